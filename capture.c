@@ -0,0 +1,494 @@
+/* Copyright (c) 2020 Wi-Fi Alliance                                                */
+
+/* Permission to use, copy, modify, and/or distribute this software for any         */
+/* purpose with or without fee is hereby granted, provided that the above           */
+/* copyright notice and this permission notice appear in all copies.                */
+
+/* THE SOFTWARE IS PROVIDED 'AS IS' AND THE AUTHOR DISCLAIMS ALL                    */
+/* WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED                    */
+/* WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL                     */
+/* THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR                       */
+/* CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING                        */
+/* FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF                       */
+/* CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT                       */
+/* OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS                          */
+/* SOFTWARE. */
+
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <net/ethernet.h>
+#include <linux/if_packet.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "vendor_specific.h"
+#include "utils.h"
+#include "capture.h"
+
+#define PCAP_MAGIC_NSEC             0xa1b23c4d
+#define PCAP_LINKTYPE_ETHERNET      1
+#define PCAP_LINKTYPE_RADIOTAP      127
+
+/* Jump targets patched once the position is known */
+#define FILTER_JUMP_PASS            0xfd    /* end of the current primitive */
+#define FILTER_JUMP_REJECT          0xfe    /* the final "ret #0" */
+
+struct pcap_file_header {
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t linktype;
+};
+
+struct pcap_record_header {
+    uint32_t ts_sec;
+    uint32_t ts_nsec;
+    uint32_t caplen;
+    uint32_t len;
+};
+
+struct capture_state {
+    int running;
+    int stop;
+    int sock;
+    int fd;
+    int write_error;
+    char ifname[32];
+    char *ring;
+    size_t ring_size;
+    unsigned int block;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    struct capture_stats stats;
+};
+
+static struct capture_state capture = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+struct capture_filter {
+    struct sock_filter *insns;
+    int count;
+    int max;
+};
+
+static int filter_emit(struct capture_filter *f, uint16_t code, uint8_t jt, uint8_t jf, uint32_t k) {
+    if (f->count >= f->max)
+        return -1;
+    f->insns[f->count].code = code;
+    f->insns[f->count].jt = jt;
+    f->insns[f->count].jf = jf;
+    f->insns[f->count].k = k;
+    f->count++;
+    return 0;
+}
+
+/* Point the FILTER_JUMP_PASS jumps of the primitive started at first to its end */
+static void filter_patch_pass(struct capture_filter *f, int first) {
+    int i;
+
+    for (i = first; i < f->count; i++) {
+        if (f->insns[i].jt == FILTER_JUMP_PASS)
+            f->insns[i].jt = f->count - i - 1;
+        if (f->insns[i].jf == FILTER_JUMP_PASS)
+            f->insns[i].jf = f->count - i - 1;
+    }
+}
+
+static int filter_ether_type(struct capture_filter *f, uint32_t type) {
+    if (filter_emit(f, BPF_LD | BPF_H | BPF_ABS, 0, 0, 12) ||
+        filter_emit(f, BPF_JMP | BPF_JEQ | BPF_K, 0, FILTER_JUMP_REJECT, type))
+        return -1;
+    return 0;
+}
+
+static int filter_ip_proto(struct capture_filter *f, uint32_t proto) {
+    if (filter_ether_type(f, ETHERTYPE_IP) ||
+        filter_emit(f, BPF_LD | BPF_B | BPF_ABS, 0, 0, 23) ||
+        filter_emit(f, BPF_JMP | BPF_JEQ | BPF_K, 0, FILTER_JUMP_REJECT, proto))
+        return -1;
+    return 0;
+}
+
+/* TCP or UDP over IPv4, first fragment, either port equals port */
+static int filter_port(struct capture_filter *f, uint32_t port) {
+    if (filter_ether_type(f, ETHERTYPE_IP) ||
+        filter_emit(f, BPF_LD | BPF_B | BPF_ABS, 0, 0, 23) ||
+        filter_emit(f, BPF_JMP | BPF_JEQ | BPF_K, 1, 0, IPPROTO_TCP) ||
+        filter_emit(f, BPF_JMP | BPF_JEQ | BPF_K, 0, FILTER_JUMP_REJECT, IPPROTO_UDP) ||
+        filter_emit(f, BPF_LD | BPF_H | BPF_ABS, 0, 0, 20) ||
+        filter_emit(f, BPF_JMP | BPF_JSET | BPF_K, FILTER_JUMP_REJECT, 0, 0x1fff) ||
+        filter_emit(f, BPF_LDX | BPF_B | BPF_MSH, 0, 0, 14) ||
+        filter_emit(f, BPF_LD | BPF_H | BPF_IND, 0, 0, 14) ||
+        filter_emit(f, BPF_JMP | BPF_JEQ | BPF_K, FILTER_JUMP_PASS, 0, port) ||
+        filter_emit(f, BPF_LD | BPF_H | BPF_IND, 0, 0, 16) ||
+        filter_emit(f, BPF_JMP | BPF_JEQ | BPF_K, FILTER_JUMP_PASS, FILTER_JUMP_REJECT, port))
+        return -1;
+    return 0;
+}
+
+/* IPv4 source or destination address */
+static int filter_host(struct capture_filter *f, uint32_t addr) {
+    if (filter_ether_type(f, ETHERTYPE_IP) ||
+        filter_emit(f, BPF_LD | BPF_W | BPF_ABS, 0, 0, 26) ||
+        filter_emit(f, BPF_JMP | BPF_JEQ | BPF_K, FILTER_JUMP_PASS, 0, addr) ||
+        filter_emit(f, BPF_LD | BPF_W | BPF_ABS, 0, 0, 30) ||
+        filter_emit(f, BPF_JMP | BPF_JEQ | BPF_K, FILTER_JUMP_PASS, FILTER_JUMP_REJECT, addr))
+        return -1;
+    return 0;
+}
+
+/* Compile the filter expression for Ethernet frames.
+ * Returns the number of instructions, 0 for an empty filter or -1.
+ */
+int capture_compile_filter(char *filter, struct sock_filter *insns, int max_insns) {
+    struct capture_filter f = { insns, 0, max_insns };
+    char buffer[256], *token, *arg, *saveptr = NULL;
+    struct in_addr addr;
+    char *end;
+    long value;
+    int first, ret, i;
+
+    snprintf(buffer, sizeof(buffer), "%s", filter ? filter : "");
+    for (token = strtok_r(buffer, " \t", &saveptr); token; token = strtok_r(NULL, " \t", &saveptr)) {
+        if (strcmp(token, "and") == 0 || strcmp(token, "&&") == 0)
+            continue;
+        first = f.count;
+        if (strcmp(token, "arp") == 0) {
+            ret = filter_ether_type(&f, ETHERTYPE_ARP);
+        } else if (strcmp(token, "ip") == 0) {
+            ret = filter_ether_type(&f, ETHERTYPE_IP);
+        } else if (strcmp(token, "ip6") == 0) {
+            ret = filter_ether_type(&f, ETHERTYPE_IPV6);
+        } else if (strcmp(token, "icmp") == 0) {
+            ret = filter_ip_proto(&f, IPPROTO_ICMP);
+        } else if (strcmp(token, "tcp") == 0) {
+            ret = filter_ip_proto(&f, IPPROTO_TCP);
+        } else if (strcmp(token, "udp") == 0) {
+            ret = filter_ip_proto(&f, IPPROTO_UDP);
+        } else if (strcmp(token, "port") == 0 || strcmp(token, "host") == 0 || strcmp(token, "ether") == 0) {
+            arg = strtok_r(NULL, " \t", &saveptr);
+            if (arg && strcmp(token, "ether") == 0) {
+                if (strcmp(arg, "proto"))
+                    goto syntax;
+                arg = strtok_r(NULL, " \t", &saveptr);
+            }
+            if (arg == NULL)
+                goto syntax;
+            if (strcmp(token, "host") == 0) {
+                if (inet_pton(AF_INET, arg, &addr) != 1)
+                    goto syntax;
+                ret = filter_host(&f, ntohl(addr.s_addr));
+            } else {
+                value = strtol(arg, &end, 0);
+                if (*end || value < 0 || value > 0xffff)
+                    goto syntax;
+                ret = strcmp(token, "port") == 0 ? filter_port(&f, value) : filter_ether_type(&f, value);
+            }
+        } else {
+            goto syntax;
+        }
+        if (ret) {
+            indigo_logger(LOG_LEVEL_ERROR, "Capture filter is too long: %s", filter);
+            return -1;
+        }
+        filter_patch_pass(&f, first);
+    }
+    if (f.count == 0)
+        return 0;
+
+    /* Accept, then the reject target */
+    if (filter_emit(&f, BPF_RET | BPF_K, 0, 0, CAPTURE_SNAPLEN) ||
+        filter_emit(&f, BPF_RET | BPF_K, 0, 0, 0)) {
+        indigo_logger(LOG_LEVEL_ERROR, "Capture filter is too long: %s", filter);
+        return -1;
+    }
+    for (i = 0; i < f.count; i++) {
+        if (f.count - i - 2 > 0xff) {
+            indigo_logger(LOG_LEVEL_ERROR, "Capture filter is too long: %s", filter);
+            return -1;
+        }
+        if (insns[i].jt == FILTER_JUMP_REJECT)
+            insns[i].jt = f.count - i - 2;
+        if (insns[i].jf == FILTER_JUMP_REJECT)
+            insns[i].jf = f.count - i - 2;
+    }
+
+    return f.count;
+syntax:
+    indigo_logger(LOG_LEVEL_ERROR, "Unsupported capture filter: %s", filter);
+    return -1;
+}
+
+/* Write every frame of a retired block with as few writev() calls as possible */
+static void capture_write_block(struct tpacket_block_desc *block) {
+    struct pcap_record_header records[CAPTURE_WRITE_BATCH];
+    struct iovec iov[CAPTURE_WRITE_BATCH * 2];
+    struct tpacket3_hdr *hdr;
+    unsigned int i, n = 0, packets, total = 0;
+    unsigned long long written = 0;
+    ssize_t expected = 0;
+
+    packets = block->hdr.bh1.num_pkts;
+    hdr = (struct tpacket3_hdr *)((char *)block + block->hdr.bh1.offset_to_first_pkt);
+    for (i = 0; i < packets; i++) {
+        records[n].ts_sec = hdr->tp_sec;
+        records[n].ts_nsec = hdr->tp_nsec;
+        records[n].caplen = hdr->tp_snaplen;
+        records[n].len = hdr->tp_len;
+        iov[n * 2].iov_base = &records[n];
+        iov[n * 2].iov_len = sizeof(records[n]);
+        iov[n * 2 + 1].iov_base = (char *)hdr + hdr->tp_mac;
+        iov[n * 2 + 1].iov_len = hdr->tp_snaplen;
+        expected += sizeof(records[n]) + hdr->tp_snaplen;
+        n++;
+
+        if (n == CAPTURE_WRITE_BATCH || i == packets - 1) {
+            if (!capture.write_error) {
+                if (writev(capture.fd, iov, n * 2) != expected) {
+                    indigo_logger(LOG_LEVEL_ERROR, "Failed to write the capture file (%s)", strerror(errno));
+                    capture.write_error = 1;
+                } else {
+                    total += n;
+                    written += expected - n * sizeof(records[0]);
+                }
+            }
+            n = 0;
+            expected = 0;
+        }
+        hdr = (struct tpacket3_hdr *)((char *)hdr + hdr->tp_next_offset);
+    }
+
+    pthread_mutex_lock(&capture.lock);
+    capture.stats.packets += total;
+    capture.stats.bytes += written;
+    capture.stats.blocks++;
+    pthread_mutex_unlock(&capture.lock);
+}
+
+static void* capture_thread(void *arg) {
+    struct tpacket_block_desc *block;
+    struct pollfd pfd;
+    uint64_t drain_ns = 0;
+
+    (void)arg;
+
+    pfd.fd = capture.sock;
+    pfd.events = POLLIN | POLLERR;
+    while (1) {
+        block = (struct tpacket_block_desc *)(capture.ring + capture.block * CAPTURE_BLOCK_SIZE);
+        if (!(__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER)) {
+            /* On stop, give the kernel one retire timeout to close the
+             * partly filled block so the file ends with the last frames.
+             */
+            if (__atomic_load_n(&capture.stop, __ATOMIC_ACQUIRE)) {
+                if (drain_ns == 0)
+                    drain_ns = traffic_now_ns() + 2ULL * CAPTURE_BLOCK_TIMEOUT_MS * 1000000;
+                else if (traffic_now_ns() >= drain_ns)
+                    break;
+            }
+            poll(&pfd, 1, CAPTURE_BLOCK_TIMEOUT_MS);
+            continue;
+        }
+        capture_write_block(block);
+        __atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+        capture.block = (capture.block + 1) % CAPTURE_BLOCK_COUNT;
+    }
+
+    return NULL;
+}
+
+static void capture_update_drops() {
+    struct tpacket_stats_v3 kstats;
+    socklen_t len = sizeof(kstats);
+
+    /* The kernel counters are reset on every read */
+    if (getsockopt(capture.sock, SOL_PACKET, PACKET_STATISTICS, &kstats, &len) == 0) {
+        pthread_mutex_lock(&capture.lock);
+        capture.stats.dropped += kstats.tp_drops;
+        pthread_mutex_unlock(&capture.lock);
+    }
+}
+
+static void capture_close() {
+    if (capture.ring && capture.ring != MAP_FAILED)
+        munmap(capture.ring, capture.ring_size);
+    capture.ring = NULL;
+    if (capture.sock >= 0)
+        close(capture.sock);
+    capture.sock = -1;
+    if (capture.fd >= 0)
+        close(capture.fd);
+    capture.fd = -1;
+}
+
+/* Start capturing on ifname into path. filter may be NULL */
+int capture_start(char *ifname, char *filter, char *path) {
+    struct sock_filter insns[CAPTURE_FILTER_MAX_INSNS];
+    struct sock_fprog prog;
+    struct tpacket_req3 req;
+    struct pcap_file_header file_header;
+    struct sockaddr_ll addr;
+    struct ifreq ifr;
+    int version = TPACKET_V3, count, linktype;
+
+    if (capture.running)
+        capture_stop(NULL);
+
+    count = capture_compile_filter(filter, insns, CAPTURE_FILTER_MAX_INSNS);
+    if (count < 0)
+        return -1;
+
+    capture.fd = -1;
+    capture.ring = NULL;
+    capture.write_error = 0;
+    capture.block = 0;
+    snprintf(capture.ifname, sizeof(capture.ifname), "%s", ifname);
+    capture.sock = socket(AF_PACKET, SOCK_RAW | SOCK_CLOEXEC, htons(ETH_P_ALL));
+    if (capture.sock < 0) {
+        indigo_logger(LOG_LEVEL_ERROR, "Failed to open capture socket (%s)", strerror(errno));
+        return -1;
+    }
+
+    memset(&ifr, 0, sizeof(ifr));
+    snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", ifname);
+    if (ioctl(capture.sock, SIOCGIFINDEX, &ifr) < 0) {
+        indigo_logger(LOG_LEVEL_ERROR, "Failed to get the index of %s (%s)", ifname, strerror(errno));
+        goto fail;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sll_family = AF_PACKET;
+    addr.sll_protocol = htons(ETH_P_ALL);
+    addr.sll_ifindex = ifr.ifr_ifindex;
+    linktype = PCAP_LINKTYPE_ETHERNET;
+    if (ioctl(capture.sock, SIOCGIFHWADDR, &ifr) == 0 && ifr.ifr_hwaddr.sa_family == ARPHRD_IEEE80211_RADIOTAP)
+        linktype = PCAP_LINKTYPE_RADIOTAP;
+    if (count > 0 && linktype != PCAP_LINKTYPE_ETHERNET) {
+        indigo_logger(LOG_LEVEL_ERROR, "Capture filters need an Ethernet interface, %s is not", ifname);
+        goto fail;
+    }
+
+    /* Attach the filter before binding so no unfiltered frame gets in */
+    if (count > 0) {
+        prog.len = count;
+        prog.filter = insns;
+        if (setsockopt(capture.sock, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0) {
+            indigo_logger(LOG_LEVEL_ERROR, "Failed to attach capture filter (%s)", strerror(errno));
+            goto fail;
+        }
+    }
+    if (setsockopt(capture.sock, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) {
+        indigo_logger(LOG_LEVEL_ERROR, "TPACKET_V3 is not supported (%s)", strerror(errno));
+        goto fail;
+    }
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = CAPTURE_BLOCK_SIZE;
+    req.tp_block_nr = CAPTURE_BLOCK_COUNT;
+    req.tp_frame_size = CAPTURE_FRAME_SIZE;
+    req.tp_frame_nr = CAPTURE_BLOCK_SIZE / CAPTURE_FRAME_SIZE * CAPTURE_BLOCK_COUNT;
+    req.tp_retire_blk_tov = CAPTURE_BLOCK_TIMEOUT_MS;
+    if (setsockopt(capture.sock, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0) {
+        indigo_logger(LOG_LEVEL_ERROR, "Failed to set up the capture ring (%s)", strerror(errno));
+        goto fail;
+    }
+    capture.ring_size = (size_t)CAPTURE_BLOCK_SIZE * CAPTURE_BLOCK_COUNT;
+    capture.ring = mmap(NULL, capture.ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED, capture.sock, 0);
+    if (capture.ring == MAP_FAILED) {
+        /* MAP_LOCKED needs RLIMIT_MEMLOCK, retry without it */
+        capture.ring = mmap(NULL, capture.ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, capture.sock, 0);
+        if (capture.ring == MAP_FAILED) {
+            indigo_logger(LOG_LEVEL_ERROR, "Failed to map the capture ring (%s)", strerror(errno));
+            goto fail;
+        }
+    }
+    if (bind(capture.sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        indigo_logger(LOG_LEVEL_ERROR, "Failed to bind capture socket to %s (%s)", ifname, strerror(errno));
+        goto fail;
+    }
+
+    capture.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (capture.fd < 0) {
+        indigo_logger(LOG_LEVEL_ERROR, "Failed to open capture file %s (%s)", path, strerror(errno));
+        goto fail;
+    }
+    memset(&file_header, 0, sizeof(file_header));
+    file_header.magic = PCAP_MAGIC_NSEC;
+    file_header.version_major = 2;
+    file_header.version_minor = 4;
+    file_header.snaplen = CAPTURE_SNAPLEN;
+    file_header.linktype = linktype;
+    if (write(capture.fd, &file_header, sizeof(file_header)) != sizeof(file_header)) {
+        indigo_logger(LOG_LEVEL_ERROR, "Failed to write capture file %s (%s)", path, strerror(errno));
+        goto fail;
+    }
+
+    pthread_mutex_lock(&capture.lock);
+    memset(&capture.stats, 0, sizeof(capture.stats));
+    pthread_mutex_unlock(&capture.lock);
+    __atomic_store_n(&capture.stop, 0, __ATOMIC_RELEASE);
+    if (pthread_create(&capture.thread, NULL, capture_thread, NULL)) {
+        indigo_logger(LOG_LEVEL_ERROR, "Failed to create the capture thread");
+        goto fail;
+    }
+    capture.running = 1;
+    indigo_logger(LOG_LEVEL_INFO, "Capture starts on %s filter \"%s\" file %s", ifname, filter ? filter : "", path);
+
+    return 0;
+fail:
+    capture_close();
+    return -1;
+}
+
+/* Stop the capture, flush the ring to the file and report the counters */
+int capture_stop(struct capture_stats *stats) {
+    struct capture_stats result;
+
+    if (!capture.running) {
+        if (stats)
+            capture_get_stats(stats);
+        return 0;
+    }
+
+    __atomic_store_n(&capture.stop, 1, __ATOMIC_RELEASE);
+    pthread_join(capture.thread, NULL);
+    capture_update_drops();
+    capture_close();
+    capture.running = 0;
+
+    capture_get_stats(&result);
+    indigo_logger(LOG_LEVEL_INFO, "Capture stops on %s: packets %u bytes %llu dropped %u blocks %u",
+                  capture.ifname, result.packets, result.bytes, result.dropped, result.blocks);
+    if (stats)
+        memcpy(stats, &result, sizeof(result));
+
+    return result.packets;
+}
+
+int capture_is_running() {
+    return capture.running;
+}
+
+void capture_get_stats(struct capture_stats *stats) {
+    if (capture.running)
+        capture_update_drops();
+    pthread_mutex_lock(&capture.lock);
+    memcpy(stats, &capture.stats, sizeof(*stats));
+    pthread_mutex_unlock(&capture.lock);
+}
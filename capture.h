@@ -0,0 +1,57 @@
+/* Copyright (c) 2020 Wi-Fi Alliance                                                */
+
+/* Permission to use, copy, modify, and/or distribute this software for any         */
+/* purpose with or without fee is hereby granted, provided that the above           */
+/* copyright notice and this permission notice appear in all copies.                */
+
+/* THE SOFTWARE IS PROVIDED 'AS IS' AND THE AUTHOR DISCLAIMS ALL                    */
+/* WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED                    */
+/* WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL                     */
+/* THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR                       */
+/* CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING                        */
+/* FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF                       */
+/* CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT                       */
+/* OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS                          */
+/* SOFTWARE. */
+
+
+#ifndef _INDIGO_CAPTURE_
+#define _INDIGO_CAPTURE_  1
+
+#include <stdint.h>
+#include <linux/filter.h>
+
+/* In-app packet capture.
+ * Frames are received through an mmap'd TPACKET_V3 ring on an AF_PACKET
+ * socket. The kernel runs the compiled BPF filter and fills whole blocks, so
+ * the capture thread wakes up once per block and hands the frames of a block
+ * to writev() straight from the ring. Memory use is bounded by the ring.
+ * The capture file is in pcap format with nanosecond timestamps.
+ *
+ * The filter is a small subset of the pcap filter language. Primitives are
+ * ANDed together:
+ *     arp | ip | ip6 | icmp | tcp | udp | port N | host A.B.C.D | ether proto N
+ * e.g. "udp port 5000 and host 192.168.1.1". An empty filter captures all.
+ */
+
+#define CAPTURE_BLOCK_SIZE          (1 << 17)
+#define CAPTURE_BLOCK_COUNT         8
+#define CAPTURE_FRAME_SIZE          2048
+#define CAPTURE_BLOCK_TIMEOUT_MS    100
+#define CAPTURE_SNAPLEN             65535
+#define CAPTURE_FILTER_MAX_INSNS    128
+#define CAPTURE_WRITE_BATCH         256
+
+struct capture_stats {
+    unsigned int packets;       /* frames written to the file */
+    unsigned long long bytes;
+    unsigned int dropped;       /* frames dropped by the kernel, ring full */
+    unsigned int blocks;
+};
+
+int capture_start(char *ifname, char *filter, char *path);
+int capture_stop(struct capture_stats *stats);
+int capture_is_running();
+void capture_get_stats(struct capture_stats *stats);
+int capture_compile_filter(char *filter, struct sock_filter *insns, int max_insns);
+#endif /* _INDIGO_CAPTURE_ */
@@ -0,0 +1,323 @@
+/* Copyright (c) 2020 Wi-Fi Alliance                                                */
+
+/* Permission to use, copy, modify, and/or distribute this software for any         */
+/* purpose with or without fee is hereby granted, provided that the above           */
+/* copyright notice and this permission notice appear in all copies.                */
+
+/* THE SOFTWARE IS PROVIDED 'AS IS' AND THE AUTHOR DISCLAIMS ALL                    */
+/* WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED                    */
+/* WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL                     */
+/* THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR                       */
+/* CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING                        */
+/* FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF                       */
+/* CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT                       */
+/* OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS                          */
+/* SOFTWARE. */
+
+
+/* Microbenchmark of the message codec: parse_packet, assemble_packet and the TLV helpers.
+ *
+ * Each case runs for -t ms per round and reports the median of -r rounds. The
+ * allocations are counted by the malloc and free wrappers linked with
+ * -Wl,--wrap=malloc,--wrap=free, so they include the ones of indigo_logger. The
+ * logger is called as in the app but prints nothing.
+ *
+ * -f json prints one object per case with the architecture and the compiler, to
+ * compare the builds of the laptop and OpenWrt toolchains.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/utsname.h>
+
+#include "vendor_specific.h"
+#include "indigo_api.h"
+#include "indigo_packet.h"
+#include "utils.h"
+
+#define BENCH_DEFAULT_TIME_MS     200
+#define BENCH_DEFAULT_ROUNDS      5
+#define BENCH_MAX_ROUNDS          32
+#define BENCH_CONFIGURE_AP_TLVS   40
+
+extern int stdout_level;
+
+/* Message and its TLVs in the wire format */
+struct bench_corpus {
+    char packet[BUFFER_LEN];
+    size_t packet_len;
+    struct packet_wrapper wrapper;
+};
+
+struct bench_case {
+    const char *name;
+    size_t (*fn)(struct bench_corpus *corpus);
+    struct bench_corpus *corpus;
+};
+
+struct bench_result {
+    unsigned long long iterations;
+    double ns_op;
+    double allocs_op;
+    double frees_op;
+    double bytes_op;
+};
+
+static unsigned long long bench_allocs, bench_frees, bench_alloc_bytes;
+static volatile size_t bench_sink;
+static struct bench_corpus small_corpus, configure_ap_corpus, max_corpus, ack_corpus;
+
+void *__real_malloc(size_t size);
+void __real_free(void *ptr);
+
+void *__wrap_malloc(size_t size) {
+    bench_allocs++;
+    bench_alloc_bytes += size;
+    return __real_malloc(size);
+}
+
+void __wrap_free(void *ptr) {
+    if (ptr)
+        bench_frees++;
+    __real_free(ptr);
+}
+
+static unsigned long long bench_now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Build the packet from the header and the TLVs of the corpus wrapper */
+static void corpus_add_tlv(struct bench_corpus *corpus, int id, size_t len, const char *value) {
+    struct packet_wrapper *wrapper = &corpus->wrapper;
+
+    wrapper->tlv[wrapper->tlv_num] = malloc(sizeof(struct tlv_hdr));
+    add_wrapper_tlv(wrapper, id, len, (char *)value);
+}
+
+static void corpus_add_str(struct bench_corpus *corpus, int id, const char *value) {
+    corpus_add_tlv(corpus, id, strlen(value), value);
+}
+
+static void corpus_finish(struct bench_corpus *corpus) {
+    corpus->packet_len = assemble_packet(corpus->packet, sizeof(corpus->packet), &corpus->wrapper);
+}
+
+static void build_corpora(void) {
+    static const char *configure_ap[BENCH_CONFIGURE_AP_TLVS] = {
+        "QuickTrack-AP-5G", "36", "0123456789", "1", "0", "1", "1", "1", "US", "1",
+        "2", "SAE", "CCMP", "12345678", "CCMP", "[HT40+][SHORT-GI-20][SHORT-GI-40]", "1", "2", "1",
+        "[MAX-MPDU-11454][RXLDPC][SHORT-GI-80][TX-STBC-2BY1]", "0", "0", "10.0.0.1", "1812",
+        "shared-secret", "wlan0", "wlan1", "5180", "1", "a", "42", "0", "1", "115", "DD0A506F9A0902020025080000",
+        "hotspot.example.com", "user@example.com", "1", "1", "02:00:00:00:00:01"
+    };
+    char value[TLV_VALUE_SIZE];
+    size_t remain;
+    int i;
+
+    /* Request of one TLV, answered with the ACK below */
+    fill_wrapper_message_hdr(&small_corpus.wrapper, API_DEVICE_RESET, 1);
+    corpus_add_str(&small_corpus, TLV_ROLE, "1");
+    corpus_finish(&small_corpus);
+
+    fill_wrapper_ack(&ack_corpus.wrapper, 1, TLV_VALUE_STATUS_OK, TLV_VALUE_OK);
+    corpus_finish(&ack_corpus);
+
+    /* AP configuration with the TLVs 0x0001 to 0x0028 */
+    fill_wrapper_message_hdr(&configure_ap_corpus.wrapper, API_AP_START_UP, 2);
+    for (i = 0; i < BENCH_CONFIGURE_AP_TLVS; i++)
+        corpus_add_str(&configure_ap_corpus, TLV_SSID + i, configure_ap[i]);
+    corpus_finish(&configure_ap_corpus);
+
+    /* Packet filling the receive buffer of the app with values of the maximum length */
+    fill_wrapper_message_hdr(&max_corpus.wrapper, API_AP_START_UP, 3);
+    memset(value, 'x', sizeof(value));
+    remain = BUFFER_LEN - sizeof(struct message_hdr);
+    while (remain > 3) {
+        corpus_add_tlv(&max_corpus, TLV_IE_OVERRIDE, remain - 3 > 255 ? 255 : remain - 3, value);
+        remain -= max_corpus.wrapper.tlv[max_corpus.wrapper.tlv_num - 1]->len + 3;
+    }
+    corpus_finish(&max_corpus);
+}
+
+static size_t bench_parse(struct bench_corpus *corpus) {
+    struct packet_wrapper req;
+    size_t tlv_num;
+
+    memset(&req, 0, sizeof(req));
+    parse_packet(&req, corpus->packet, corpus->packet_len);
+    tlv_num = req.tlv_num;
+    free_packet_wrapper(&req);
+    return tlv_num;
+}
+
+static size_t bench_assemble(struct bench_corpus *corpus) {
+    struct packet_wrapper resp;
+    char buffer[BUFFER_LEN];
+    size_t i, len;
+
+    memset(&resp, 0, sizeof(resp));
+    fill_wrapper_message_hdr(&resp, corpus->wrapper.hdr.type, corpus->wrapper.hdr.seq);
+    for (i = 0; i < corpus->wrapper.tlv_num; i++)
+        fill_wrapper_tlv_bytes(&resp, corpus->wrapper.tlv[i]->id, corpus->wrapper.tlv[i]->len, corpus->wrapper.tlv[i]->value);
+    len = assemble_packet(buffer, sizeof(buffer), &resp);
+    free_packet_wrapper(&resp);
+    return len;
+}
+
+static size_t bench_ack(struct bench_corpus *corpus) {
+    struct packet_wrapper resp;
+    char buffer[BUFFER_LEN];
+    size_t len;
+
+    (void) corpus;
+    memset(&resp, 0, sizeof(resp));
+    fill_wrapper_ack(&resp, 1, TLV_VALUE_STATUS_OK, TLV_VALUE_OK);
+    len = assemble_packet(buffer, sizeof(buffer), &resp);
+    free_packet_wrapper(&resp);
+    return len;
+}
+
+/* First TLV of the packet, after the message header */
+static size_t bench_parse_tlv(struct bench_corpus *corpus) {
+    struct tlv_hdr tlv;
+    int len;
+
+    len = parse_tlv(&tlv, corpus->packet + sizeof(struct message_hdr), corpus->packet_len - sizeof(struct message_hdr));
+    free(tlv.value);
+    return len;
+}
+
+static size_t bench_gen_tlv(struct bench_corpus *corpus) {
+    char buffer[BUFFER_LEN];
+
+    return gen_tlv(buffer, sizeof(buffer), corpus->wrapper.tlv[0]);
+}
+
+static const struct bench_case bench_cases[] = {
+    { "parse_packet/small", bench_parse, &small_corpus },
+    { "parse_packet/configure_ap", bench_parse, &configure_ap_corpus },
+    { "parse_packet/max", bench_parse, &max_corpus },
+    { "assemble_packet/ack", bench_ack, &ack_corpus },
+    { "assemble_packet/configure_ap", bench_assemble, &configure_ap_corpus },
+    { "assemble_packet/max", bench_assemble, &max_corpus },
+    { "parse_tlv/small", bench_parse_tlv, &small_corpus },
+    { "parse_tlv/max", bench_parse_tlv, &max_corpus },
+    { "gen_tlv/small", bench_gen_tlv, &small_corpus },
+    { "gen_tlv/max", bench_gen_tlv, &max_corpus },
+};
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+static void run_case(const struct bench_case *c, int time_ms, int rounds, struct bench_result *result) {
+    double ns[BENCH_MAX_ROUNDS];
+    unsigned long long iterations = 1, i, start, elapsed;
+    unsigned long long allocs, frees, bytes;
+    int r;
+
+    /* Double the iterations until a round takes a tenth of the time, then scale */
+    for (;;) {
+        start = bench_now_ns();
+        for (i = 0; i < iterations; i++)
+            bench_sink += c->fn(c->corpus);
+        elapsed = bench_now_ns() - start;
+        if (elapsed >= time_ms * 100000ULL)
+            break;
+        iterations *= 2;
+    }
+    iterations = iterations * (time_ms * 1000000ULL) / (elapsed ? elapsed : 1);
+    if (iterations == 0)
+        iterations = 1;
+
+    allocs = bench_allocs;
+    frees = bench_frees;
+    bytes = bench_alloc_bytes;
+    for (r = 0; r < rounds; r++) {
+        start = bench_now_ns();
+        for (i = 0; i < iterations; i++)
+            bench_sink += c->fn(c->corpus);
+        ns[r] = (double)(bench_now_ns() - start) / iterations;
+    }
+    qsort(ns, rounds, sizeof(ns[0]), compare_double);
+
+    result->iterations = iterations;
+    result->ns_op = ns[rounds / 2];
+    result->allocs_op = (double)(bench_allocs - allocs) / (iterations * rounds);
+    result->frees_op = (double)(bench_frees - frees) / (iterations * rounds);
+    result->bytes_op = (double)(bench_alloc_bytes - bytes) / (iterations * rounds);
+}
+
+static void usage(char *name) {
+    printf("usage: %s [-t <ms per round>] [-r <rounds>] [-b <case filter>] [-f text|json]\n", name);
+}
+
+int main(int argc, char *argv[]) {
+    struct bench_result result;
+    struct utsname uts;
+    const char *filter = NULL;
+    int c, json = 0, time_ms = BENCH_DEFAULT_TIME_MS, rounds = BENCH_DEFAULT_ROUNDS;
+    size_t i;
+
+    while ((c = getopt(argc, argv, "t:r:b:f:h")) != -1) {
+        switch (c) {
+        case 't':
+            time_ms = atoi(optarg);
+            break;
+        case 'r':
+            rounds = atoi(optarg);
+            break;
+        case 'b':
+            filter = optarg;
+            break;
+        case 'f':
+            json = strcmp(optarg, "json") == 0;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (time_ms <= 0 || rounds <= 0 || rounds > BENCH_MAX_ROUNDS) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (uname(&uts))
+        snprintf(uts.machine, sizeof(uts.machine), "unknown");
+
+    stdout_level = LOG_LEVEL_ERROR + 1;
+    build_corpora();
+
+    if (!json) {
+        printf("%s, %s, %d rounds of %d ms\n", uts.machine, __VERSION__, rounds, time_ms);
+        printf("%-30s %12s %10s %10s %10s\n", "case", "iterations", "ns/op", "allocs/op", "bytes/op");
+    }
+    for (i = 0; i < sizeof(bench_cases) / sizeof(bench_cases[0]); i++) {
+        if (filter && strstr(bench_cases[i].name, filter) == NULL)
+            continue;
+        run_case(&bench_cases[i], time_ms, rounds, &result);
+        if (json) {
+            printf("{\"case\": \"%s\", \"arch\": \"%s\", \"compiler\": \"%s\", \"iterations\": %llu, "
+                "\"ns_op\": %.1f, \"allocs_op\": %.2f, \"frees_op\": %.2f, \"bytes_op\": %.1f}\n",
+                bench_cases[i].name, uts.machine, __VERSION__, result.iterations,
+                result.ns_op, result.allocs_op, result.frees_op, result.bytes_op);
+        } else {
+            printf("%-30s %12llu %10.1f %10.2f %10.1f\n", bench_cases[i].name, result.iterations,
+                result.ns_op, result.allocs_op, result.bytes_op);
+        }
+        /* Every case frees what it allocates */
+        if (result.allocs_op != result.frees_op)
+            fprintf(stderr, "%s: %.2f allocations and %.2f frees per operation\n",
+                bench_cases[i].name, result.allocs_op, result.frees_op);
+    }
+
+    return 0;
+}
@@ -29,6 +29,15 @@
 #include "sys/select.h"
 #endif
 
+#if defined(__linux__) && !defined(CONFIG_ZEPHYR)
+#define ELOOP_WAKEUP
+#define ELOOP_STATS
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#endif /* __linux__ && !CONFIG_ZEPHYR */
+
 #ifdef CONFIG_NATIVE_WINDOWS
 #include "common.h"
 #endif /* CONFIG_NATIVE_WINDOWS */
@@ -89,6 +98,30 @@ struct eloop_signal {
 	int signaled;
 };
 
+struct eloop_post {
+	void *eloop_data;
+	void *user_data;
+	void (*handler)(void *eloop_ctx, void *user_ctx);
+	unsigned long long posted_ns;
+	struct eloop_post *next;
+};
+
+#ifdef ELOOP_STATS
+#define ELOOP_STATS_MAX 32
+#define ELOOP_NAMES_MAX 16
+
+struct eloop_handler_name {
+	eloop_handler_fn handler;
+	const char *name;
+};
+
+struct eloop_stats_entry {
+	int kind;
+	eloop_handler_fn handler;
+	struct eloop_handler_stats stats;
+};
+#endif /* ELOOP_STATS */
+
 struct eloop_data {
 	void *user_data;
 
@@ -103,6 +136,25 @@ struct eloop_data {
 	int pending_terminate;
 
 	int terminate;
+
+#ifdef ELOOP_WAKEUP
+	/* Written by signal handlers and qt_eloop_post() to wake select() */
+	int wakeup_fd;
+	pthread_mutex_t post_lock;
+	struct eloop_post *post_head, *post_tail;
+#endif /* ELOOP_WAKEUP */
+
+#ifdef ELOOP_STATS
+	int stats_count;
+	struct eloop_stats_entry stats[ELOOP_STATS_MAX];
+	int name_count;
+	struct eloop_handler_name names[ELOOP_NAMES_MAX];
+	unsigned long long stall_ns;
+	void (*stall_handler)(const char *name, const char *tag,
+			      unsigned int elapsed_ms);
+	/* What the running callback is working on, reported with stalls */
+	const char *stall_tag;
+#endif /* ELOOP_STATS */
 };
 
 static struct eloop_data eloop;
@@ -112,6 +164,284 @@ void qt_eloop_init(void *user_data)
 {
 	memset(&eloop, 0, sizeof(eloop));
 	eloop.user_data = user_data;
+#ifdef ELOOP_WAKEUP
+	pthread_mutex_init(&eloop.post_lock, NULL);
+	eloop.wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (eloop.wakeup_fd < 0)
+		perror("eventfd");
+#endif /* ELOOP_WAKEUP */
+}
+
+
+#ifdef ELOOP_STATS
+static unsigned long long eloop_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static struct eloop_stats_entry * eloop_get_stats_entry(int kind,
+							eloop_handler_fn fn)
+{
+	struct eloop_stats_entry *entry;
+	int i;
+
+	for (i = 0; i < eloop.stats_count; i++) {
+		if (eloop.stats[i].handler == fn &&
+		    eloop.stats[i].kind == kind)
+			return &eloop.stats[i];
+	}
+	if (eloop.stats_count == ELOOP_STATS_MAX)
+		return NULL;
+	entry = &eloop.stats[eloop.stats_count++];
+	memset(entry, 0, sizeof(*entry));
+	entry->kind = kind;
+	entry->handler = fn;
+	entry->stats.kind = kind;
+	for (i = 0; i < eloop.name_count; i++) {
+		if (eloop.names[i].handler == fn)
+			entry->stats.name = eloop.names[i].name;
+	}
+	return entry;
+}
+
+
+/* Bucket i counts durations in [2^i, 2^(i+1)) usec, bucket 0 also < 1 usec */
+static int eloop_hist_bucket(unsigned long long ns)
+{
+	unsigned long long us = ns / 1000;
+	int bucket = 0;
+
+	while (us > 1 && bucket < ELOOP_HIST_BUCKETS - 1) {
+		us >>= 1;
+		bucket++;
+	}
+	return bucket;
+}
+
+
+/* Account one callback which started at start_ns. late_ns is how long it
+ * waited past its deadline (timeouts) or in the queue (posts). */
+static void eloop_account(int kind, eloop_handler_fn fn,
+			  unsigned long long start_ns, unsigned long long late_ns)
+{
+	struct eloop_stats_entry *entry;
+	struct eloop_handler_stats *stats;
+	unsigned long long elapsed_ns = eloop_now_ns() - start_ns;
+	const char *tag = eloop.stall_tag;
+
+	eloop.stall_tag = NULL;
+	entry = eloop_get_stats_entry(kind, fn);
+	if (entry == NULL)
+		return;
+	stats = &entry->stats;
+	stats->count++;
+	stats->total_ns += elapsed_ns;
+	if (elapsed_ns > stats->max_ns)
+		stats->max_ns = elapsed_ns;
+	stats->hist[eloop_hist_bucket(elapsed_ns)]++;
+	if (kind == ELOOP_KIND_TIMEOUT || kind == ELOOP_KIND_POST) {
+		stats->late_total_ns += late_ns;
+		if (late_ns > stats->late_max_ns)
+			stats->late_max_ns = late_ns;
+		stats->late_hist[eloop_hist_bucket(late_ns)]++;
+	}
+
+	if (eloop.stall_ns && elapsed_ns >= eloop.stall_ns) {
+		stats->stalls++;
+		if (eloop.stall_handler)
+			eloop.stall_handler(stats->name, tag,
+					    elapsed_ns / 1000000);
+	}
+}
+#else /* ELOOP_STATS */
+#define eloop_now_ns() 0ULL
+#define eloop_account(kind, fn, start_ns, late_ns) \
+	do { (void) (fn); (void) (start_ns); (void) (late_ns); } while (0)
+#endif /* ELOOP_STATS */
+
+
+/* Timeouts run on the monotonic clock where it is available so that they
+ * are not affected by wall clock changes */
+static void eloop_get_time(struct timeval *tv)
+{
+#ifdef ELOOP_STATS
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	tv->tv_sec = ts.tv_sec;
+	tv->tv_usec = ts.tv_nsec / 1000;
+#else /* ELOOP_STATS */
+	gettimeofday(tv, NULL);
+#endif /* ELOOP_STATS */
+}
+
+
+void qt_eloop_set_handler_name(eloop_handler_fn handler, const char *name)
+{
+#ifdef ELOOP_STATS
+	int i;
+
+	for (i = 0; i < eloop.name_count; i++) {
+		if (eloop.names[i].handler == handler)
+			break;
+	}
+	if (i == ELOOP_NAMES_MAX)
+		return;
+	if (i == eloop.name_count)
+		eloop.name_count++;
+	eloop.names[i].handler = handler;
+	eloop.names[i].name = name;
+
+	/* The same function may already run as several kinds of callback */
+	for (i = 0; i < eloop.stats_count; i++) {
+		if (eloop.stats[i].handler == handler)
+			eloop.stats[i].stats.name = name;
+	}
+#else /* ELOOP_STATS */
+	(void) handler;
+	(void) name;
+#endif /* ELOOP_STATS */
+}
+
+
+void qt_eloop_set_stall_handler(unsigned int threshold_ms,
+				void (*handler)(const char *name,
+						const char *tag,
+						unsigned int elapsed_ms))
+{
+#ifdef ELOOP_STATS
+	eloop.stall_ns = (unsigned long long) threshold_ms * 1000000ULL;
+	eloop.stall_handler = handler;
+#else /* ELOOP_STATS */
+	(void) threshold_ms;
+	(void) handler;
+#endif /* ELOOP_STATS */
+}
+
+
+void qt_eloop_set_stall_tag(const char *tag)
+{
+#ifdef ELOOP_STATS
+	eloop.stall_tag = tag;
+#else /* ELOOP_STATS */
+	(void) tag;
+#endif /* ELOOP_STATS */
+}
+
+
+int qt_eloop_get_stats(struct eloop_handler_stats *stats, int max)
+{
+#ifdef ELOOP_STATS
+	int i, count = 0;
+
+	for (i = 0; i < eloop.stats_count && count < max; i++)
+		stats[count++] = eloop.stats[i].stats;
+	return count;
+#else /* ELOOP_STATS */
+	(void) stats;
+	(void) max;
+	return 0;
+#endif /* ELOOP_STATS */
+}
+
+
+void qt_eloop_reset_stats(void)
+{
+#ifdef ELOOP_STATS
+	int i;
+
+	for (i = 0; i < eloop.stats_count; i++) {
+		const char *name = eloop.stats[i].stats.name;
+
+		memset(&eloop.stats[i].stats, 0, sizeof(eloop.stats[i].stats));
+		eloop.stats[i].stats.kind = eloop.stats[i].kind;
+		eloop.stats[i].stats.name = name;
+	}
+#endif /* ELOOP_STATS */
+}
+
+
+#ifdef ELOOP_WAKEUP
+static void eloop_wakeup(void)
+{
+	uint64_t one = 1;
+	int saved_errno = errno;
+
+	/* eventfd write is async-signal-safe. EAGAIN only means the counter
+	 * is already non-zero, so the loop is going to wake up anyway. */
+	if (eloop.wakeup_fd >= 0 &&
+	    write(eloop.wakeup_fd, &one, sizeof(one)) < 0) {
+		/* nothing else can be done from a signal handler */
+	}
+	errno = saved_errno;
+}
+
+
+static void eloop_process_posts(void)
+{
+	struct eloop_post *post, *next;
+	unsigned long long start_ns;
+	uint64_t count;
+
+	if (read(eloop.wakeup_fd, &count, sizeof(count)) < 0 &&
+	    errno != EAGAIN)
+		return;
+
+	pthread_mutex_lock(&eloop.post_lock);
+	post = eloop.post_head;
+	eloop.post_head = eloop.post_tail = NULL;
+	pthread_mutex_unlock(&eloop.post_lock);
+
+	while (post != NULL) {
+		next = post->next;
+		start_ns = eloop_now_ns();
+		post->handler(post->eloop_data, post->user_data);
+		eloop_account(ELOOP_KIND_POST, (eloop_handler_fn) post->handler,
+			      start_ns, start_ns - post->posted_ns);
+		free(post);
+		post = next;
+	}
+}
+#endif /* ELOOP_WAKEUP */
+
+
+int qt_eloop_post(void (*handler)(void *eloop_ctx, void *user_ctx),
+		  void *eloop_data, void *user_data)
+{
+#ifdef ELOOP_WAKEUP
+	struct eloop_post *post;
+
+	if (eloop.wakeup_fd < 0)
+		return -1;
+	post = (struct eloop_post *) malloc(sizeof(*post));
+	if (post == NULL)
+		return -1;
+	post->eloop_data = eloop_data;
+	post->user_data = user_data;
+	post->handler = handler;
+	post->posted_ns = eloop_now_ns();
+	post->next = NULL;
+
+	pthread_mutex_lock(&eloop.post_lock);
+	if (eloop.post_tail)
+		eloop.post_tail->next = post;
+	else
+		eloop.post_head = post;
+	eloop.post_tail = post;
+	pthread_mutex_unlock(&eloop.post_lock);
+
+	eloop_wakeup();
+	return 0;
+#else /* ELOOP_WAKEUP */
+	(void) handler;
+	(void) eloop_data;
+	(void) user_data;
+	return -1;
+#endif /* ELOOP_WAKEUP */
 }
 
 
@@ -172,7 +502,7 @@ int qt_eloop_register_timeout(unsigned int secs, unsigned int usecs,
 	timeout = (struct eloop_timeout *) malloc(sizeof(*timeout));
 	if (timeout == NULL)
 		return -1;
-	gettimeofday(&timeout->time, NULL);
+	eloop_get_time(&timeout->time);
 	timeout->time.tv_sec += secs;
 	timeout->time.tv_usec += usecs;
 	while (timeout->time.tv_usec >= 1000000) {
@@ -278,6 +608,11 @@ static void eloop_handle_signal(int sig)
 			break;
 		}
 	}
+#ifdef ELOOP_WAKEUP
+	/* The signal may have been delivered to a worker thread, in which
+	 * case select() is not interrupted */
+	eloop_wakeup();
+#endif /* ELOOP_WAKEUP */
 }
 
 
@@ -298,10 +633,15 @@ static void eloop_process_pending_signals(void)
 
 	for (i = 0; i < eloop.signal_count; i++) {
 		if (eloop.signals[i].signaled) {
+			unsigned long long start_ns = eloop_now_ns();
+
 			eloop.signals[i].signaled = 0;
 			eloop.signals[i].handler(eloop.signals[i].sig,
 						 eloop.user_data,
 						 eloop.signals[i].user_data);
+			eloop_account(ELOOP_KIND_SIGNAL,
+				      (eloop_handler_fn) eloop.signals[i].handler,
+				      start_ns, 0ULL);
 		}
 	}
 }
@@ -335,7 +675,7 @@ int qt_eloop_register_signal(int sig,
 void qt_eloop_run(void)
 {
 	fd_set *rfds;
-	int i, res;
+	int i, res, max_sock;
 	struct timeval tv, now;
 
 	rfds = malloc(sizeof(*rfds));
@@ -347,7 +687,7 @@ void qt_eloop_run(void)
 	while (!eloop.terminate &&
 		(eloop.timeout || eloop.reader_count > 0)) {
 		if (eloop.timeout) {
-			gettimeofday(&now, NULL);
+			eloop_get_time(&now);
 			if (timercmp(&now, &eloop.timeout->time, <))
 				timersub(&eloop.timeout->time, &now, &tv);
 			else
@@ -361,7 +701,15 @@ void qt_eloop_run(void)
 		FD_ZERO(rfds);
 		for (i = 0; i < eloop.reader_count; i++)
 			FD_SET(eloop.readers[i].sock, rfds);
-		res = select(eloop.max_sock + 1, rfds, NULL, NULL,
+		max_sock = eloop.max_sock;
+#ifdef ELOOP_WAKEUP
+		if (eloop.wakeup_fd >= 0) {
+			FD_SET(eloop.wakeup_fd, rfds);
+			if (eloop.wakeup_fd > max_sock)
+				max_sock = eloop.wakeup_fd;
+		}
+#endif /* ELOOP_WAKEUP */
+		res = select(max_sock + 1, rfds, NULL, NULL,
 			     eloop.timeout ? &tv : NULL);
 		if (res < 0 && errno != EINTR) {
 			perror("select");
@@ -369,17 +717,32 @@ void qt_eloop_run(void)
 			return;
 		}
 		eloop_process_pending_signals();
+#ifdef ELOOP_WAKEUP
+		if (res > 0 && eloop.wakeup_fd >= 0 &&
+		    FD_ISSET(eloop.wakeup_fd, rfds)) {
+			eloop_process_posts();
+			res--;
+		}
+#endif /* ELOOP_WAKEUP */
 
 		/* check if some registered timeouts have occurred */
 		if (eloop.timeout) {
 			struct eloop_timeout *tmp;
 
-			gettimeofday(&now, NULL);
+			eloop_get_time(&now);
 			if (!timercmp(&now, &eloop.timeout->time, <)) {
+				unsigned long long start_ns = eloop_now_ns();
+
 				tmp = eloop.timeout;
 				eloop.timeout = eloop.timeout->next;
+				timersub(&now, &tmp->time, &tv);
 				tmp->handler(tmp->eloop_data,
 					     tmp->user_data);
+				eloop_account(ELOOP_KIND_TIMEOUT,
+					      (eloop_handler_fn) tmp->handler,
+					      start_ns,
+					      tv.tv_sec * 1000000000ULL +
+					      tv.tv_usec * 1000ULL);
 				free(tmp);
 			}
 
@@ -390,10 +753,16 @@ void qt_eloop_run(void)
 
 		for (i = 0; i < eloop.reader_count; i++) {
 			if (FD_ISSET(eloop.readers[i].sock, rfds)) {
+				unsigned long long start_ns = eloop_now_ns();
+				eloop_handler_fn fn = (eloop_handler_fn)
+					eloop.readers[i].handler;
+
 				eloop.readers[i].handler(
 					eloop.readers[i].sock,
 					eloop.readers[i].eloop_data,
 					eloop.readers[i].user_data);
+				eloop_account(ELOOP_KIND_SOCK, fn, start_ns,
+					      0ULL);
 			}
 		}
 	}
@@ -420,6 +789,18 @@ void qt_eloop_destroy(void)
 	}
 	free(eloop.readers);
 	free(eloop.signals);
+#ifdef ELOOP_WAKEUP
+	while (eloop.post_head != NULL) {
+		struct eloop_post *post = eloop.post_head;
+
+		eloop.post_head = post->next;
+		free(post);
+	}
+	eloop.post_tail = NULL;
+	if (eloop.wakeup_fd >= 0)
+		close(eloop.wakeup_fd);
+	eloop.wakeup_fd = -1;
+#endif /* ELOOP_WAKEUP */
 }
 
 
@@ -26,6 +26,34 @@
 /* Magic number for qt_eloop_cancel_timeout() */
 #define ELOOP_ALL_CTX (void *) -1
 
+/* Histogram bucket i counts [2^i, 2^(i+1)) usec, the last one is open */
+#define ELOOP_HIST_BUCKETS 20
+
+enum eloop_handler_kind {
+	ELOOP_KIND_SOCK,
+	ELOOP_KIND_TIMEOUT,
+	ELOOP_KIND_SIGNAL,
+	ELOOP_KIND_POST,
+	ELOOP_KIND_MAX
+};
+
+/* Any eloop callback, cast to a common type to identify it in statistics */
+typedef void (*eloop_handler_fn)(void);
+
+struct eloop_handler_stats {
+	const char *name;
+	int kind;
+	unsigned int count;
+	unsigned int stalls;
+	unsigned long long total_ns;
+	unsigned long long max_ns;
+	unsigned int hist[ELOOP_HIST_BUCKETS];
+	/* How late timeouts fired and how long posts were queued */
+	unsigned long long late_total_ns;
+	unsigned long long late_max_ns;
+	unsigned int late_hist[ELOOP_HIST_BUCKETS];
+};
+
 /**
  * qt_eloop_init() - Initialize global event loop data
  * @user_data: Pointer to global data passed as eloop_ctx to signal handlers
@@ -92,6 +120,21 @@ int qt_eloop_register_timeout(unsigned int secs, unsigned int usecs,
 int qt_eloop_cancel_timeout(void (*handler)(void *eloop_ctx, void *sock_ctx),
 			 void *eloop_data, void *user_data);
 
+/**
+ * qt_eloop_post - Run a callback from the event loop thread
+ * @handler: Callback function to be called from qt_eloop_run()
+ * @eloop_data: Callback context data (eloop_ctx)
+ * @user_data: Callback context data (user_ctx)
+ * Returns: 0 on success, -1 on failure
+ *
+ * This is the only eloop function that may be called from other threads. The
+ * callback is queued and the event loop is woken up through an eventfd, so
+ * worker threads can hand their results back without the loop polling for
+ * them. Callbacks run in the order they were posted. Not supported on Zephyr.
+ */
+int qt_eloop_post(void (*handler)(void *eloop_ctx, void *user_ctx),
+		  void *eloop_data, void *user_data);
+
 /**
  * qt_eloop_register_signal - Register handler for signals
  * @sig: Signal number (e.g., SIGHUP)
@@ -112,6 +155,55 @@ int qt_eloop_register_signal(int sig,
 			  void (*handler)(int sig, void *eloop_ctx,
 					  void *signal_ctx),
 			  void *user_data);
+/**
+ * qt_eloop_set_handler_name - Name a callback in the loop statistics
+ * @handler: Callback function cast to eloop_handler_fn
+ * @name: Name to report, must stay valid while the loop runs
+ *
+ * QT_ELOOP_HANDLER_NAME() names a callback after its function.
+ */
+void qt_eloop_set_handler_name(eloop_handler_fn handler, const char *name);
+
+#define QT_ELOOP_HANDLER_NAME(fn) \
+	qt_eloop_set_handler_name((eloop_handler_fn) (fn), #fn)
+
+/**
+ * qt_eloop_set_stall_handler - Report callbacks holding the loop too long
+ * @threshold_ms: Callback duration reported as a stall, 0 to disable
+ * @handler: Called from the loop after the stalling callback has returned
+ *
+ * The handler gets the callback name and the tag set with
+ * qt_eloop_set_stall_tag() by the callback, if any.
+ */
+void qt_eloop_set_stall_handler(unsigned int threshold_ms,
+				void (*handler)(const char *name,
+						const char *tag,
+						unsigned int elapsed_ms));
+
+/**
+ * qt_eloop_set_stall_tag - Describe the work of the running callback
+ * @tag: e.g., the API being handled, must stay valid while the loop runs
+ *
+ * The tag is cleared when the callback returns.
+ */
+void qt_eloop_set_stall_tag(const char *tag);
+
+/**
+ * qt_eloop_get_stats - Get the callback duration and lateness statistics
+ * @stats: Array to fill, one entry per callback and kind
+ * @max: Number of entries in stats
+ * Returns: Number of filled entries
+ *
+ * Durations are measured with the monotonic clock. Statistics are only
+ * collected on Linux, other platforms return 0.
+ */
+int qt_eloop_get_stats(struct eloop_handler_stats *stats, int max);
+
+/**
+ * qt_eloop_reset_stats - Clear the statistics, keeping the handler names
+ */
+void qt_eloop_reset_stats(void);
+
 /**
  * qt_eloop_run - Start the event loop
  *
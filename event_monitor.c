@@ -0,0 +1,327 @@
+/* Copyright (c) 2020 Wi-Fi Alliance                                                */
+
+/* Permission to use, copy, modify, and/or distribute this software for any         */
+/* purpose with or without fee is hereby granted, provided that the above           */
+/* copyright notice and this permission notice appear in all copies.                */
+
+/* THE SOFTWARE IS PROVIDED 'AS IS' AND THE AUTHOR DISCLAIMS ALL                    */
+/* WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED                    */
+/* WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL                     */
+/* THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR                       */
+/* CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING                        */
+/* FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF                       */
+/* CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT                       */
+/* OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS                          */
+/* SOFTWARE. */
+
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <libgen.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/inotify.h>
+
+#include "vendor_specific.h"
+#include "indigo_api.h"
+#include "indigo_packet.h"
+#include "utils.h"
+#include "wpa_ctrl.h"
+#include "event_monitor.h"
+
+/* Monitor connection to one control interface */
+struct event_monitor {
+    struct wpa_ctrl *ctrl;
+    char path[S_BUFFER_LEN * 2];
+    char source[S_BUFFER_LEN];
+    ino_t ino;
+    int seen;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_t thread;
+    int running;
+    int stop;
+    int wake_fds[2];
+    int inotify_fd;
+    /* Control socket of the app, the tool receives the events from the port of the requests */
+    int sock;
+    struct sockaddr_in addr;
+    char filter[EVENT_FILTER_LEN];
+    unsigned short seq;
+    char dirs[2][S_BUFFER_LEN];
+    /* Owned by the thread */
+    struct event_monitor monitors[EVENT_MONITOR_MAX];
+    int monitor_count;
+} events = { .lock = PTHREAD_MUTEX_INITIALIZER, .sock = -1, .wake_fds = { -1, -1 }, .inotify_fd = -1 };
+
+static const char *event_daemons[2] = { "hostapd", "wpa_supplicant" };
+
+static int event_match(const char *filter, const char *msg) {
+    const char *token = filter, *end;
+    size_t len;
+
+    if (strcmp(filter, "*") == 0)
+        return 1;
+    while (*token) {
+        end = strchr(token, ',');
+        len = end ? (size_t)(end - token) : strlen(token);
+        if (len > 0 && strncmp(msg, token, len) == 0)
+            return 1;
+        if (end == NULL)
+            break;
+        token = end + 1;
+    }
+    return 0;
+}
+
+static void event_forward(struct event_monitor *monitor, char *msg) {
+    struct packet_wrapper wrapper;
+    struct timespec now;
+    char buffer[BUFFER_LEN], timestamp[32];
+    char *pos;
+    int len;
+
+    /* Skip the "<level>" prefix */
+    if (msg[0] == '<' && (pos = strchr(msg, '>')) != NULL)
+        msg = pos + 1;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    snprintf(timestamp, sizeof(timestamp), "%ld.%06ld", (long)now.tv_sec, now.tv_nsec / 1000);
+
+    pthread_mutex_lock(&events.lock);
+    if (events.addr.sin_port == 0 || !event_match(events.filter, msg)) {
+        pthread_mutex_unlock(&events.lock);
+        return;
+    }
+    memset(&wrapper, 0, sizeof(wrapper));
+    fill_wrapper_message_hdr(&wrapper, API_CMD_EVENT, ++events.seq);
+    fill_wrapper_tlv_bytes(&wrapper, TLV_EVENT_SOURCE, strlen(monitor->source), monitor->source);
+    len = strlen(msg);
+    /* The TLV length is one byte, longer events are truncated */
+    fill_wrapper_tlv_bytes(&wrapper, TLV_EVENT_MESSAGE, len > 255 ? 255 : len, msg);
+    fill_wrapper_tlv_bytes(&wrapper, TLV_EVENT_TIMESTAMP, strlen(timestamp), timestamp);
+    len = assemble_packet(buffer, sizeof(buffer), &wrapper);
+    if (sendto(events.sock, buffer, len, 0, (struct sockaddr *)&events.addr, sizeof(events.addr)) < 0)
+        indigo_logger(LOG_LEVEL_WARNING, "Failed to forward the event %s (%s)", msg, strerror(errno));
+    pthread_mutex_unlock(&events.lock);
+    free_packet_wrapper(&wrapper);
+    indigo_logger(LOG_LEVEL_DEBUG, "Forward the event of %s: %s", monitor->source, msg);
+}
+
+static void event_monitor_close(int index) {
+    struct event_monitor *monitor = &events.monitors[index];
+
+    indigo_logger(LOG_LEVEL_DEBUG, "Stop monitoring %s", monitor->path);
+    wpa_ctrl_detach(monitor->ctrl);
+    wpa_ctrl_close(monitor->ctrl);
+    events.monitors[index] = events.monitors[--events.monitor_count];
+}
+
+static void event_monitor_open(const char *path, const char *daemon, const char *ifname, ino_t ino) {
+    struct event_monitor *monitor;
+    struct wpa_ctrl *ctrl;
+
+    if (events.monitor_count == EVENT_MONITOR_MAX)
+        return;
+    ctrl = wpa_ctrl_open(path);
+    if (ctrl == NULL)
+        return;
+    if (wpa_ctrl_attach(ctrl)) {
+        wpa_ctrl_close(ctrl);
+        return;
+    }
+    monitor = &events.monitors[events.monitor_count++];
+    memset(monitor, 0, sizeof(*monitor));
+    monitor->ctrl = ctrl;
+    monitor->ino = ino;
+    monitor->seen = 1;
+    snprintf(monitor->path, sizeof(monitor->path), "%s", path);
+    snprintf(monitor->source, sizeof(monitor->source), "%s/%s", daemon, ifname);
+    indigo_logger(LOG_LEVEL_DEBUG, "Monitor the events of %s", monitor->source);
+}
+
+/* Attach to the new control interfaces and close the ones of stopped daemons */
+static void event_monitor_scan() {
+    char path[S_BUFFER_LEN * 2];
+    struct dirent *entry;
+    struct stat st;
+    DIR *dir;
+    int d, i;
+
+    for (i = 0; i < events.monitor_count; i++)
+        events.monitors[i].seen = 0;
+
+    for (d = 0; d < 2; d++) {
+        /* The directories are created by the daemons, the parent tells when to watch them */
+        if (inotify_add_watch(events.inotify_fd, events.dirs[d], IN_CREATE | IN_DELETE | IN_MOVED_TO | IN_ONLYDIR) < 0) {
+            snprintf(path, sizeof(path), "%s", events.dirs[d]);
+            inotify_add_watch(events.inotify_fd, dirname(path), IN_CREATE | IN_MOVED_TO | IN_ONLYDIR);
+        }
+        dir = opendir(events.dirs[d]);
+        if (dir == NULL)
+            continue;
+        while ((entry = readdir(dir)) != NULL) {
+            /* The global interface repeats the events of all interfaces */
+            if (entry->d_name[0] == '.' || strcmp(entry->d_name, "global") == 0)
+                continue;
+            snprintf(path, sizeof(path), "%s/%s", events.dirs[d], entry->d_name);
+            if (stat(path, &st) || !S_ISSOCK(st.st_mode))
+                continue;
+            for (i = 0; i < events.monitor_count; i++) {
+                if (strcmp(events.monitors[i].path, path) == 0)
+                    break;
+            }
+            if (i < events.monitor_count && events.monitors[i].ino == st.st_ino) {
+                events.monitors[i].seen = 1;
+                continue;
+            }
+            /* A restarted daemon has a new socket with the same path */
+            if (i < events.monitor_count)
+                event_monitor_close(i);
+            event_monitor_open(path, event_daemons[d], entry->d_name, st.st_ino);
+        }
+        closedir(dir);
+    }
+
+    for (i = 0; i < events.monitor_count; i++) {
+        if (!events.monitors[i].seen)
+            event_monitor_close(i--);
+    }
+}
+
+static void event_monitor_receive(struct event_monitor *monitor) {
+    char msg[EVENT_MESSAGE_LEN];
+    size_t len;
+
+    while (wpa_ctrl_pending(monitor->ctrl) > 0) {
+        len = sizeof(msg) - 1;
+        if (wpa_ctrl_recv(monitor->ctrl, msg, &len))
+            break;
+        msg[len] = '\0';
+        event_forward(monitor, msg);
+    }
+}
+
+static void* event_monitor_thread(void *arg) {
+    struct pollfd pfds[EVENT_MONITOR_MAX + 2];
+    struct event_monitor *polled[EVENT_MONITOR_MAX];
+    char buffer[4096];
+    int i, count, n, rescan;
+
+    (void)arg;
+
+    event_monitor_scan();
+    while (!__atomic_load_n(&events.stop, __ATOMIC_ACQUIRE)) {
+        pfds[0].fd = events.wake_fds[0];
+        pfds[0].events = POLLIN;
+        pfds[1].fd = events.inotify_fd;
+        pfds[1].events = POLLIN;
+        count = 2;
+        for (i = 0; i < events.monitor_count; i++) {
+            polled[i] = &events.monitors[i];
+            pfds[count].fd = wpa_ctrl_get_fd(events.monitors[i].ctrl);
+            pfds[count++].events = POLLIN;
+        }
+
+        n = poll(pfds, count, EVENT_MONITOR_SCAN_MS);
+        if (n < 0 && errno != EINTR)
+            break;
+        rescan = n == 0;
+        if (n > 0 && (pfds[1].revents & POLLIN)) {
+            while (read(events.inotify_fd, buffer, sizeof(buffer)) > 0)
+                ;
+            rescan = 1;
+        }
+        for (i = 2; n > 0 && i < count; i++) {
+            if (pfds[i].revents & POLLIN)
+                event_monitor_receive(polled[i - 2]);
+            else if (pfds[i].revents & (POLLERR | POLLHUP))
+                rescan = 1;
+        }
+        if (rescan)
+            event_monitor_scan();
+    }
+
+    while (events.monitor_count > 0)
+        event_monitor_close(0);
+    return NULL;
+}
+
+/* Control socket used to send the events */
+void event_monitor_init(int sock) {
+    events.sock = sock;
+}
+
+static void event_ctrl_dir(char *dir, int size, char *ctrl_path) {
+    char *pos;
+
+    snprintf(dir, size, "%s", ctrl_path);
+    pos = strrchr(dir, '/');
+    if (pos)
+        *pos = '\0';
+}
+
+/* Forward the events matching filter to addr. A new subscription replaces the previous one */
+int event_monitor_subscribe(struct sockaddr_in *addr, char *filter) {
+    if (events.sock < 0)
+        return -1;
+
+    pthread_mutex_lock(&events.lock);
+    memcpy(&events.addr, addr, sizeof(events.addr));
+    snprintf(events.filter, sizeof(events.filter), "%s", filter);
+    pthread_mutex_unlock(&events.lock);
+    if (events.running)
+        return 0;
+
+    event_ctrl_dir(events.dirs[0], sizeof(events.dirs[0]), get_hapd_ctrl_path());
+    event_ctrl_dir(events.dirs[1], sizeof(events.dirs[1]), get_wpas_ctrl_path());
+    events.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (events.inotify_fd < 0 || pipe(events.wake_fds)) {
+        indigo_logger(LOG_LEVEL_ERROR, "Failed to create the event monitor descriptors");
+        goto fail;
+    }
+    __atomic_store_n(&events.stop, 0, __ATOMIC_RELEASE);
+    if (pthread_create(&events.thread, NULL, event_monitor_thread, NULL)) {
+        indigo_logger(LOG_LEVEL_ERROR, "Failed to create the event monitor thread");
+        goto fail;
+    }
+    events.running = 1;
+    return 0;
+
+fail:
+    event_monitor_unsubscribe();
+    return -1;
+}
+
+void event_monitor_unsubscribe() {
+    pthread_mutex_lock(&events.lock);
+    memset(&events.addr, 0, sizeof(events.addr));
+    pthread_mutex_unlock(&events.lock);
+
+    if (events.running) {
+        __atomic_store_n(&events.stop, 1, __ATOMIC_RELEASE);
+        (void)write(events.wake_fds[1], "x", 1);
+        pthread_join(events.thread, NULL);
+        events.running = 0;
+    }
+    if (events.inotify_fd >= 0)
+        close(events.inotify_fd);
+    if (events.wake_fds[0] >= 0) {
+        close(events.wake_fds[0]);
+        close(events.wake_fds[1]);
+    }
+    events.inotify_fd = -1;
+    events.wake_fds[0] = events.wake_fds[1] = -1;
+}
+
+int event_monitor_is_subscribed() {
+    return events.running;
+}
@@ -0,0 +1,50 @@
+/* Copyright (c) 2020 Wi-Fi Alliance                                                */
+
+/* Permission to use, copy, modify, and/or distribute this software for any         */
+/* purpose with or without fee is hereby granted, provided that the above           */
+/* copyright notice and this permission notice appear in all copies.                */
+
+/* THE SOFTWARE IS PROVIDED 'AS IS' AND THE AUTHOR DISCLAIMS ALL                    */
+/* WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED                    */
+/* WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL                     */
+/* THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR                       */
+/* CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING                        */
+/* FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF                       */
+/* CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT                       */
+/* OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS                          */
+/* SOFTWARE. */
+
+
+#ifndef _INDIGO_EVENT_MONITOR_
+#define _INDIGO_EVENT_MONITOR_  1
+
+#include <netinet/in.h>
+
+/* Forwarding of the hostapd and wpa_supplicant events to the tool.
+ * A thread attaches a monitor connection to each control interface socket in
+ * the hostapd and wpa_supplicant control directories. It finds the new sockets
+ * with inotify, e.g. the P2P group interfaces, and rescans the directories
+ * every EVENT_MONITOR_SCAN_MS. Events matching the filter of the subscription
+ * are sent from the control socket to the tool as API_CMD_EVENT messages.
+ * The thread does not wait for the event loop, so an event is forwarded while
+ * a handler is still waiting for it.
+ *
+ * The filter is a comma separated list of event prefixes, "*" forwards all.
+ */
+
+#define EVENT_MONITOR_MAX           16
+#define EVENT_MONITOR_SCAN_MS       1000
+#define EVENT_FILTER_LEN            256
+#define EVENT_MESSAGE_LEN           1024
+#define EVENT_DEFAULT_FILTER        "CTRL-EVENT-CONNECTED,CTRL-EVENT-DISCONNECTED,CTRL-EVENT-SCAN-RESULTS," \
+                                    "CTRL-EVENT-EAP-SUCCESS,CTRL-EVENT-EAP-FAILURE,AP-ENABLED,AP-DISABLED," \
+                                    "AP-STA-CONNECTED,AP-STA-DISCONNECTED,WPS-SUCCESS,WPS-FAIL," \
+                                    "P2P-GROUP-STARTED,P2P-GROUP-REMOVED,P2P-GO-NEG-SUCCESS,P2P-GO-NEG-FAILURE," \
+                                    "P2P-GROUP-FORMATION-FAILURE,ANQP-QUERY-DONE,INTERWORKING-"
+
+void event_monitor_init(int sock);
+int event_monitor_subscribe(struct sockaddr_in *addr, char *filter);
+void event_monitor_unsubscribe();
+int event_monitor_is_subscribed();
+
+#endif /* _INDIGO_EVENT_MONITOR_ */
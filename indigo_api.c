@@ -17,6 +17,11 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#ifdef CONFIG_ZEPHYR
+#include <zephyr/kernel.h>
+#else
+#include <time.h>
+#endif
 
 #include "vendor_specific.h"
 #include "indigo_api.h"
@@ -27,6 +32,7 @@ struct indigo_api indigo_api_list[] = {
     /* Common */
     { API_CMD_RESPONSE, "CMD_RESPONSE", NULL, NULL },
     { API_CMD_ACK, "CMD_ACK", NULL, NULL },
+    { API_CMD_EVENT, "CMD_EVENT", NULL, NULL },
     /* AP specific */
     { API_AP_START_UP, "AP_START_UP", NULL, NULL },
     { API_AP_STOP, "AP_STOP", NULL, NULL },
@@ -69,6 +75,7 @@ struct indigo_api indigo_api_list[] = {
     { API_STA_SEND_ICON_REQ, "STA_SEND_ICON_REQ", NULL, NULL },
     { API_P2P_SET_EXT_LISTEN, "P2P_SET_EXT_LISTEN", NULL, NULL },
     { API_STA_ENABLE_WSC, "STA_ENABLE_WSC", NULL, NULL },
+    { API_STA_GET_SCAN_RESULTS, "STA_GET_SCAN_RESULTS", NULL, NULL },
     /* Network operation. E.g., get/set IP address, get MAC address, send the UDP data and reset */
     { API_GET_IP_ADDR, "GET_IP_ADDR", NULL, NULL },
     { API_GET_MAC_ADDR, "GET_MAC_ADDR", NULL, NULL },
@@ -84,8 +91,21 @@ struct indigo_api indigo_api_list[] = {
     { API_STOP_DHCP, "STOP_DHCP", NULL, NULL },
     { API_GET_WSC_PIN, "GET_WSC_PIN", NULL, NULL },
     { API_GET_WSC_CRED, "GET_WSC_CRED", NULL, NULL },
+    { API_START_CAPTURE, "START_CAPTURE", NULL, NULL },
+    { API_STOP_CAPTURE, "STOP_CAPTURE", NULL, NULL },
+    { API_GET_LOOP_STATS, "GET_LOOP_STATS", NULL, NULL },
+    { API_GET_API_STATS, "GET_API_STATS", NULL, NULL },
+    { API_SUBSCRIBE_EVENTS, "SUBSCRIBE_EVENTS", NULL, NULL },
+    { API_UNSUBSCRIBE_EVENTS, "UNSUBSCRIBE_EVENTS", NULL, NULL },
+    { API_GET_STATUS, "GET_STATUS", NULL, NULL },
 };
 
+#define API_COUNT (sizeof(indigo_api_list)/sizeof(struct indigo_api))
+
+/* Metrics of indigo_api_list[i] are in api_metrics[i] */
+static struct indigo_api_metrics api_metrics[API_COUNT];
+static struct indigo_api_metrics_totals api_metrics_totals;
+
 /* Structure to declare the TLV list */
 struct indigo_tlv indigo_tlv_list[] = {
     { TLV_SSID, "SSID" },
@@ -273,6 +293,14 @@ struct indigo_tlv indigo_tlv_list[] = {
     { TLV_TP_IP_ADDRESS, "TP_IP_ADDRESS" },
     { TLV_WPS_ER_SUPPORT, "WPS_ER_SUPPORT" },
     { TLV_ADDITIONAL_TEST_PLATFORM_ID, "ADDITIONAL_TEST_PLATFORM_ID" },
+    { TLV_FLOW_ID, "FLOW_ID" },
+    { TLV_TIMESTAMPING, "TIMESTAMPING" },
+    { TLV_RESET_STATS, "RESET_STATS" },
+    { TLV_API_ID, "API_ID" },
+    { TLV_EVENT_FILTER, "EVENT_FILTER" },
+    { TLV_EVENT_PORT, "EVENT_PORT" },
+    { TLV_STATUS_FIELDS, "STATUS_FIELDS" },
+    { TLV_WAIT_TIMEOUT, "WAIT_TIMEOUT" },
 };
 
 /* Find the type of the API stucture by the ID from the list */
@@ -297,6 +325,209 @@ struct indigo_api* get_api_by_id(int id) {
     return NULL;
 }
 
+/* Monotonic time for the API metrics */
+unsigned long long get_api_metrics_time_us() {
+#ifdef CONFIG_ZEPHYR
+    return k_ticks_to_us_floor64(k_uptime_ticks());
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+#endif
+}
+
+static int get_api_metrics_bucket(unsigned long long us) {
+    int bucket = 0;
+
+    while (us > 1 && bucket < API_METRICS_BUCKETS - 1) {
+        us >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+/* Account one control message. api is NULL if the message was not parsed or the API is unknown */
+void record_api_metrics(struct indigo_api *api, struct api_call_sample *sample) {
+    struct indigo_api_metrics *metrics;
+
+    api_metrics_totals.count++;
+    api_metrics_totals.bytes_in += sample->bytes_in;
+    api_metrics_totals.bytes_out += sample->bytes_out;
+    if (sample->error) {
+        api_metrics_totals.errors++;
+    }
+    if (sample->parse_failed) {
+        api_metrics_totals.parse_failures++;
+        return;
+    }
+    metrics = get_api_metrics(api);
+    if (metrics == NULL) {
+        api_metrics_totals.unknown_apis++;
+        return;
+    }
+
+    metrics->count++;
+    if (sample->error) {
+        metrics->errors++;
+    }
+    metrics->bytes_in += sample->bytes_in;
+    metrics->bytes_out += sample->bytes_out;
+    metrics->verify_us += sample->verify_us;
+    metrics->handle_us += sample->handle_us;
+    metrics->total_us += sample->total_us;
+    if (sample->total_us > metrics->max_us) {
+        metrics->max_us = sample->total_us;
+    }
+    metrics->hist[get_api_metrics_bucket(sample->total_us)]++;
+}
+
+struct indigo_api_metrics* get_api_metrics(struct indigo_api *api) {
+    if (api == NULL || api < indigo_api_list || api >= indigo_api_list + API_COUNT) {
+        return NULL;
+    }
+    return &api_metrics[api - indigo_api_list];
+}
+
+void get_api_metrics_totals(struct indigo_api_metrics_totals *totals) {
+    memcpy(totals, &api_metrics_totals, sizeof(*totals));
+}
+
+void reset_api_metrics() {
+    memset(api_metrics, 0, sizeof(api_metrics));
+    memset(&api_metrics_totals, 0, sizeof(api_metrics_totals));
+}
+
+/* Print the non-empty buckets as "<upper bound>:count" */
+int format_latency_histogram(char *buffer, int size, unsigned int *hist, int buckets) {
+    int i, len = 0;
+
+    buffer[0] = 0;
+    for (i = 0; i < buckets && len < size; i++) {
+        if (hist[i] == 0)
+            continue;
+        if (i == buckets - 1)
+            len += snprintf(buffer + len, size - len, " >=%uus:%u", 1U << i, hist[i]);
+        else
+            len += snprintf(buffer + len, size - len, " <%uus:%u", 1U << (i + 1), hist[i]);
+    }
+    return len < size ? len : size - 1;
+}
+
+void log_api_metrics() {
+    char buffer[256];
+    unsigned int i;
+    struct indigo_api_metrics *metrics;
+
+    indigo_logger(LOG_LEVEL_INFO, "API statistics: %u requests, %u errors, %u parse failures, %u unknown, %llu bytes in, %llu bytes out",
+        api_metrics_totals.count, api_metrics_totals.errors, api_metrics_totals.parse_failures,
+        api_metrics_totals.unknown_apis, api_metrics_totals.bytes_in, api_metrics_totals.bytes_out);
+    for (i = 0; i < API_COUNT; i++) {
+        metrics = &api_metrics[i];
+        if (metrics->count == 0)
+            continue;
+        indigo_logger(LOG_LEVEL_INFO, "API %s: count %u errors %u avg verify %llu us handle %llu us total %llu us max %llu us",
+            indigo_api_list[i].name, metrics->count, metrics->errors, metrics->verify_us / metrics->count,
+            metrics->handle_us / metrics->count, metrics->total_us / metrics->count, metrics->max_us);
+        format_latency_histogram(buffer, sizeof(buffer), metrics->hist, API_METRICS_BUCKETS);
+        indigo_logger(LOG_LEVEL_INFO, "  total%s", buffer);
+    }
+}
+
+static void fill_wrapper_tlv_number(struct packet_wrapper *wrapper, int id, unsigned long long value) {
+    char buffer[32];
+
+    snprintf(buffer, sizeof(buffer), "%llu", value);
+    fill_wrapper_tlv_bytes(wrapper, id, strlen(buffer), buffer);
+}
+
+/* "NAME=ms ..." of the APIs which took the most time in total */
+static void format_api_metrics_top(char *buffer, int size) {
+    int used[API_COUNT];
+    unsigned int i, best, n;
+    int len = 0;
+
+    memset(used, 0, sizeof(used));
+    buffer[0] = 0;
+    for (n = 0; n < API_METRICS_TOP; n++) {
+        best = API_COUNT;
+        for (i = 0; i < API_COUNT; i++) {
+            if (used[i] || api_metrics[i].count == 0)
+                continue;
+            if (best == API_COUNT || api_metrics[i].total_us > api_metrics[best].total_us)
+                best = i;
+        }
+        if (best == API_COUNT)
+            break;
+        used[best] = 1;
+        i = snprintf(buffer + len, size - len, "%s%s=%llu", len ? " " : "",
+            indigo_api_list[best].name, api_metrics[best].total_us / 1000);
+        /* Drop the entry which does not fit */
+        if (len + (int)i >= size) {
+            buffer[len] = 0;
+            break;
+        }
+        len += i;
+    }
+}
+
+/* Response of API_GET_API_STATS. TLV_API_ID selects one API, otherwise the totals are returned */
+void fill_api_metrics_response(struct packet_wrapper *req, struct packet_wrapper *resp) {
+    struct tlv_hdr *tlv;
+    struct indigo_api *api = NULL;
+    struct indigo_api_metrics *metrics;
+    char buffer[TLV_VALUE_SIZE];
+
+    log_api_metrics();
+
+    fill_wrapper_message_hdr(resp, API_CMD_RESPONSE, req->hdr.seq);
+    /* TLV: TLV_API_ID, e.g. "0x5007" */
+    tlv = find_wrapper_tlv_by_id(req, TLV_API_ID);
+    if (tlv) {
+        memset(buffer, 0, sizeof(buffer));
+        memcpy(buffer, tlv->value, tlv->len);
+        api = get_api_by_id(strtol(buffer, NULL, 0));
+        if (api == NULL) {
+            fill_wrapper_tlv_byte(resp, TLV_STATUS, TLV_VALUE_STATUS_NOT_OK);
+            fill_wrapper_tlv_bytes(resp, TLV_MESSAGE, strlen(TLV_VALUE_API_STATS_NOT_OK), TLV_VALUE_API_STATS_NOT_OK);
+            return;
+        }
+    }
+
+    fill_wrapper_tlv_byte(resp, TLV_STATUS, TLV_VALUE_STATUS_OK);
+    fill_wrapper_tlv_bytes(resp, TLV_MESSAGE, strlen(TLV_VALUE_API_STATS_OK), TLV_VALUE_API_STATS_OK);
+    if (api) {
+        metrics = get_api_metrics(api);
+        fill_wrapper_tlv_number(resp, TLV_API_STATS_COUNT, metrics->count);
+        fill_wrapper_tlv_number(resp, TLV_API_STATS_ERRORS, metrics->errors);
+        fill_wrapper_tlv_number(resp, TLV_API_STATS_BYTES_IN, metrics->bytes_in);
+        fill_wrapper_tlv_number(resp, TLV_API_STATS_BYTES_OUT, metrics->bytes_out);
+        if (metrics->count) {
+            fill_wrapper_tlv_number(resp, TLV_API_STATS_VERIFY_TIME, metrics->verify_us / metrics->count);
+            fill_wrapper_tlv_number(resp, TLV_API_STATS_HANDLE_TIME, metrics->handle_us / metrics->count);
+            fill_wrapper_tlv_number(resp, TLV_API_STATS_TOTAL_TIME, metrics->total_us / metrics->count);
+            fill_wrapper_tlv_number(resp, TLV_API_STATS_MAX_TIME, metrics->max_us);
+            format_latency_histogram(buffer, sizeof(buffer), metrics->hist, API_METRICS_BUCKETS);
+            fill_wrapper_tlv_bytes(resp, TLV_API_STATS_HISTOGRAM, strlen(buffer), buffer);
+        }
+    } else {
+        fill_wrapper_tlv_number(resp, TLV_API_STATS_COUNT, api_metrics_totals.count);
+        fill_wrapper_tlv_number(resp, TLV_API_STATS_ERRORS, api_metrics_totals.errors);
+        fill_wrapper_tlv_number(resp, TLV_API_STATS_PARSE_FAILURES, api_metrics_totals.parse_failures);
+        fill_wrapper_tlv_number(resp, TLV_API_STATS_UNKNOWN, api_metrics_totals.unknown_apis);
+        fill_wrapper_tlv_number(resp, TLV_API_STATS_BYTES_IN, api_metrics_totals.bytes_in);
+        fill_wrapper_tlv_number(resp, TLV_API_STATS_BYTES_OUT, api_metrics_totals.bytes_out);
+        format_api_metrics_top(buffer, sizeof(buffer));
+        fill_wrapper_tlv_bytes(resp, TLV_API_STATS_TOP, strlen(buffer), buffer);
+    }
+
+    /* TLV: TLV_RESET_STATS. "1" clears the statistics after reading them */
+    tlv = find_wrapper_tlv_by_id(req, TLV_RESET_STATS);
+    if (tlv && tlv->len > 0 && tlv->value[0] == '1') {
+        reset_api_metrics();
+    }
+}
+
 /* Find the TLV by the ID from the list */
 struct indigo_tlv* get_tlv_by_id(int id) {
     unsigned int i = 0;
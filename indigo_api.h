@@ -40,6 +40,7 @@ struct indigo_api {
 /* Message type definition */
 #define API_CMD_RESPONSE                        0x0000
 #define API_CMD_ACK                             0x0001
+#define API_CMD_EVENT                           0x0002
 
 #define API_AP_START_UP                         0x1000
 #define API_AP_STOP                             0x1001
@@ -82,6 +83,7 @@ struct indigo_api {
 #define API_STA_SEND_ICON_REQ                   0x201b
 #define API_P2P_SET_EXT_LISTEN                  0x201c
 #define API_STA_ENABLE_WSC                      0x201d
+#define API_STA_GET_SCAN_RESULTS                0x201e
 
 #define API_GET_IP_ADDR                         0x5000
 #define API_GET_MAC_ADDR                        0x5001
@@ -97,6 +99,13 @@ struct indigo_api {
 #define API_STOP_DHCP                           0x500b
 #define API_GET_WSC_PIN                         0x500c
 #define API_GET_WSC_CRED                        0x500d
+#define API_START_CAPTURE                       0x500e
+#define API_STOP_CAPTURE                        0x500f
+#define API_GET_LOOP_STATS                      0x5010
+#define API_GET_API_STATS                       0x5011
+#define API_SUBSCRIBE_EVENTS                    0x5012
+#define API_UNSUBSCRIBE_EVENTS                  0x5013
+#define API_GET_STATUS                          0x5014
 
 /* TLV definition */
 #define TLV_SSID                                0x0001
@@ -282,6 +291,14 @@ struct indigo_api {
 #define TLV_TP_IP_ADDRESS                       0x00df
 #define TLV_WPS_ER_SUPPORT                      0x00e0
 #define TLV_ADDITIONAL_TEST_PLATFORM_ID         0x00e1
+#define TLV_FLOW_ID                             0x00e2
+#define TLV_TIMESTAMPING                        0x00e3
+#define TLV_RESET_STATS                         0x00e4
+#define TLV_API_ID                              0x00e5
+#define TLV_EVENT_FILTER                        0x00e6
+#define TLV_EVENT_PORT                          0x00e7
+#define TLV_STATUS_FIELDS                       0x00e8
+#define TLV_WAIT_TIMEOUT                        0x00e9
 
 // class ResponseTLV
 // List of TLV used in the QuickTrack API response and ACK messages from the DUT
@@ -301,6 +318,45 @@ struct indigo_api {
 #define TLV_WSC_WPA_KEY_MGMT                    0xa00d
 #define TLV_WSC_WPA_PASSPHRASE                  0xa00e
 #define TLV_PASSPOINT_ICON_CHECKSUM             0xa00f
+#define TLV_LOOP_BACK_RTT_MIN                   0xa010
+#define TLV_LOOP_BACK_RTT_AVG                   0xa011
+#define TLV_LOOP_BACK_RTT_MAX                   0xa012
+#define TLV_LOOP_BACK_RTT_P99                   0xa013
+#define TLV_LOOP_BACK_JITTER                    0xa014
+#define TLV_LOOP_BACK_OUT_OF_ORDER              0xa015
+#define TLV_LOOP_BACK_DATA_LOST                 0xa016
+#define TLV_LOOP_BACK_FLOW_ID                   0xa017
+#define TLV_CAPTURE_PACKETS                     0xa018
+#define TLV_CAPTURE_DROPPED                     0xa019
+#define TLV_LOOP_BACK_TIMESTAMPED               0xa01a
+#define TLV_LOOP_STATS_CALLBACKS                0xa01b
+#define TLV_LOOP_STATS_STALLS                   0xa01c
+#define TLV_LOOP_STATS_MAX_DURATION             0xa01d
+#define TLV_LOOP_STATS_MAX_HANDLER              0xa01e
+#define TLV_LOOP_STATS_MAX_LATENESS             0xa01f
+#define TLV_API_STATS_COUNT                     0xa020
+#define TLV_API_STATS_ERRORS                    0xa021
+#define TLV_API_STATS_PARSE_FAILURES            0xa022
+#define TLV_API_STATS_BYTES_IN                  0xa023
+#define TLV_API_STATS_BYTES_OUT                 0xa024
+#define TLV_API_STATS_VERIFY_TIME               0xa025
+#define TLV_API_STATS_HANDLE_TIME               0xa026
+#define TLV_API_STATS_TOTAL_TIME                0xa027
+#define TLV_API_STATS_MAX_TIME                  0xa028
+#define TLV_API_STATS_HISTOGRAM                 0xa029
+#define TLV_API_STATS_TOP                       0xa02a
+#define TLV_EVENT_SOURCE                        0xa02b
+#define TLV_EVENT_MESSAGE                       0xa02c
+#define TLV_EVENT_TIMESTAMP                     0xa02d
+#define TLV_STATUS_SSID                         0xa02e
+#define TLV_STATUS_BSSID                        0xa02f
+#define TLV_STATUS_FREQ                         0xa030
+#define TLV_STATUS_STATE                        0xa031
+#define TLV_STATUS_MISSING_FIELDS               0xa032
+#define TLV_SCAN_RESULT                         0xa033
+#define TLV_SCAN_RESULT_COUNT                   0xa034
+#define TLV_SCAN_RESULT_AGE                     0xa035
+#define TLV_API_STATS_UNKNOWN                   0xa036
 
 /* TLV Value */
 #define DUT_TYPE_STAUT                          0x01
@@ -339,6 +395,16 @@ struct indigo_api {
 #define TLV_VALUE_CREATE_BRIDGE_OK              "Bridge network is created successfully"
 #define TLV_VALUE_CREATE_BRIDGE_NOT_OK          "Failed to create bridge network"
 #define TLV_VALUE_START_DHCP_NOT_OK              "Failed to start DHCP server or client"
+#define TLV_VALUE_CAPTURE_START_OK              "Packet capture started"
+#define TLV_VALUE_CAPTURE_START_NOT_OK          "Failed to start packet capture"
+#define TLV_VALUE_CAPTURE_STOP_OK               "Packet capture stopped"
+#define TLV_VALUE_LOOP_STATS_OK                 "Event loop statistics are logged"
+#define TLV_VALUE_API_STATS_OK                  "API statistics are logged"
+#define TLV_VALUE_API_STATS_NOT_OK              "Unknown API ID"
+#define TLV_VALUE_SUBSCRIBE_EVENTS_OK           "Event subscription started"
+#define TLV_VALUE_SUBSCRIBE_EVENTS_NOT_OK       "Failed to start the event subscription"
+#define TLV_VALUE_UNSUBSCRIBE_EVENTS_OK         "Event subscription stopped"
+#define TLV_VALUE_GET_STATUS_NOT_OK             "Some status fields are not available"
 
 #define TLV_VALUE_WPA_S_START_UP_OK             "wpa_supplicant is initialized successfully"
 #define TLV_VALUE_WPA_S_START_UP_NOT_OK         "The wpa_supplicant was unable to initialize."
@@ -356,6 +422,7 @@ struct indigo_api {
 #define TLV_VALUE_WPA_S_BTM_QUERY_OK            "Sent WNM_BSS_QUERY"
 #define TLV_VALUE_WPA_S_BTM_QUERY_NOT_OK        "Failed to WNM_BSS_QUERY"
 #define TLV_VALUE_WPA_S_SCAN_NOT_OK             "Failed to trigger SCAN"
+#define TLV_VALUE_SCAN_RESULTS_NOT_OK           "No scan has completed"
 #define TLV_VALUE_RESET_OK                      "Device reset successfully"
 #define TLV_VALUE_RESET_NOT_OK                  "Failed to run Device reset"
 #define TLV_VALUE_POWER_SAVE_OK                 "Set power save value successfully"
@@ -389,10 +456,57 @@ struct indigo_api {
 #define WPS_ENABLE_NORMAL                       0x01
 #define WPS_ENABLE_OOB                          0x02
 
+/* Histogram bucket i counts [2^i, 2^(i+1)) usec, the last one is open */
+#define API_METRICS_BUCKETS                     24
+#define API_METRICS_TOP                         8
+
+/* Per API counters, the times are in microseconds */
+struct indigo_api_metrics {
+    unsigned int count;
+    unsigned int errors;
+    unsigned long long bytes_in;
+    unsigned long long bytes_out;
+    unsigned long long verify_us;
+    unsigned long long handle_us;
+    unsigned long long total_us;
+    unsigned long long max_us;
+    unsigned int hist[API_METRICS_BUCKETS];
+};
+
+/* Sum of all APIs, plus the requests which never reached an API */
+struct indigo_api_metrics_totals {
+    unsigned int count;
+    unsigned int errors;
+    unsigned int parse_failures;
+    unsigned int unknown_apis;
+    unsigned long long bytes_in;
+    unsigned long long bytes_out;
+};
+
+/* One control message, recorded by the receive path */
+struct api_call_sample {
+    int parse_failed;
+    int error;
+    unsigned int bytes_in;
+    unsigned int bytes_out;
+    unsigned long long verify_us;
+    unsigned long long handle_us;
+    unsigned long long total_us;
+};
+
 struct indigo_api* get_api_by_id(int id);
 struct indigo_tlv* get_tlv_by_id(int id);
 char* get_api_type_by_id(int id);
 
+unsigned long long get_api_metrics_time_us();
+void record_api_metrics(struct indigo_api *api, struct api_call_sample *sample);
+struct indigo_api_metrics* get_api_metrics(struct indigo_api *api);
+void get_api_metrics_totals(struct indigo_api_metrics_totals *totals);
+void reset_api_metrics();
+void log_api_metrics();
+int format_latency_histogram(char *buffer, int size, unsigned int *hist, int buckets);
+void fill_api_metrics_response(struct packet_wrapper *req, struct packet_wrapper *resp);
+
 typedef int (*api_callback_func)(struct packet_wrapper *req, struct packet_wrapper *resp);
 void register_api(int id, api_callback_func verify, api_callback_func handle);
 
@@ -241,6 +241,20 @@ static int get_ip_addr_handler(struct packet_wrapper *req, struct packet_wrapper
 static int reset_device_handler(struct packet_wrapper *req, struct packet_wrapper *resp);
 static int start_dhcp_handler(struct packet_wrapper *req, struct packet_wrapper *resp);
 static int stop_dhcp_handler(struct packet_wrapper *req, struct packet_wrapper *resp);
+#ifndef CONFIG_ZEPHYR
+static int get_loop_stats_handler(struct packet_wrapper *req, struct packet_wrapper *resp);
+static int get_api_stats_handler(struct packet_wrapper *req, struct packet_wrapper *resp);
+#ifdef _DUT_
+static int subscribe_events_handler(struct packet_wrapper *req, struct packet_wrapper *resp);
+static int unsubscribe_events_handler(struct packet_wrapper *req, struct packet_wrapper *resp);
+static int get_status_handler(struct packet_wrapper *req, struct packet_wrapper *resp);
+static int get_sta_scan_results_handler(struct packet_wrapper *req, struct packet_wrapper *resp);
+#endif /* End Of _DUT_ */
+#endif /* End Of CONFIG_ZEPHYR */
+#ifdef _TEST_PLATFORM_
+static int start_capture_handler(struct packet_wrapper *req, struct packet_wrapper *resp);
+static int stop_capture_handler(struct packet_wrapper *req, struct packet_wrapper *resp);
+#endif /* End Of _TEST_PLATFORM_ */
 
 #ifdef CONFIG_AP
 /* AP */
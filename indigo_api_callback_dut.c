@@ -26,7 +26,10 @@
 #include "utils.h"
 #include "wpa_ctrl.h"
 #include "indigo_api_callback.h"
+#include "wpas_config.h"
 #include "hs2_profile.h"
+#include "event_monitor.h"
+#include "p2p_tracker.h"
 
 static char pac_file_path[S_BUFFER_LEN] = {0};
 struct interface_info* band_transmitter[16];
@@ -40,6 +43,11 @@ void register_apis() {
     register_api(API_GET_IP_ADDR, NULL, get_ip_addr_handler);
     register_api(API_GET_MAC_ADDR, NULL, get_mac_addr_handler);
     register_api(API_GET_CONTROL_APP_VERSION, NULL, get_control_app_handler);
+    register_api(API_GET_LOOP_STATS, NULL, get_loop_stats_handler);
+    register_api(API_GET_API_STATS, NULL, get_api_stats_handler);
+    register_api(API_SUBSCRIBE_EVENTS, NULL, subscribe_events_handler);
+    register_api(API_UNSUBSCRIBE_EVENTS, NULL, unsubscribe_events_handler);
+    register_api(API_GET_STATUS, NULL, get_status_handler);
     register_api(API_START_LOOP_BACK_SERVER, NULL, start_loopback_server);
     register_api(API_STOP_LOOP_BACK_SERVER, NULL, stop_loop_back_server_handler);
     register_api(API_CREATE_NEW_INTERFACE_BRIDGE_NETWORK, NULL, create_bridge_network_handler);
@@ -75,6 +83,7 @@ void register_apis() {
     register_api(API_STA_REASSOCIATE, NULL, send_sta_reconnect_handler);
     register_api(API_STA_SET_PARAM, NULL, set_sta_parameter_handler);
     register_api(API_STA_SCAN, NULL, sta_scan_handler);
+    register_api(API_STA_GET_SCAN_RESULTS, NULL, get_sta_scan_results_handler);
 #ifdef CONFIG_WNM
     register_api(API_STA_SEND_BTM_QUERY, NULL, send_sta_btm_query_handler);
 #endif /* End Of CONFIG_WNM */
@@ -122,10 +131,94 @@ static int get_control_app_handler(struct packet_wrapper *req, struct packet_wra
     return 0;
 }
 
+/* Summary of the event loop callback statistics, the histograms go to the log */
+static int get_loop_stats_handler(struct packet_wrapper *req, struct packet_wrapper *resp) {
+    struct eloop_stats_summary summary;
+    struct tlv_hdr *tlv;
+    char buffer[16];
+
+    log_eloop_stats();
+    /* TLV: TLV_RESET_STATS. "1" clears the statistics after reading them */
+    tlv = find_wrapper_tlv_by_id(req, TLV_RESET_STATS);
+    get_eloop_stats_summary(&summary, tlv && tlv->len > 0 && tlv->value[0] == '1');
+
+    fill_wrapper_message_hdr(resp, API_CMD_RESPONSE, req->hdr.seq);
+    fill_wrapper_tlv_byte(resp, TLV_STATUS, TLV_VALUE_STATUS_OK);
+    fill_wrapper_tlv_bytes(resp, TLV_MESSAGE, strlen(TLV_VALUE_LOOP_STATS_OK), TLV_VALUE_LOOP_STATS_OK);
+    snprintf(buffer, sizeof(buffer), "%u", summary.callbacks);
+    fill_wrapper_tlv_bytes(resp, TLV_LOOP_STATS_CALLBACKS, strlen(buffer), buffer);
+    snprintf(buffer, sizeof(buffer), "%u", summary.stalls);
+    fill_wrapper_tlv_bytes(resp, TLV_LOOP_STATS_STALLS, strlen(buffer), buffer);
+    snprintf(buffer, sizeof(buffer), "%u", summary.max_us);
+    fill_wrapper_tlv_bytes(resp, TLV_LOOP_STATS_MAX_DURATION, strlen(buffer), buffer);
+    if (summary.max_name) {
+        fill_wrapper_tlv_bytes(resp, TLV_LOOP_STATS_MAX_HANDLER, strlen(summary.max_name), (char *)summary.max_name);
+    }
+    snprintf(buffer, sizeof(buffer), "%u", summary.late_max_us);
+    fill_wrapper_tlv_bytes(resp, TLV_LOOP_STATS_MAX_LATENESS, strlen(buffer), buffer);
+
+    return 0;
+}
+
+/* Per API counts, errors, sizes and latencies, see fill_api_metrics_response() */
+static int get_api_stats_handler(struct packet_wrapper *req, struct packet_wrapper *resp) {
+    fill_api_metrics_response(req, resp);
+    return 0;
+}
+
+/* Forward the hostapd and wpa_supplicant events to the tool, see event_monitor.h */
+static int subscribe_events_handler(struct packet_wrapper *req, struct packet_wrapper *resp) {
+    int status = TLV_VALUE_STATUS_NOT_OK;
+    char *message = TLV_VALUE_SUBSCRIBE_EVENTS_NOT_OK;
+    char filter[EVENT_FILTER_LEN], port[16];
+    struct sockaddr_in addr;
+    struct tlv_hdr *tlv = NULL;
+
+    if (tool_addr == NULL)
+        goto done;
+    memcpy(&addr, tool_addr, sizeof(addr));
+
+    /* TLV: TLV_EVENT_FILTER, e.g. "CTRL-EVENT-CONNECTED,AP-STA-CONNECTED" or "*" */
+    memset(filter, 0, sizeof(filter));
+    tlv = find_wrapper_tlv_by_id(req, TLV_EVENT_FILTER);
+    if (tlv) {
+        memcpy(filter, tlv->value, tlv->len);
+    } else {
+        strlcpy(filter, EVENT_DEFAULT_FILTER, sizeof(filter));
+    }
+    /* TLV: TLV_EVENT_PORT, the events are sent to the port of the request by default */
+    tlv = find_wrapper_tlv_by_id(req, TLV_EVENT_PORT);
+    if (tlv && tlv->len < sizeof(port)) {
+        memset(port, 0, sizeof(port));
+        memcpy(port, tlv->value, tlv->len);
+        addr.sin_port = htons(atoi(port));
+    }
+
+    if (event_monitor_subscribe(&addr, filter) == 0) {
+        indigo_logger(LOG_LEVEL_INFO, "Forward the events %s to port %d", filter, ntohs(addr.sin_port));
+        status = TLV_VALUE_STATUS_OK;
+        message = TLV_VALUE_SUBSCRIBE_EVENTS_OK;
+    }
+
+done:
+    fill_wrapper_message_hdr(resp, API_CMD_RESPONSE, req->hdr.seq);
+    fill_wrapper_tlv_byte(resp, TLV_STATUS, status);
+    fill_wrapper_tlv_bytes(resp, TLV_MESSAGE, strlen(message), message);
+    return 0;
+}
+
+static int unsubscribe_events_handler(struct packet_wrapper *req, struct packet_wrapper *resp) {
+    event_monitor_unsubscribe();
+
+    fill_wrapper_message_hdr(resp, API_CMD_RESPONSE, req->hdr.seq);
+    fill_wrapper_tlv_byte(resp, TLV_STATUS, TLV_VALUE_STATUS_OK);
+    fill_wrapper_tlv_bytes(resp, TLV_MESSAGE, strlen(TLV_VALUE_UNSUBSCRIBE_EVENTS_OK), TLV_VALUE_UNSUBSCRIBE_EVENTS_OK);
+    return 0;
+}
+
 static int reset_device_handler(struct packet_wrapper *req, struct packet_wrapper *resp) {
     int status = TLV_VALUE_STATUS_NOT_OK;
     char *message = TLV_VALUE_RESET_NOT_OK;
-    char buffer[TLV_VALUE_SIZE];
     char role[TLV_VALUE_SIZE], log_level[TLV_VALUE_SIZE], band[TLV_VALUE_SIZE];
     struct tlv_hdr *tlv = NULL;
 
@@ -152,11 +245,11 @@ static int reset_device_handler(struct packet_wrapper *req, struct packet_wrappe
 
     if (atoi(role) == DUT_TYPE_STAUT) {
         /* stop the wpa_supplicant and release IP address */
-        memset(buffer, 0, sizeof(buffer));
-        sprintf(buffer, "killall %s 1>/dev/null 2>/dev/null", get_wpas_exec_file());
-        system(buffer);
-        sleep(1);
-        reset_interface_ip(get_wireless_interface());
+        struct reset_step steps[] = {
+            { "stop wpa_supplicant", stop_process, get_wpas_exec_file(), 0, 0 },
+            { "flush address", reset_interface_ip, get_wireless_interface(), 0, 0 },
+        };
+        run_reset_steps(steps, sizeof(steps) / sizeof(steps[0]));
         if (strlen(log_level)) {
             set_wpas_debug_level(get_debug_level(atoi(log_level)));
         }
@@ -164,16 +257,16 @@ static int reset_device_handler(struct packet_wrapper *req, struct packet_wrappe
         sta_started = 0;
     } else if (atoi(role) == DUT_TYPE_APUT) {
 #ifdef CONFIG_AP
-        /* stop the hostapd and release IP address */
-        memset(buffer, 0, sizeof(buffer));
-        sprintf(buffer, "killall %s 1>/dev/null 2>/dev/null", get_hapd_exec_file());
-        system(buffer);
-        sleep(1);
-        reset_interface_ip(get_wireless_interface());
+        /* stop the hostapd, release IP address and remove the bridge */
+        struct reset_step steps[] = {
+            { "stop hostapd", stop_process, get_hapd_exec_file(), 0, 0 },
+            { "flush address", reset_interface_ip, get_wireless_interface(), 0, 0 },
+            { "remove bridge", reset_bridge, get_wlans_bridge(), 0, 0 },
+        };
+        run_reset_steps(steps, sizeof(steps) / sizeof(steps[0]));
         if (strlen(log_level)) {
             set_hostapd_debug_level(get_debug_level(atoi(log_level)));
         }
-        reset_bridge(get_wlans_bridge());
         /* reset interfaces info */
         clear_interfaces_resource();
 #endif /* End Of CONFIG_AP */
@@ -201,8 +294,6 @@ static int reset_device_handler(struct packet_wrapper *req, struct packet_wrappe
 
     vendor_device_reset();
 
-    sleep(1);
-
     status = TLV_VALUE_STATUS_OK;
     message = TLV_VALUE_RESET_OK;
 
@@ -895,6 +986,12 @@ static int configure_ap_handler(struct packet_wrapper *req, struct packet_wrappe
 #ifdef HOSTAPD_SUPPORT_MBSSID_WAR
 extern int use_openwrt_wpad;
 #endif
+/* iterate_all_wlan_interfaces_parallel() callback. The bands are set up concurrently */
+static void start_ap_set_wlan_params_worker(void *if_info, void *ctx) {
+    (void) ctx;
+    start_ap_set_wlan_params(if_info);
+}
+
 // RESP: {<ResponseTLV.STATUS: 40961>: '0', <ResponseTLV.MESSAGE: 40960>: 'AP is up : Hostapd service is active'}
 static int start_ap_handler(struct packet_wrapper *req, struct packet_wrapper *resp) {
     char *message = TLV_VALUE_HOSTAPD_START_OK;
@@ -905,7 +1002,7 @@ static int start_ap_handler(struct packet_wrapper *req, struct packet_wrapper *r
 #ifdef _WTS_OPENWRT_
     openwrt_apply_radio_config();
     // DFS wait again if set wlan params after hostapd starts
-    iterate_all_wlan_interfaces(start_ap_set_wlan_params);
+    iterate_all_wlan_interfaces_parallel(start_ap_set_wlan_params_worker, NULL);
 #endif
 
     memset(buffer, 0, sizeof(buffer));
@@ -934,7 +1031,7 @@ static int start_ap_handler(struct packet_wrapper *req, struct packet_wrapper *r
     }
 
 #ifndef _WTS_OPENWRT_
-    iterate_all_wlan_interfaces(start_ap_set_wlan_params);
+    iterate_all_wlan_interfaces_parallel(start_ap_set_wlan_params_worker, NULL);
 #endif
 
     bridge_init(get_wlans_bridge());
@@ -1070,7 +1167,7 @@ static int configure_ap_wsc_handler(struct packet_wrapper *req, struct packet_wr
 #ifdef _WTS_OPENWRT_
     openwrt_apply_radio_config();
     // DFS wait again if set wlan params after hostapd starts
-    iterate_all_wlan_interfaces(start_ap_set_wlan_params);
+    iterate_all_wlan_interfaces_parallel(start_ap_set_wlan_params_worker, NULL);
 #endif
 
     memset(buffer, 0, sizeof(buffer));
@@ -1099,7 +1196,7 @@ static int configure_ap_wsc_handler(struct packet_wrapper *req, struct packet_wr
     }
 
 #ifndef _WTS_OPENWRT_
-    iterate_all_wlan_interfaces(start_ap_set_wlan_params);
+    iterate_all_wlan_interfaces_parallel(start_ap_set_wlan_params_worker, NULL);
 #endif
 
     bridge_init(get_wlans_bridge());
@@ -1341,6 +1438,7 @@ static int get_mac_addr_handler(struct packet_wrapper *req, struct packet_wrappe
 
     char cmd[16];
     char response[L_BUFFER_LEN];
+    struct key_value_index kv_index;
 
     char band[S_BUFFER_LEN];
     char ssid[S_BUFFER_LEN];
@@ -1437,26 +1535,29 @@ static int get_mac_addr_handler(struct packet_wrapper *req, struct packet_wrappe
     wpa_ctrl_request(w, cmd, strlen(cmd), response, &resp_len, NULL);
 
     /* Check response */
-    get_key_value(connected_freq, response, "freq");
+    kv_index_build(&kv_index, response);
+    memset(connected_freq, 0, sizeof(connected_freq));
+    memset(connected_ssid, 0, sizeof(connected_ssid));
+    kv_index_get(&kv_index, "freq", connected_freq, sizeof(connected_freq));
 
     memset(mac_addr, 0, sizeof(mac_addr));
     if (atoi(role) == DUT_TYPE_STAUT) {
-        get_key_value(connected_ssid, response, "ssid");
-        get_key_value(mac_addr, response, "address");
+        kv_index_get(&kv_index, "ssid", connected_ssid, sizeof(connected_ssid));
+        kv_index_get(&kv_index, "address", mac_addr, sizeof(mac_addr));
     } else {
 #if HOSTAPD_SUPPORT_MBSSID
         if(bss_info.identifier >= 0) {
             sprintf(buff, "ssid[%d]", wlan->hapd_bss_id);
-            get_key_value(connected_ssid, response, buff);
+            kv_index_get(&kv_index, buff, connected_ssid, sizeof(connected_ssid));
             sprintf(buff, "bssid[%d]", wlan->hapd_bss_id);
-            get_key_value(mac_addr, response, buff);
+            kv_index_get(&kv_index, buff, mac_addr, sizeof(mac_addr));
         } else {
-            get_key_value(connected_ssid, response, "ssid[0]");
-            get_key_value(mac_addr, response, "bssid[0]");
+            kv_index_get(&kv_index, "ssid[0]", connected_ssid, sizeof(connected_ssid));
+            kv_index_get(&kv_index, "bssid[0]", mac_addr, sizeof(mac_addr));
         }
 #else
-        get_key_value(connected_ssid, response, "ssid[0]");
-        get_key_value(mac_addr, response, "bssid[0]");
+        kv_index_get(&kv_index, "ssid[0]", connected_ssid, sizeof(connected_ssid));
+        kv_index_get(&kv_index, "bssid[0]", mac_addr, sizeof(mac_addr));
 #endif
     }
 
@@ -1517,6 +1618,7 @@ done:
 }
 
 static int start_loopback_server(struct packet_wrapper *req, struct packet_wrapper *resp) {
+    struct tlv_hdr *tlv;
     char local_ip[256];
     int status = TLV_VALUE_STATUS_NOT_OK;
     char *message = TLV_VALUE_LOOPBACK_SVR_START_NOT_OK;
@@ -1545,6 +1647,10 @@ static int start_loopback_server(struct packet_wrapper *req, struct packet_wrapp
         indigo_logger(LOG_LEVEL_ERROR, "No available interface");
         goto done;
     }
+    /* TLV: TLV_TIMESTAMPING. "1" timestamps the echoes in the kernel */
+    tlv = find_wrapper_tlv_by_id(req, TLV_TIMESTAMPING);
+    loopback_set_timestamping(tlv && tlv->len > 0 && tlv->value[0] == '1');
+
     /* Start loopback */
     if (!loopback_server_start(local_ip, tool_udp_port, LOOPBACK_TIMEOUT)) {
         status = TLV_VALUE_STATUS_OK;
@@ -1561,13 +1667,22 @@ done:
 
 // RESP: {<ResponseTLV.STATUS: 40961>: '0', <ResponseTLV.MESSAGE: 40960>: 'Loopback server in idle state'}
 static int stop_loop_back_server_handler(struct packet_wrapper *req, struct packet_wrapper *resp) {
+    struct traffic_echo_stats stats;
+    char recv_count[16], send_count[16];
+
     /* Stop loopback */
     if (loopback_server_status()) {
         loopback_server_stop();
     }
+    loopback_server_get_stats(&stats);
+    snprintf(recv_count, sizeof(recv_count), "%u", stats.received);
+    snprintf(send_count, sizeof(send_count), "%u", stats.echoed);
+
     fill_wrapper_message_hdr(resp, API_CMD_RESPONSE, req->hdr.seq);
     fill_wrapper_tlv_byte(resp, TLV_STATUS, TLV_VALUE_STATUS_OK);
     fill_wrapper_tlv_bytes(resp, TLV_MESSAGE, strlen(TLV_VALUE_LOOP_BACK_STOP_OK), TLV_VALUE_LOOP_BACK_STOP_OK);
+    fill_wrapper_tlv_bytes(resp, TLV_LOOP_BACK_DATA_RECEIVED, strlen(recv_count), recv_count);
+    fill_wrapper_tlv_bytes(resp, TLV_LOOP_BACK_DATA_SENT, strlen(send_count), send_count);
 
     return 0;
 }
@@ -1774,38 +1889,37 @@ done:
 }
 #endif /* End Of CONFIG_AP */
 
+/* IP address of the P2P group interface, the bridge or the wireless interface */
+static int find_dut_ip_addr(char *buffer, int size, int role) {
+#ifdef CONFIG_P2P
+    char if_name[32];
+
+    if (role == DUT_TYPE_P2PUT && get_p2p_group_if(if_name, sizeof(if_name)) == 0 && find_interface_ip(buffer, size, if_name)) {
+        return 1;
+    }
+#else
+    (void)role;
+#endif /* End Of CONFIG_P2P */
+    if (find_interface_ip(buffer, size, get_wlans_bridge())) {
+        return 1;
+    }
+    return find_interface_ip(buffer, size, get_wireless_interface());
+}
+
 static int get_ip_addr_handler(struct packet_wrapper *req, struct packet_wrapper *resp) {
     int status = TLV_VALUE_STATUS_NOT_OK;
     char *message = NULL;
     char buffer[64];
     struct tlv_hdr *tlv = NULL;
     char value[16];
-#ifdef CONFIG_P2P
-    char if_name[32];
-    int role = 0;
-#endif /* End Of CONFIG_P2P */
-
 
     memset(value, 0, sizeof(value));
     tlv = find_wrapper_tlv_by_id(req, TLV_ROLE);
     if (tlv) {
             memcpy(value, tlv->value, tlv->len);
-#ifdef CONFIG_P2P
-            role = atoi(value);
-#endif /* End Of CONFIG_P2P */
     }
 
-#ifdef CONFIG_P2P
-    if (role == DUT_TYPE_P2PUT && get_p2p_group_if(if_name, sizeof(if_name)) == 0 && find_interface_ip(buffer, sizeof(buffer), if_name)) {
-        status = TLV_VALUE_STATUS_OK;
-        message = TLV_VALUE_OK;
-    } else if (find_interface_ip(buffer, sizeof(buffer), get_wlans_bridge())) {
-#else
-    if (find_interface_ip(buffer, sizeof(buffer), get_wlans_bridge())) {
-#endif /* End Of CONFIG_P2P */
-        status = TLV_VALUE_STATUS_OK;
-        message = TLV_VALUE_OK;
-    } else if (find_interface_ip(buffer, sizeof(buffer), get_wireless_interface())) {
+    if (find_dut_ip_addr(buffer, sizeof(buffer), atoi(value))) {
         status = TLV_VALUE_STATUS_OK;
         message = TLV_VALUE_OK;
     } else {
@@ -1822,6 +1936,148 @@ static int get_ip_addr_handler(struct packet_wrapper *req, struct packet_wrapper
     return 0;
 }
 
+/* Fields of API_GET_STATUS. The daemon fields come from one STATUS of the daemon of the role,
+ * the hostapd keys are formatted with the BSS index */
+static const struct status_field {
+    const char *name;
+    unsigned short tlv;
+    const char *sta_key;
+    const char *ap_key;
+} status_fields[] = {
+    { "version", TLV_CONTROL_APP_VERSION, NULL, NULL },
+    { "ip", TLV_DUT_WLAN_IP_ADDR, NULL, NULL },
+    { "mac", TLV_DUT_MAC_ADDR, "address", "bssid[%d]" },
+    { "ssid", TLV_STATUS_SSID, "ssid", "ssid[%d]" },
+    { "bssid", TLV_STATUS_BSSID, "bssid", "bssid[%d]" },
+    { "freq", TLV_STATUS_FREQ, "freq", "freq" },
+    { "state", TLV_STATUS_STATE, "wpa_state", "state" },
+};
+
+/* One response with the fields listed in TLV_STATUS_FIELDS instead of a GET_* request per field */
+static int get_status_handler(struct packet_wrapper *req, struct packet_wrapper *resp) {
+    int status = TLV_VALUE_STATUS_NOT_OK;
+    char *message = TLV_VALUE_GET_STATUS_NOT_OK;
+    struct tlv_hdr *tlv;
+    struct wpa_ctrl *w = NULL;
+    struct key_value_index kv_index;
+    struct bss_identifier_info bss_info;
+    struct interface_info *wlan = NULL;
+    const struct status_field *field;
+    char fields[S_BUFFER_LEN], missing[S_BUFFER_LEN], value[S_BUFFER_LEN], key[32];
+    char response[L_BUFFER_LEN];
+    char *name, *saveptr = NULL;
+    size_t resp_len;
+    int role = 0, bss_index = 0, queried = 0, found;
+    unsigned int i;
+
+    /* TLV: TLV_ROLE */
+    memset(value, 0, sizeof(value));
+    tlv = find_wrapper_tlv_by_id(req, TLV_ROLE);
+    if (tlv) {
+        memcpy(value, tlv->value, tlv->len);
+        role = atoi(value);
+    }
+    /* TLV: TLV_BSS_IDENTIFIER */
+    memset(&bss_info, 0, sizeof(bss_info));
+    bss_info.identifier = -1;
+    tlv = find_wrapper_tlv_by_id(req, TLV_BSS_IDENTIFIER);
+    if (tlv) {
+        memset(value, 0, sizeof(value));
+        memcpy(value, tlv->value, tlv->len);
+        parse_bss_identifier(atoi(value), &bss_info);
+    }
+    /* TLV: TLV_STATUS_FIELDS, e.g. "mac,ip,ssid". All fields by default */
+    memset(fields, 0, sizeof(fields));
+    tlv = find_wrapper_tlv_by_id(req, TLV_STATUS_FIELDS);
+    if (tlv) {
+        memcpy(fields, tlv->value, tlv->len);
+    } else {
+        for (i = 0; i < sizeof(status_fields) / sizeof(status_fields[0]); i++) {
+            snprintf(fields + strlen(fields), sizeof(fields) - strlen(fields), "%s%s", i ? "," : "", status_fields[i].name);
+        }
+    }
+
+    fill_wrapper_message_hdr(resp, API_CMD_RESPONSE, req->hdr.seq);
+    memset(missing, 0, sizeof(missing));
+    memset(&kv_index, 0, sizeof(kv_index));
+    for (name = strtok_r(fields, ",", &saveptr); name; name = strtok_r(NULL, ",", &saveptr)) {
+        field = NULL;
+        for (i = 0; i < sizeof(status_fields) / sizeof(status_fields[0]); i++) {
+            if (strcmp(name, status_fields[i].name) == 0) {
+                field = &status_fields[i];
+                break;
+            }
+        }
+
+        found = 0;
+        memset(value, 0, sizeof(value));
+        if (field == NULL) {
+            /* Unknown fields are reported as missing */
+        } else if (field->tlv == TLV_CONTROL_APP_VERSION) {
+#ifdef _VERSION_
+            snprintf(value, sizeof(value), "%s", _VERSION_);
+#else
+            snprintf(value, sizeof(value), "%s", TLV_VALUE_APP_VERSION);
+#endif
+            found = 1;
+        } else if (field->tlv == TLV_DUT_WLAN_IP_ADDR) {
+            found = find_dut_ip_addr(value, sizeof(value), role);
+        } else if (field->tlv == TLV_DUT_MAC_ADDR && role != DUT_TYPE_STAUT && role != DUT_TYPE_APUT) {
+            /* Same as GET_MAC_ADDR without a daemon query */
+#ifdef CONFIG_P2P
+            if (role != DUT_TYPE_P2PUT || get_p2p_mac_addr(value, sizeof(value)))
+#endif /* End Of CONFIG_P2P */
+                get_mac_address(value, sizeof(value), get_wireless_interface());
+            found = strlen(value) > 0;
+        } else if (role == DUT_TYPE_STAUT || role == DUT_TYPE_APUT) {
+            /* The first daemon field queries the STATUS, the others reuse the reply */
+            if (!queried) {
+                queried = 1;
+                if (role == DUT_TYPE_STAUT) {
+                    w = wpa_ctrl_open(get_wpas_ctrl_path());
+                } else {
+#ifdef CONFIG_AP
+                    wlan = get_wireless_interface_info(bss_info.band, bss_info.identifier);
+                    w = wpa_ctrl_open(get_hapd_ctrl_path_by_id(wlan));
+#if HOSTAPD_SUPPORT_MBSSID
+                    if (wlan && bss_info.identifier >= 0)
+                        bss_index = wlan->hapd_bss_id;
+#endif
+#endif /* End Of CONFIG_AP */
+                }
+                if (w) {
+                    resp_len = sizeof(response) - 1;
+                    memset(response, 0, sizeof(response));
+                    if (wpa_ctrl_request(w, "STATUS", strlen("STATUS"), response, &resp_len, NULL) == 0)
+                        kv_index_build(&kv_index, response);
+                    wpa_ctrl_close(w);
+                } else {
+                    indigo_logger(LOG_LEVEL_ERROR, "Failed to connect to %s", role == DUT_TYPE_STAUT ? "wpa_supplicant" : "hostapd");
+                }
+            }
+            snprintf(key, sizeof(key), role == DUT_TYPE_STAUT ? field->sta_key : field->ap_key, bss_index);
+            found = kv_index_get(&kv_index, key, value, sizeof(value)) == 0 && strlen(value) > 0;
+        }
+
+        if (found) {
+            fill_wrapper_tlv_bytes(resp, field->tlv, strlen(value), value);
+        } else {
+            snprintf(missing + strlen(missing), sizeof(missing) - strlen(missing), "%s%s", strlen(missing) ? "," : "", name);
+        }
+    }
+
+    if (strlen(missing)) {
+        indigo_logger(LOG_LEVEL_DEBUG, "Status fields %s are not available", missing);
+        fill_wrapper_tlv_bytes(resp, TLV_STATUS_MISSING_FIELDS, strlen(missing), missing);
+    } else {
+        status = TLV_VALUE_STATUS_OK;
+        message = TLV_VALUE_OK;
+    }
+    fill_wrapper_tlv_byte(resp, TLV_STATUS, status);
+    fill_wrapper_tlv_bytes(resp, TLV_MESSAGE, strlen(message), message);
+    return 0;
+}
+
 static int stop_sta_handler(struct packet_wrapper *req, struct packet_wrapper *resp) {
     int len = 0, reset = 0;
     char buffer[S_BUFFER_LEN], reset_type[16];
@@ -2018,7 +2274,7 @@ static int configure_sta_handler(struct packet_wrapper *req, struct packet_wrapp
     len = generate_wpas_config(buffer, sizeof(buffer), req);
     if (len) {
         sta_configured = 1;
-        write_file(get_wpas_conf_file(), buffer, len);
+        wpas_conf_write_buffer(get_wpas_conf_file(), buffer);
     }
 
     fill_wrapper_message_hdr(resp, API_CMD_RESPONSE, req->hdr.seq);
@@ -2266,10 +2522,7 @@ static int start_up_p2p_handler(struct packet_wrapper *req, struct packet_wrappe
     sleep(1);
 #endif
 
-    memset(buffer, 0, sizeof(buffer));
-    sprintf(buffer, "killall %s 1>/dev/null 2>/dev/null", get_wpas_exec_file());
-    system(buffer);
-    sleep(3);
+    stop_process(get_wpas_exec_file());
 
     /* Generate P2P config file */
     sprintf(buffer, "ctrl_interface=%s\n", WPAS_CTRL_PATH_DEFAULT);
@@ -2281,7 +2534,7 @@ static int start_up_p2p_handler(struct packet_wrapper *req, struct packet_wrappe
     len = strlen(buffer);
 
     if (len) {
-        write_file(get_wpas_conf_file(), buffer, len);
+        wpas_conf_write_buffer(get_wpas_conf_file(), buffer);
     }
 
     /* Start WPA supplicant */
@@ -2292,7 +2545,9 @@ static int start_up_p2p_handler(struct packet_wrapper *req, struct packet_wrappe
         get_wpas_debug_arguments(),
         get_wireless_interface());
     len = system(buffer);
-    sleep(2);
+    wait_ctrl_interface(get_wpas_ctrl_path(), WPAS_START_TIMEOUT_MS);
+    /* The P2P handlers wait for the tracked state changes */
+    p2p_tracker_start(get_wireless_interface());
 
     status = TLV_VALUE_STATUS_OK;
     message = TLV_VALUE_WPA_S_START_UP_OK;
@@ -2419,6 +2674,7 @@ static int add_p2p_group_handler(struct packet_wrapper *req, struct packet_wrapp
     memset(buffer, 0, sizeof(buffer));
     memset(response, 0, sizeof(response));
     sprintf(buffer, "P2P_GROUP_ADD freq=%s%s", freq, he);
+    p2p_tracker_expect(P2P_EVENT_GROUP_STARTED | P2P_EVENT_GROUP_FAILURE);
     resp_len = sizeof(response) - 1;
     wpa_ctrl_request(w, buffer, strlen(buffer), response, &resp_len, NULL);
     /* Check response */
@@ -2426,6 +2682,11 @@ static int add_p2p_group_handler(struct packet_wrapper *req, struct packet_wrapp
         indigo_logger(LOG_LEVEL_ERROR, "Failed to execute the command. Response: %s", response);
         goto done;
     }
+    /* The group interface is used by the next requests */
+    if (p2p_tracker_wait(P2P_EVENT_GROUP_STARTED | P2P_EVENT_GROUP_FAILURE, P2P_GROUP_WAIT_TIMEOUT_MS) & P2P_EVENT_GROUP_FAILURE) {
+        indigo_logger(LOG_LEVEL_ERROR, "P2P group formation failed");
+        goto done;
+    }
     status = TLV_VALUE_STATUS_OK;
     message = TLV_VALUE_OK;
 
@@ -2470,6 +2731,7 @@ static int stop_p2p_group_handler(struct packet_wrapper *req, struct packet_wrap
     memset(buffer, 0, sizeof(buffer));
     memset(response, 0, sizeof(response));
     sprintf(buffer, "P2P_GROUP_REMOVE %s", if_name);
+    p2p_tracker_expect(P2P_EVENT_GROUP_REMOVED);
     resp_len = sizeof(response) - 1;
     wpa_ctrl_request(w, buffer, strlen(buffer), response, &resp_len, NULL);
     /* Check response */
@@ -2477,6 +2739,7 @@ static int stop_p2p_group_handler(struct packet_wrapper *req, struct packet_wrap
         indigo_logger(LOG_LEVEL_ERROR, "Failed to execute the command. Response: %s", response);
         goto done;
     }
+    p2p_tracker_wait(P2P_EVENT_GROUP_REMOVED, P2P_GROUP_WAIT_TIMEOUT_MS);
     if (w) {
         wpa_ctrl_close(w);
         w = NULL;
@@ -2623,6 +2886,9 @@ static int p2p_invite_handler(struct packet_wrapper *req, struct packet_wrapper
         goto done;
     }
 
+    /* The invitation fails until the peer is discovered */
+    p2p_tracker_wait_peer(addr, P2P_PEER_WAIT_TIMEOUT_MS);
+
     /* Can use global ctrl if global ctrl is initialized */
     get_p2p_dev_if(p2p_dev_if, sizeof(p2p_dev_if));
     indigo_logger(LOG_LEVEL_DEBUG, "P2P Dev IF: %s", p2p_dev_if);
@@ -2748,6 +3014,11 @@ static int p2p_connect_handler(struct packet_wrapper *req, struct packet_wrapper
     }
     indigo_logger(LOG_LEVEL_DEBUG, "Command: %s", buffer);
 
+    /* Except for auth, which waits for the peer to connect, the peer must be discovered first */
+    if (strcmp(type, " auth")) {
+        p2p_tracker_wait_peer(mac, P2P_PEER_WAIT_TIMEOUT_MS);
+    }
+
     /* Open wpa_supplicant UDS socket */
     w = wpa_ctrl_open(get_wpas_ctrl_path());
     if (!w) {
@@ -2777,14 +3048,20 @@ done:
 }
 #endif /* End Of CONFIG_P2P */
 
+/* SCAN-FAILED is the second event of both, it ends the wait on a rejected scan */
+static const char *scan_start_events[] = { "CTRL-EVENT-SCAN-STARTED", "CTRL-EVENT-SCAN-FAILED", NULL };
+static const char *scan_events[] = { "CTRL-EVENT-SCAN-RESULTS", "CTRL-EVENT-SCAN-FAILED", NULL };
+
 static int sta_scan_handler(struct packet_wrapper *req, struct packet_wrapper *resp) {
     int len, status = TLV_VALUE_STATUS_NOT_OK;
     char *message = TLV_VALUE_WPA_S_SCAN_NOT_OK;
     char buffer[1024];
     char response[1024];
     struct tlv_hdr *tlv = NULL;
-    struct wpa_ctrl *w = NULL;
+    struct wpa_ctrl *w = NULL, *monitor = NULL;
     size_t resp_len, i;
+    int timeout_ms = SCAN_WAIT_TIMEOUT_MS, elapsed_ms, event;
+    unsigned long long start_us;
     struct tlv_to_config_name* cfg = NULL;
     char value[TLV_VALUE_SIZE], cfg_item[2*S_BUFFER_LEN];
 
@@ -2808,7 +3085,7 @@ static int sta_scan_handler(struct packet_wrapper *req, struct packet_wrapper *r
     }
     len = strlen(buffer);
     if (len) {
-        write_file(get_wpas_conf_file(), buffer, len);
+        wpas_conf_write_buffer(get_wpas_conf_file(), buffer);
     }
 
     memset(buffer, 0 ,sizeof(buffer));
@@ -2817,7 +3094,7 @@ static int sta_scan_handler(struct packet_wrapper *req, struct packet_wrapper *r
         get_wpas_conf_file(),
         get_wireless_interface());
     len = system(buffer);
-    sleep(2);
+    wait_ctrl_interface(get_wpas_ctrl_path(), WPAS_START_TIMEOUT_MS);
 
     /* Open wpa_supplicant UDS socket */
     w = wpa_ctrl_open(get_wpas_ctrl_path());
@@ -2827,6 +3104,15 @@ static int sta_scan_handler(struct packet_wrapper *req, struct packet_wrapper *r
         message = TLV_VALUE_WPA_S_CTRL_NOT_OK;
         goto done;
     }
+    /* TLV: TLV_WAIT_TIMEOUT */
+    tlv = find_wrapper_tlv_by_id(req, TLV_WAIT_TIMEOUT);
+    if (tlv) {
+        memset(value, 0, sizeof(value));
+        memcpy(value, tlv->value, tlv->len);
+        timeout_ms = atoi(value);
+    }
+    /* Attach before the SCAN, the results event must not be missed */
+    monitor = open_ctrl_monitor(get_wpas_ctrl_path());
     // SCAN
     memset(buffer, 0, sizeof(buffer));
     memset(response, 0, sizeof(response));
@@ -2839,7 +3125,20 @@ static int sta_scan_handler(struct packet_wrapper *req, struct packet_wrapper *r
         goto done;
     }
     indigo_logger(LOG_LEVEL_DEBUG, "%s -> resp: %s\n", buffer, response);
-    sleep(10);
+    /* The results of a startup or background scan may come first. Only take the
+     * results after the scan started by the command. A scan that is still running
+     * at the deadline is reported as before, with the results so far. */
+    start_us = get_api_metrics_time_us();
+    event = wait_ctrl_event(monitor, scan_start_events, NULL, 0, timeout_ms);
+    if (event == 0) {
+        elapsed_ms = (get_api_metrics_time_us() - start_us) / 1000;
+        event = wait_ctrl_event(monitor, scan_events, NULL, 0, timeout_ms > elapsed_ms ? timeout_ms - elapsed_ms : 0);
+    }
+    if (event == 1) {
+        indigo_logger(LOG_LEVEL_ERROR, "wpa_supplicant failed to scan");
+        goto done;
+    }
+    scan_results_update(w);
 
     status = TLV_VALUE_STATUS_OK;
     message = TLV_VALUE_OK;
@@ -2848,12 +3147,65 @@ done:
     fill_wrapper_message_hdr(resp, API_CMD_RESPONSE, req->hdr.seq);
     fill_wrapper_tlv_byte(resp, TLV_STATUS, status);
     fill_wrapper_tlv_bytes(resp, TLV_MESSAGE, strlen(message), message);
+    close_ctrl_monitor(monitor);
     if (w) {
         wpa_ctrl_close(w);
     }
     return 0;
 }
 
+/* Results of the last scan of STA_SCAN or SEND_ANQP_QUERY. TLV_SSID selects one SSID */
+static int get_sta_scan_results_handler(struct packet_wrapper *req, struct packet_wrapper *resp) {
+    int status = TLV_VALUE_STATUS_NOT_OK;
+    char *message = TLV_VALUE_SCAN_RESULTS_NOT_OK;
+    struct scan_result *results = NULL;
+    struct tlv_hdr *tlv = NULL;
+    char ssid[S_BUFFER_LEN], buffer[S_BUFFER_LEN];
+    int i, count, age_ms = 0, matched = 0, len, size;
+
+    memset(ssid, 0, sizeof(ssid));
+    tlv = find_wrapper_tlv_by_id(req, TLV_SSID);
+    if (tlv) {
+        memcpy(ssid, tlv->value, tlv->len);
+    }
+
+    fill_wrapper_message_hdr(resp, API_CMD_RESPONSE, req->hdr.seq);
+    count = scan_results_get(&results, &age_ms);
+    if (count >= 0) {
+        status = TLV_VALUE_STATUS_OK;
+        message = TLV_VALUE_OK;
+    }
+    fill_wrapper_tlv_byte(resp, TLV_STATUS, status);
+    fill_wrapper_tlv_bytes(resp, TLV_MESSAGE, strlen(message), message);
+    if (count < 0) {
+        return 0;
+    }
+
+    snprintf(buffer, sizeof(buffer), "%d", age_ms);
+    fill_wrapper_tlv_bytes(resp, TLV_SCAN_RESULT_AGE, strlen(buffer), buffer);
+    /* One "bssid<TAB>freq<TAB>signal<TAB>ssid" TLV per BSS, as many as fit with the count TLV */
+    size = 7 + 3 + 8;
+    for (i = 0; i < (int)resp->tlv_num; i++) {
+        size += 3 + resp->tlv[i]->len;
+    }
+    for (i = 0; i < count; i++) {
+        if (strlen(ssid) && strcmp(ssid, results[i].ssid)) {
+            continue;
+        }
+        len = snprintf(buffer, sizeof(buffer), "%s\t%d\t%d\t%s", results[i].bssid, results[i].freq, results[i].signal, results[i].ssid);
+        len = len > 255 ? 255 : len;
+        if (size + 3 + len > BUFFER_LEN || resp->tlv_num >= TLV_NUM - 1) {
+            break;
+        }
+        size += 3 + len;
+        fill_wrapper_tlv_bytes(resp, TLV_SCAN_RESULT, len, buffer);
+        matched++;
+    }
+    snprintf(buffer, sizeof(buffer), "%d", matched);
+    fill_wrapper_tlv_bytes(resp, TLV_SCAN_RESULT_COUNT, strlen(buffer), buffer);
+    return 0;
+}
+
 #ifdef CONFIG_HS20
 static int send_sta_anqp_query_handler(struct packet_wrapper *req, struct packet_wrapper *resp) {
     int len, status = TLV_VALUE_STATUS_NOT_OK;
@@ -2863,8 +3215,11 @@ static int send_sta_anqp_query_handler(struct packet_wrapper *req, struct packet
     char bssid[256];
     char anqp_info_id[256];
     struct tlv_hdr *tlv = NULL;
-    struct wpa_ctrl *w = NULL;
+    struct wpa_ctrl *w = NULL, *monitor = NULL;
     size_t resp_len, i;
+    int timeout_ms = ANQP_WAIT_TIMEOUT_MS;
+    const char *anqp_events[] = { "ANQP-QUERY-DONE", NULL };
+    char timeout[16];
     char *token = NULL;
     char *delimit = ";";
     char realm[S_BUFFER_LEN];
@@ -2873,7 +3228,7 @@ static int send_sta_anqp_query_handler(struct packet_wrapper *req, struct packet
     memset(buffer, 0, sizeof(buffer));
     len = sprintf(buffer, "ctrl_interface=%s\nap_scan=1\n", WPAS_CTRL_PATH_DEFAULT);
     if (len) {
-        write_file(get_wpas_conf_file(), buffer, len);
+        wpas_conf_write_buffer(get_wpas_conf_file(), buffer);
     }
 
     memset(buffer, 0 ,sizeof(buffer));
@@ -2882,7 +3237,7 @@ static int send_sta_anqp_query_handler(struct packet_wrapper *req, struct packet
         get_wpas_conf_file(),
         get_wireless_interface());
     len = system(buffer);
-    sleep(2);
+    wait_ctrl_interface(get_wpas_ctrl_path(), WPAS_START_TIMEOUT_MS);
 
     /* Open wpa_supplicant UDS socket */
     w = wpa_ctrl_open(get_wpas_ctrl_path());
@@ -2892,6 +3247,14 @@ static int send_sta_anqp_query_handler(struct packet_wrapper *req, struct packet
         message = TLV_VALUE_WPA_S_CTRL_NOT_OK;
         goto done;
     }
+    /* TLV: TLV_WAIT_TIMEOUT */
+    tlv = find_wrapper_tlv_by_id(req, TLV_WAIT_TIMEOUT);
+    if (tlv && tlv->len < sizeof(timeout)) {
+        memset(timeout, 0, sizeof(timeout));
+        memcpy(timeout, tlv->value, tlv->len);
+        timeout_ms = atoi(timeout);
+    }
+    monitor = open_ctrl_monitor(get_wpas_ctrl_path());
     // SCAN
     memset(buffer, 0, sizeof(buffer));
     memset(response, 0, sizeof(response));
@@ -2903,7 +3266,8 @@ static int send_sta_anqp_query_handler(struct packet_wrapper *req, struct packet
         indigo_logger(LOG_LEVEL_ERROR, "Failed to execute the command. Response: %s", response);
         goto done;
     }
-    sleep(10);
+    wait_ctrl_event(monitor, scan_events, NULL, 0, timeout_ms);
+    scan_results_update(w);
 
     /* TLV: BSSID */
     tlv = find_wrapper_tlv_by_id(req, TLV_BSSID);
@@ -2959,6 +3323,8 @@ static int send_sta_anqp_query_handler(struct packet_wrapper *req, struct packet
         indigo_logger(LOG_LEVEL_ERROR, "Failed to execute the command. Response: %s", response);
         goto done;
     }
+    /* The response comes from the AP, report the query once it is done */
+    wait_ctrl_event(monitor, anqp_events, NULL, 0, timeout_ms);
     status = TLV_VALUE_STATUS_OK;
     message = TLV_VALUE_OK;
 
@@ -2966,6 +3332,7 @@ done:
     fill_wrapper_message_hdr(resp, API_CMD_RESPONSE, req->hdr.seq);
     fill_wrapper_tlv_byte(resp, TLV_STATUS, status);
     fill_wrapper_tlv_bytes(resp, TLV_MESSAGE, strlen(message), message);
+    close_ctrl_monitor(monitor);
     if (w) {
         wpa_ctrl_close(w);
     }
@@ -3026,7 +3393,7 @@ done:
 static int sta_add_credential_handler(struct packet_wrapper *req, struct packet_wrapper *resp) {
     char *message = TLV_VALUE_WPA_S_ADD_CRED_NOT_OK;
     char buffer[BUFFER_LEN];
-    int len, status = TLV_VALUE_STATUS_NOT_OK, cred_id, wpa_ret;
+    int status = TLV_VALUE_STATUS_NOT_OK, cred_id, wpa_ret;
     size_t resp_len, i;
     char response[BUFFER_LEN];
     char param_value[256];
@@ -3046,12 +3413,10 @@ static int sta_add_credential_handler(struct packet_wrapper *req, struct packet_
         system(buffer);
         sleep(3);
 
-        memset(buffer, 0, sizeof(buffer));
-        sprintf(buffer, "ctrl_interface=%s\nap_scan=1\n", WPAS_CTRL_PATH_DEFAULT);
-        len = strlen(buffer);
-        if (len) {
-            write_file(get_wpas_conf_file(), buffer, len);
-        }
+        wpas_conf_reset();
+        wpas_conf_set_global("ctrl_interface", WPAS_CTRL_PATH_DEFAULT);
+        wpas_conf_set_global("ap_scan", "1");
+        wpas_conf_save(get_wpas_conf_file());
     }
     if (sta_started == 0) {
         sta_started = 1;
@@ -3062,7 +3427,7 @@ static int sta_add_credential_handler(struct packet_wrapper *req, struct packet_
             get_wpas_conf_file(),
             get_wpas_debug_arguments(),
             get_wireless_interface());
-        len = system(buffer);
+        system(buffer);
         sleep(2);
     }
 
@@ -3153,19 +3518,15 @@ static int run_hs20_osu_client(const char *params)
 static int set_sta_install_ppsmo_handler(struct packet_wrapper *req, struct packet_wrapper *resp) {
     int status = TLV_VALUE_STATUS_NOT_OK;
     char *message = TLV_VALUE_HS2_INSTALL_PPSMO_NOT_OK;
-    int len;
     char buffer[L_BUFFER_LEN], ppsmo_file[S_BUFFER_LEN];
     struct tlv_hdr *tlv;
     char *fqdn = NULL;
     char fqdn_buf[S_BUFFER_LEN];
 
-    memset(buffer, 0, sizeof(buffer));
-    snprintf(buffer, sizeof(buffer), "ctrl_interface=%s\nap_scan=1\n", WPAS_CTRL_PATH_DEFAULT);
-
-    len = strlen(buffer);
-    if (len) {
-        write_file(get_wpas_conf_file(), buffer, len);
-    }
+    wpas_conf_reset();
+    wpas_conf_set_global("ctrl_interface", WPAS_CTRL_PATH_DEFAULT);
+    wpas_conf_set_global("ap_scan", "1");
+    wpas_conf_save(get_wpas_conf_file());
 
     snprintf(buffer, sizeof(buffer), "%s -B -t -c %s -i %s -f /var/log/supplicant.log",
             get_wpas_full_exec_path(),
@@ -3718,7 +4079,7 @@ static int enable_wsc_sta_handler(struct packet_wrapper *req, struct packet_wrap
     len = strlen(buffer);
 
     if (len) {
-        write_file(get_wpas_conf_file(), buffer, len);
+        wpas_conf_write_buffer(get_wpas_conf_file(), buffer);
     }
 
     /* Start wpa supplicant */
@@ -27,7 +27,9 @@
 #include "utils.h"
 #include "wpa_ctrl.h"
 #include "indigo_api_callback.h"
+#include "wpas_config.h"
 #include "hs2_profile.h"
+#include "capture.h"
 
 struct sta_platform_config sta_hw_config = {PHYMODE_AUTO, CHWIDTH_AUTO, false, false};
 struct interface_info* band_transmitter[16];
@@ -47,6 +49,8 @@ void register_apis() {
     /* Basic */
     register_api(API_GET_MAC_ADDR, NULL, get_mac_addr_handler);
     register_api(API_GET_CONTROL_APP_VERSION, NULL, get_control_app_handler);
+    register_api(API_GET_LOOP_STATS, NULL, get_loop_stats_handler);
+    register_api(API_GET_API_STATS, NULL, get_api_stats_handler);
     register_api(API_SEND_LOOP_BACK_DATA, NULL, send_loopback_data_handler);
     register_api(API_STOP_LOOP_BACK_DATA, NULL, stop_loopback_data_handler);
     register_api(API_START_LOOP_BACK_SERVER, NULL, start_loopback_server);
@@ -55,6 +59,8 @@ void register_apis() {
     register_api(API_ASSIGN_STATIC_IP, NULL, assign_static_ip_handler);
     register_api(API_START_DHCP, NULL, start_dhcp_handler);
     register_api(API_STOP_DHCP, NULL, stop_dhcp_handler);
+    register_api(API_START_CAPTURE, NULL, start_capture_handler);
+    register_api(API_STOP_CAPTURE, NULL, stop_capture_handler);
 #ifdef CONFIG_WPS
     register_api(API_GET_WSC_CRED, NULL, get_wsc_cred_handler);
 #endif /* End Of CONFIG_WPS */
@@ -96,6 +102,41 @@ static int get_control_app_handler(struct packet_wrapper *req, struct packet_wra
     return 0;
 }
 
+/* Summary of the event loop callback statistics, the histograms go to the log */
+static int get_loop_stats_handler(struct packet_wrapper *req, struct packet_wrapper *resp) {
+    struct eloop_stats_summary summary;
+    struct tlv_hdr *tlv;
+    char buffer[16];
+
+    log_eloop_stats();
+    /* TLV: TLV_RESET_STATS. "1" clears the statistics after reading them */
+    tlv = find_wrapper_tlv_by_id(req, TLV_RESET_STATS);
+    get_eloop_stats_summary(&summary, tlv && tlv->len > 0 && tlv->value[0] == '1');
+
+    fill_wrapper_message_hdr(resp, API_CMD_RESPONSE, req->hdr.seq);
+    fill_wrapper_tlv_byte(resp, TLV_STATUS, TLV_VALUE_STATUS_OK);
+    fill_wrapper_tlv_bytes(resp, TLV_MESSAGE, strlen(TLV_VALUE_LOOP_STATS_OK), TLV_VALUE_LOOP_STATS_OK);
+    snprintf(buffer, sizeof(buffer), "%u", summary.callbacks);
+    fill_wrapper_tlv_bytes(resp, TLV_LOOP_STATS_CALLBACKS, strlen(buffer), buffer);
+    snprintf(buffer, sizeof(buffer), "%u", summary.stalls);
+    fill_wrapper_tlv_bytes(resp, TLV_LOOP_STATS_STALLS, strlen(buffer), buffer);
+    snprintf(buffer, sizeof(buffer), "%u", summary.max_us);
+    fill_wrapper_tlv_bytes(resp, TLV_LOOP_STATS_MAX_DURATION, strlen(buffer), buffer);
+    if (summary.max_name) {
+        fill_wrapper_tlv_bytes(resp, TLV_LOOP_STATS_MAX_HANDLER, strlen(summary.max_name), (char *)summary.max_name);
+    }
+    snprintf(buffer, sizeof(buffer), "%u", summary.late_max_us);
+    fill_wrapper_tlv_bytes(resp, TLV_LOOP_STATS_MAX_LATENESS, strlen(buffer), buffer);
+
+    return 0;
+}
+
+/* Per API counts, errors, sizes and latencies, see fill_api_metrics_response() */
+static int get_api_stats_handler(struct packet_wrapper *req, struct packet_wrapper *resp) {
+    fill_api_metrics_response(req, resp);
+    return 0;
+}
+
 /*
  * void (*callback_fn)(void *), callback of active wlans iterator
  */
@@ -1027,21 +1068,61 @@ static int get_mac_addr_handler(struct packet_wrapper *req, struct packet_wrappe
     return 0;
 }
 
+/* Loopback statistics TLVs. RTT and jitter are in microseconds */
+static void fill_loopback_stats_tlv(struct packet_wrapper *resp, struct traffic_stats *stats) {
+    char value[16];
+
+    snprintf(value, sizeof(value), "%d", stats->lost);
+    fill_wrapper_tlv_bytes(resp, TLV_LOOP_BACK_DATA_LOST, strlen(value), value);
+    snprintf(value, sizeof(value), "%d", stats->reordered);
+    fill_wrapper_tlv_bytes(resp, TLV_LOOP_BACK_OUT_OF_ORDER, strlen(value), value);
+    snprintf(value, sizeof(value), "%u", stats->rtt_min);
+    fill_wrapper_tlv_bytes(resp, TLV_LOOP_BACK_RTT_MIN, strlen(value), value);
+    snprintf(value, sizeof(value), "%u", stats->rtt_avg);
+    fill_wrapper_tlv_bytes(resp, TLV_LOOP_BACK_RTT_AVG, strlen(value), value);
+    snprintf(value, sizeof(value), "%u", stats->rtt_max);
+    fill_wrapper_tlv_bytes(resp, TLV_LOOP_BACK_RTT_MAX, strlen(value), value);
+    snprintf(value, sizeof(value), "%u", stats->rtt_p99);
+    fill_wrapper_tlv_bytes(resp, TLV_LOOP_BACK_RTT_P99, strlen(value), value);
+    snprintf(value, sizeof(value), "%u", stats->jitter);
+    fill_wrapper_tlv_bytes(resp, TLV_LOOP_BACK_JITTER, strlen(value), value);
+    snprintf(value, sizeof(value), "%d", stats->timestamped);
+    fill_wrapper_tlv_bytes(resp, TLV_LOOP_BACK_TIMESTAMPED, strlen(value), value);
+}
+
+/* TLV: TLV_TIMESTAMPING. "1" takes the RTT from kernel or NIC timestamps */
+static void set_loopback_timestamping(struct packet_wrapper *req) {
+    struct tlv_hdr *tlv;
+
+    tlv = find_wrapper_tlv_by_id(req, TLV_TIMESTAMPING);
+    loopback_set_timestamping(tlv && tlv->len > 0 && tlv->value[0] == '1');
+}
+
 /* Tool will send this API to stop continuous data */
 static int stop_loopback_data_handler(struct packet_wrapper *req, struct packet_wrapper *resp) {
-    char recv_count[16], send_count[16];
-    int recvd, sent;
+    struct tlv_hdr *tlv;
+    char recv_count[16], send_count[16], flow_id[16];
+    struct traffic_stats stats;
 
-    recvd = stop_loopback_data(&sent);
+    /* TLV: TLV_FLOW_ID. Stop one flow, or all flows without it */
+    tlv = find_wrapper_tlv_by_id(req, TLV_FLOW_ID);
+    if (tlv) {
+        memset(flow_id, 0, sizeof(flow_id));
+        memcpy(flow_id, tlv->value, tlv->len < sizeof(flow_id) - 1 ? tlv->len : sizeof(flow_id) - 1);
+        stop_loopback_flow(atoi(flow_id), &stats);
+    } else {
+        stop_loopback_data(&stats);
+    }
     indigo_logger(LOG_LEVEL_INFO, "Stop continuous loopdata data, send: %d receive: %d",
-                  sent, recvd);
-    snprintf(recv_count, sizeof(recv_count), "%d", recvd);
-    snprintf(send_count, sizeof(send_count), "%d", sent);
+                  stats.sent, stats.received);
+    snprintf(recv_count, sizeof(recv_count), "%d", stats.received);
+    snprintf(send_count, sizeof(send_count), "%d", stats.sent);
     fill_wrapper_message_hdr(resp, API_CMD_RESPONSE, req->hdr.seq);
     fill_wrapper_tlv_byte(resp, TLV_STATUS, TLV_VALUE_STATUS_OK);
     fill_wrapper_tlv_bytes(resp, TLV_MESSAGE, strlen(TLV_VALUE_LOOP_BACK_STOP_OK), TLV_VALUE_LOOP_BACK_STOP_OK);
     fill_wrapper_tlv_bytes(resp, TLV_LOOP_BACK_DATA_RECEIVED, strlen(recv_count), recv_count);
     fill_wrapper_tlv_bytes(resp, TLV_LOOP_BACK_DATA_SENT, strlen(send_count), send_count);
+    fill_loopback_stats_tlv(resp, &stats);
 
     return 0;
 }
@@ -1051,8 +1132,12 @@ static int send_loopback_data_handler(struct packet_wrapper *req, struct packet_
     char dst_ip[64];
     char dut_port[32];
     char rate[16], pkt_count[16], pkt_size[16], recv_count[16], pkt_type[16];
+    char if_name[32], flow_id[16];
     int status = TLV_VALUE_STATUS_NOT_OK, recvd = 0;
     char *message = TLV_VALUE_SEND_LOOPBACK_DATA_NOT_OK;
+    struct traffic_stats stats;
+
+    memset(&stats, 0, sizeof(stats));
 
     /* TLV: TLV_DUT_IP_ADDRESS */
     memset(dst_ip, 0, sizeof(dst_ip));
@@ -1108,6 +1193,15 @@ static int send_loopback_data_handler(struct packet_wrapper *req, struct packet_
         snprintf(pkt_type, sizeof(pkt_type), "udp");
     }
 
+    /* TLV: TLV_INTERFACE_NAME. Without it, the interface is chosen as before */
+    memset(if_name, 0, sizeof(if_name));
+    tlv = find_wrapper_tlv_by_id(req, TLV_INTERFACE_NAME);
+    if (tlv) {
+        memcpy(if_name, tlv->value, tlv->len < sizeof(if_name) - 1 ? tlv->len : sizeof(if_name) - 1);
+    }
+
+    set_loopback_timestamping(req);
+
     /* Detect and delete existing ARP entry for STAUT randomized MAC */
     detect_del_arp_entry(dst_ip);
 
@@ -1115,13 +1209,13 @@ static int send_loopback_data_handler(struct packet_wrapper *req, struct packet_
     snprintf(recv_count, sizeof(recv_count), "0");
 
     if (strcmp(pkt_type, "icmp") == 0) {
-        recvd = send_icmp_data(dst_ip, atoi(pkt_count), atoi(pkt_size), atof(rate));
+        recvd = send_icmp_data(dst_ip, if_name, atoi(pkt_count), atoi(pkt_size), atof(rate), &stats);
     } else if (strcmp(pkt_type, "udp") == 0) {
-        recvd = send_udp_data(dst_ip, atoi(dut_port), atoi(pkt_count), atoi(pkt_size), atof(rate));
+        recvd = send_udp_data(dst_ip, atoi(dut_port), if_name, atoi(pkt_count), atoi(pkt_size), atof(rate), &stats);
     }
 
-    /* -1 : Continuous data case uses timer and directly reply OK */
-    if (recvd > 0 || atoi(pkt_count) == -1) {
+    /* -1 : Continuous data case starts a flow and directly reply OK */
+    if (recvd > 0 || (atoi(pkt_count) == -1 && recvd == 0)) {
         status = TLV_VALUE_STATUS_OK;
         message = TLV_VALUE_SEND_LOOPBACK_DATA_OK;
         snprintf(recv_count, sizeof(recv_count), "%d", recvd);
@@ -1131,6 +1225,13 @@ done:
     fill_wrapper_tlv_byte(resp, TLV_STATUS, status);
     fill_wrapper_tlv_bytes(resp, TLV_MESSAGE, strlen(message), message);
     fill_wrapper_tlv_bytes(resp, TLV_LOOP_BACK_DATA_RECEIVED, strlen(recv_count), recv_count);
+    if (recvd > 0) {
+        fill_loopback_stats_tlv(resp, &stats);
+    } else if (status == TLV_VALUE_STATUS_OK) {
+        /* Continuous flow: the tool stops it with this id */
+        snprintf(flow_id, sizeof(flow_id), "%d", stats.flow_id);
+        fill_wrapper_tlv_bytes(resp, TLV_LOOP_BACK_FLOW_ID, strlen(flow_id), flow_id);
+    }
 
     return 0;
 }
@@ -1166,6 +1267,7 @@ static int start_loopback_server(struct packet_wrapper *req, struct packet_wrapp
         goto done;
     }
     /* Start loopback */
+    set_loopback_timestamping(req);
     if (!loopback_server_start(local_ip, tool_udp_port, LOOPBACK_TIMEOUT)) {
         status = TLV_VALUE_STATUS_OK;
         message = TLV_VALUE_LOOPBACK_SVR_START_OK;
@@ -1181,13 +1283,86 @@ done:
 
 // RESP: {<ResponseTLV.STATUS: 40961>: '0', <ResponseTLV.MESSAGE: 40960>: 'Loopback server in idle state'}
 static int stop_loop_back_server_handler(struct packet_wrapper *req, struct packet_wrapper *resp) {
+    struct traffic_echo_stats stats;
+    char recv_count[16], send_count[16];
+
     /* Stop loopback */
     if (loopback_server_status()) {
         loopback_server_stop();
     }
+    loopback_server_get_stats(&stats);
+    snprintf(recv_count, sizeof(recv_count), "%u", stats.received);
+    snprintf(send_count, sizeof(send_count), "%u", stats.echoed);
+
     fill_wrapper_message_hdr(resp, API_CMD_RESPONSE, req->hdr.seq);
     fill_wrapper_tlv_byte(resp, TLV_STATUS, TLV_VALUE_STATUS_OK);
     fill_wrapper_tlv_bytes(resp, TLV_MESSAGE, strlen(TLV_VALUE_LOOP_BACK_STOP_OK), TLV_VALUE_LOOP_BACK_STOP_OK);
+    fill_wrapper_tlv_bytes(resp, TLV_LOOP_BACK_DATA_RECEIVED, strlen(recv_count), recv_count);
+    fill_wrapper_tlv_bytes(resp, TLV_LOOP_BACK_DATA_SENT, strlen(send_count), send_count);
+
+    return 0;
+}
+
+static int start_capture_handler(struct packet_wrapper *req, struct packet_wrapper *resp) {
+    struct tlv_hdr *tlv;
+    char if_name[32], filter[256], path[256];
+    int status = TLV_VALUE_STATUS_NOT_OK;
+    char *message = TLV_VALUE_CAPTURE_START_NOT_OK;
+
+    /* TLV: TLV_CAPTURE_OUTFILE or TLV_CAPTURE_FILE */
+    memset(path, 0, sizeof(path));
+    tlv = find_wrapper_tlv_by_id(req, TLV_CAPTURE_OUTFILE);
+    if (tlv == NULL)
+        tlv = find_wrapper_tlv_by_id(req, TLV_CAPTURE_FILE);
+    if (tlv) {
+        memcpy(path, tlv->value, tlv->len);
+    } else {
+        message = TLV_VALUE_INSUFFICIENT_TLV;
+        goto done;
+    }
+
+    /* TLV: TLV_CAPTURE_FILTER */
+    memset(filter, 0, sizeof(filter));
+    tlv = find_wrapper_tlv_by_id(req, TLV_CAPTURE_FILTER);
+    if (tlv) {
+        memcpy(filter, tlv->value, tlv->len);
+    }
+
+    /* TLV: TLV_INTERFACE_NAME */
+    memset(if_name, 0, sizeof(if_name));
+    tlv = find_wrapper_tlv_by_id(req, TLV_INTERFACE_NAME);
+    if (tlv && tlv->len < sizeof(if_name)) {
+        memcpy(if_name, tlv->value, tlv->len);
+    } else {
+        snprintf(if_name, sizeof(if_name), "%s", get_wireless_interface());
+    }
+
+    if (capture_start(if_name, filter, path) == 0) {
+        status = TLV_VALUE_STATUS_OK;
+        message = TLV_VALUE_CAPTURE_START_OK;
+    }
+
+done:
+    fill_wrapper_message_hdr(resp, API_CMD_RESPONSE, req->hdr.seq);
+    fill_wrapper_tlv_byte(resp, TLV_STATUS, status);
+    fill_wrapper_tlv_bytes(resp, TLV_MESSAGE, strlen(message), message);
+
+    return 0;
+}
+
+static int stop_capture_handler(struct packet_wrapper *req, struct packet_wrapper *resp) {
+    struct capture_stats stats;
+    char packets[16], dropped[16];
+
+    capture_stop(&stats);
+    snprintf(packets, sizeof(packets), "%u", stats.packets);
+    snprintf(dropped, sizeof(dropped), "%u", stats.dropped);
+
+    fill_wrapper_message_hdr(resp, API_CMD_RESPONSE, req->hdr.seq);
+    fill_wrapper_tlv_byte(resp, TLV_STATUS, TLV_VALUE_STATUS_OK);
+    fill_wrapper_tlv_bytes(resp, TLV_MESSAGE, strlen(TLV_VALUE_CAPTURE_STOP_OK), TLV_VALUE_CAPTURE_STOP_OK);
+    fill_wrapper_tlv_bytes(resp, TLV_CAPTURE_PACKETS, strlen(packets), packets);
+    fill_wrapper_tlv_bytes(resp, TLV_CAPTURE_DROPPED, strlen(dropped), dropped);
 
     return 0;
 }
@@ -1269,16 +1444,15 @@ static int stop_sta_handler(struct packet_wrapper *req, struct packet_wrapper *r
         if (len) {
             indigo_logger(LOG_LEVEL_DEBUG, "Failed to remove wpa_supplicant.conf");
         }
+        wpas_conf_reset();
 
         /* clean the log */
         snprintf(buffer, sizeof(buffer), "rm -rf %s >/dev/null 2>/dev/null", WPAS_LOG_FILE);
         system(buffer);
     }
 
-    memset(buffer, 0, sizeof(buffer));
-    sprintf(buffer, "killall %s 1>/dev/null 2>/dev/null", get_wpas_exec_file());
-    system(buffer);
-    sleep(2);
+    /* Returns once wpa_supplicant has exited */
+    stop_process(get_wpas_exec_file());
 
     /* Test case teardown case */
     if (reset == RESET_TYPE_TEARDOWN) {
@@ -1557,7 +1731,7 @@ static int configure_sta_handler(struct packet_wrapper *req, struct packet_wrapp
     memset(buffer, 0, sizeof(buffer));
     len = generate_wpas_config(buffer, sizeof(buffer), req);
     if (len) {
-        write_file(get_wpas_conf_file(), buffer, len);
+        wpas_conf_write_buffer(get_wpas_conf_file(), buffer);
     }
 
     /* Apply in this API as some settings are via wpas conf */
@@ -1719,7 +1893,7 @@ static int start_up_sta_handler(struct packet_wrapper *req, struct packet_wrappe
         len = strlen(buffer);
 
         if (len) {
-            write_file(get_wpas_conf_file(), buffer, len);
+            wpas_conf_write_buffer(get_wpas_conf_file(), buffer);
         }
     } else {
         return 0;
@@ -1974,7 +2148,7 @@ static int start_up_p2p_handler(struct packet_wrapper *req, struct packet_wrappe
         len = strlen(buffer);
 
         if (len) {
-            write_file(get_wpas_conf_file(), buffer, len);
+            wpas_conf_write_buffer(get_wpas_conf_file(), buffer);
         }
     } else {
         indigo_logger(LOG_LEVEL_ERROR, "No remote UDP port in TP");
@@ -21,6 +21,7 @@
 #include <sys/time.h>
 #include <netinet/in.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <unistd.h>
@@ -33,6 +34,7 @@
 #include "eloop.h"
 #include "indigo_api.h"
 #include "utils.h"
+#include "event_monitor.h"
 
 
 /* Internal functions */
@@ -155,6 +157,13 @@ static void handle_term(int sig, void *eloop_ctx, void *signal_ctx) {
     vendor_deinit();
 }
 
+static void handle_dump_stats(int sig, void *eloop_ctx, void *signal_ctx) {
+    (void) sig;
+    (void) eloop_ctx;
+    (void) signal_ctx;
+    log_eloop_stats();
+}
+
 int main(int argc, char* argv[]) {
     int service_socket = -1;
 
@@ -178,7 +187,7 @@ int main(int argc, char* argv[]) {
     }
 
 #ifndef _OPENWRT_
-    system("mkdir -p /etc/hostapd/");
+    mkdir("/etc/hostapd", 0755);
 #endif
 
     /* Print the run-time information */
@@ -209,10 +218,16 @@ int main(int argc, char* argv[]) {
     /* Register SIGTERM */
     qt_eloop_register_signal(SIGINT, handle_term, NULL);
     qt_eloop_register_signal(SIGTERM, handle_term, NULL);
+    QT_ELOOP_HANDLER_NAME(handle_term);
+    /* SIGUSR1 dumps the callback latency histograms */
+    qt_eloop_register_signal(SIGUSR1, handle_dump_stats, NULL);
+    QT_ELOOP_HANDLER_NAME(handle_dump_stats);
+    qt_eloop_set_stall_handler(ELOOP_STALL_MS, log_eloop_stall);
 
     /* Bind the service port and register to eloop */
     service_socket = control_socket_init(get_service_port());
     if (service_socket >= 0) {
+        event_monitor_init(service_socket);
         qt_eloop_run();
     } else {
         indigo_logger(LOG_LEVEL_INFO, "Failed to initiate the UDP socket");
@@ -220,6 +235,7 @@ int main(int argc, char* argv[]) {
 
     /* Stop eloop */
     qt_eloop_destroy();
+    event_monitor_unsubscribe();
     indigo_logger(LOG_LEVEL_INFO, "ControlAppC stops");
     if (service_socket >= 0) {
         indigo_logger(LOG_LEVEL_INFO, "Close service port: %d", get_service_port());
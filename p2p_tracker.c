@@ -0,0 +1,331 @@
+/* Copyright (c) 2020 Wi-Fi Alliance                                                */
+
+/* Permission to use, copy, modify, and/or distribute this software for any         */
+/* purpose with or without fee is hereby granted, provided that the above           */
+/* copyright notice and this permission notice appear in all copies.                */
+
+/* THE SOFTWARE IS PROVIDED 'AS IS' AND THE AUTHOR DISCLAIMS ALL                    */
+/* WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED                    */
+/* WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL                     */
+/* THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR                       */
+/* CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING                        */
+/* FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF                       */
+/* CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT                       */
+/* OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS                          */
+/* SOFTWARE. */
+
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/stat.h>
+
+#include "vendor_specific.h"
+#include "eloop.h"
+#include "utils.h"
+#include "wpa_ctrl.h"
+#include "p2p_tracker.h"
+
+/* The P2P events come from the P2P device interface when the driver has one,
+ * otherwise from the wireless interface. Both are monitored and the state
+ * updates are idempotent */
+#define P2P_MONITORS    2
+
+static struct {
+    struct wpa_ctrl *monitors[P2P_MONITORS];
+    /* Control socket of the tracked wpa_supplicant, a new inode means it was restarted */
+    char path[S_BUFFER_LEN];
+    ino_t ino;
+    char device_addr[18];
+    struct p2p_peer peers[P2P_PEERS_MAX];
+    int peer_count;
+    struct p2p_group group;
+    int go_neg_role;
+    /* Events seen since p2p_tracker_expect() */
+    int events;
+} p2p;
+
+/* Value of "<name>=" in an event, quoted values are unquoted */
+static int p2p_event_param(const char *event, const char *name, char *value, int size) {
+    const char *pos = event, *end;
+    int len = strlen(name);
+
+    while ((pos = strstr(pos, name)) != NULL) {
+        if ((pos == event || pos[-1] == ' ') && pos[len] == '=')
+            break;
+        pos += len;
+    }
+    if (pos == NULL)
+        return -1;
+    pos += len + 1;
+    if (*pos == '"' || *pos == '\'') {
+        end = strchr(pos + 1, *pos);
+        pos++;
+    } else {
+        end = strchr(pos, ' ');
+    }
+    len = end ? end - pos : (int)strlen(pos);
+    snprintf(value, size, "%.*s", len, pos);
+    return 0;
+}
+
+/* Word index of an event, e.g. the interface name of P2P-GROUP-STARTED */
+static int p2p_event_word(const char *event, int index, char *value, int size) {
+    const char *pos = event;
+    int len;
+
+    while (index-- > 0) {
+        pos = strchr(pos, ' ');
+        if (pos == NULL)
+            return -1;
+        pos++;
+    }
+    len = strcspn(pos, " ");
+    snprintf(value, size, "%.*s", len, pos);
+    return 0;
+}
+
+static int p2p_find_peer(const char *addr) {
+    int i;
+
+    for (i = 0; i < p2p.peer_count; i++) {
+        if (strcasecmp(p2p.peers[i].addr, addr) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static void p2p_handle_event(char *event) {
+    char addr[18], role[16], value[64];
+    int i;
+
+    if (event[0] == '<' && strchr(event, '>'))
+        event = strchr(event, '>') + 1;
+
+    if (strncmp(event, "P2P-DEVICE-FOUND ", 17) == 0) {
+        if (p2p_event_param(event, "p2p_dev_addr", addr, sizeof(addr)))
+            p2p_event_word(event, 1, addr, sizeof(addr));
+        i = p2p_find_peer(addr);
+        if (i < 0 && p2p.peer_count < P2P_PEERS_MAX) {
+            i = p2p.peer_count++;
+            indigo_logger(LOG_LEVEL_DEBUG, "P2P peer %s found", addr);
+        }
+        if (i >= 0) {
+            snprintf(p2p.peers[i].addr, sizeof(p2p.peers[i].addr), "%s", addr);
+            p2p_event_param(event, "name", p2p.peers[i].name, sizeof(p2p.peers[i].name));
+        }
+        p2p.events |= P2P_EVENT_DEVICE_FOUND;
+    } else if (strncmp(event, "P2P-DEVICE-LOST ", 16) == 0) {
+        if (p2p_event_param(event, "p2p_dev_addr", addr, sizeof(addr)) == 0 && (i = p2p_find_peer(addr)) >= 0) {
+            p2p.peers[i] = p2p.peers[--p2p.peer_count];
+        }
+    } else if (strncmp(event, "P2P-GO-NEG-SUCCESS", 18) == 0) {
+        memset(role, 0, sizeof(role));
+        p2p_event_param(event, "role", role, sizeof(role));
+        p2p.go_neg_role = strcmp(role, "GO") == 0 ? P2P_ROLE_GO : P2P_ROLE_CLIENT;
+        p2p.events |= P2P_EVENT_GO_NEG_SUCCESS;
+    } else if (strncmp(event, "P2P-GO-NEG-FAILURE", 18) == 0) {
+        p2p.go_neg_role = P2P_ROLE_NONE;
+        p2p.events |= P2P_EVENT_GO_NEG_FAILURE;
+    } else if (strncmp(event, "P2P-GROUP-FORMATION-FAILURE", 27) == 0) {
+        p2p.events |= P2P_EVENT_GROUP_FAILURE;
+    } else if (strncmp(event, "P2P-GROUP-STARTED ", 18) == 0) {
+        memset(&p2p.group, 0, sizeof(p2p.group));
+        p2p_event_word(event, 1, p2p.group.ifname, sizeof(p2p.group.ifname));
+        p2p_event_word(event, 2, role, sizeof(role));
+        p2p.group.role = strcmp(role, "GO") == 0 ? P2P_ROLE_GO : P2P_ROLE_CLIENT;
+        p2p_event_param(event, "ssid", p2p.group.ssid, sizeof(p2p.group.ssid));
+        if (p2p_event_param(event, "freq", value, sizeof(value)) == 0)
+            p2p.group.freq = atoi(value);
+        p2p_event_param(event, "go_dev_addr", p2p.group.go_dev_addr, sizeof(p2p.group.go_dev_addr));
+        indigo_logger(LOG_LEVEL_DEBUG, "P2P group %s started as %s", p2p.group.ifname, role);
+        p2p.events |= P2P_EVENT_GROUP_STARTED;
+    } else if (strncmp(event, "P2P-GROUP-REMOVED ", 18) == 0) {
+        p2p_event_word(event, 1, value, sizeof(value));
+        if (strcmp(value, p2p.group.ifname) == 0) {
+            indigo_logger(LOG_LEVEL_DEBUG, "P2P group %s removed", p2p.group.ifname);
+            memset(&p2p.group, 0, sizeof(p2p.group));
+        }
+        p2p.events |= P2P_EVENT_GROUP_REMOVED;
+    }
+}
+
+static void p2p_receive(struct wpa_ctrl *monitor) {
+    char buffer[BUFFER_LEN];
+    size_t len;
+
+    while (wpa_ctrl_pending(monitor) > 0) {
+        len = sizeof(buffer) - 1;
+        if (wpa_ctrl_recv(monitor, buffer, &len))
+            break;
+        buffer[len] = '\0';
+        p2p_handle_event(buffer);
+    }
+}
+
+/* Handle the events still queued on the monitors. The event loop serves the
+ * control socket before the monitors, so a request can arrive before them. */
+static void p2p_receive_all() {
+    int i;
+
+    for (i = 0; i < P2P_MONITORS; i++) {
+        if (p2p.monitors[i])
+            p2p_receive(p2p.monitors[i]);
+    }
+}
+
+static void p2p_receive_callback(int sock, void *eloop_ctx, void *sock_ctx) {
+    (void)sock;
+    (void)eloop_ctx;
+
+    p2p_receive((struct wpa_ctrl *)sock_ctx);
+}
+
+/* Attach to the interfaces of the wpa_supplicant just started for P2P. The state starts empty */
+int p2p_tracker_start(char *ifname) {
+    char path[S_BUFFER_LEN], response[BUFFER_LEN];
+    struct key_value_index kv_index;
+    struct stat st;
+    size_t resp_len;
+    int i;
+
+    p2p_tracker_stop();
+
+    snprintf(p2p.path, sizeof(p2p.path), "%s", get_wpas_if_ctrl_path(ifname));
+    if (stat(p2p.path, &st) == 0)
+        p2p.ino = st.st_ino;
+    p2p.monitors[0] = open_ctrl_monitor(p2p.path);
+    snprintf(path, sizeof(path), "p2p-dev-%s", ifname);
+    if (file_exists(get_wpas_if_ctrl_path(path)))
+        p2p.monitors[1] = open_ctrl_monitor(get_wpas_if_ctrl_path(path));
+    if (p2p.monitors[0] == NULL) {
+        p2p_tracker_stop();
+        return -1;
+    }
+    for (i = 0; i < P2P_MONITORS; i++) {
+        if (p2p.monitors[i]) {
+            qt_eloop_register_read_sock(wpa_ctrl_get_fd(p2p.monitors[i]), p2p_receive_callback, NULL, p2p.monitors[i]);
+            QT_ELOOP_HANDLER_NAME(p2p_receive_callback);
+        }
+    }
+
+    /* The P2P device address does not change while wpa_supplicant runs */
+    memset(response, 0, sizeof(response));
+    resp_len = sizeof(response) - 1;
+    if (wpa_ctrl_request(p2p.monitors[0], "STATUS", strlen("STATUS"), response, &resp_len, NULL) == 0) {
+        kv_index_build(&kv_index, response);
+        kv_index_get(&kv_index, "p2p_device_address", p2p.device_addr, sizeof(p2p.device_addr));
+    }
+    indigo_logger(LOG_LEVEL_DEBUG, "Track the P2P state of %s, device address %s", ifname, p2p.device_addr);
+    return 0;
+}
+
+void p2p_tracker_stop() {
+    int i;
+
+    for (i = 0; i < P2P_MONITORS; i++) {
+        if (p2p.monitors[i]) {
+            qt_eloop_unregister_read_sock(wpa_ctrl_get_fd(p2p.monitors[i]));
+            close_ctrl_monitor(p2p.monitors[i]);
+        }
+    }
+    memset(&p2p, 0, sizeof(p2p));
+}
+
+/* The state is valid while the wpa_supplicant it was started with runs */
+int p2p_tracker_is_running() {
+    struct stat st;
+
+    if (p2p.monitors[0] == NULL)
+        return 0;
+    if (stat(p2p.path, &st) || st.st_ino != p2p.ino) {
+        indigo_logger(LOG_LEVEL_DEBUG, "wpa_supplicant of the P2P state stopped");
+        p2p_tracker_stop();
+        return 0;
+    }
+    return 1;
+}
+
+/* Forget the events seen so far, call before the command that causes them */
+void p2p_tracker_expect(int events) {
+    /* Events queued while the request was waiting for the event loop are older than the command */
+    p2p_receive_all();
+    p2p.events &= ~events;
+}
+
+/* Wait for one of the events since p2p_tracker_expect(). Returns the events seen or 0 at timeout_ms */
+int p2p_tracker_wait(int events, int timeout_ms) {
+    struct pollfd pfds[P2P_MONITORS];
+    struct wpa_ctrl *polled[P2P_MONITORS];
+    struct timespec start, now;
+    int i, count, elapsed_ms = 0;
+
+    if (!p2p_tracker_is_running())
+        return 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while ((p2p.events & events) == 0 && elapsed_ms < timeout_ms) {
+        for (i = 0, count = 0; i < P2P_MONITORS; i++) {
+            if (p2p.monitors[i]) {
+                polled[count] = p2p.monitors[i];
+                pfds[count].fd = wpa_ctrl_get_fd(p2p.monitors[i]);
+                pfds[count++].events = POLLIN;
+            }
+        }
+        if (poll(pfds, count, timeout_ms - elapsed_ms) > 0) {
+            for (i = 0; i < count; i++) {
+                if (pfds[i].revents & POLLIN)
+                    p2p_receive(polled[i]);
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed_ms = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+    }
+    if ((p2p.events & events) == 0)
+        indigo_logger(LOG_LEVEL_WARNING, "No P2P event 0x%x after %d ms", events, timeout_ms);
+    else
+        indigo_logger(LOG_LEVEL_DEBUG, "P2P event 0x%x after %d ms", p2p.events & events, elapsed_ms);
+    return p2p.events & events;
+}
+
+/* Wait until the peer has been discovered. Returns 0 when it is in the peer table */
+int p2p_tracker_wait_peer(char *addr, int timeout_ms) {
+    struct timespec start, now;
+    int elapsed_ms = 0;
+
+    if (!p2p_tracker_is_running())
+        return -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (p2p_find_peer(addr) < 0 && elapsed_ms < timeout_ms) {
+        p2p_tracker_expect(P2P_EVENT_DEVICE_FOUND);
+        p2p_tracker_wait(P2P_EVENT_DEVICE_FOUND, timeout_ms - elapsed_ms);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed_ms = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+    }
+    return p2p_find_peer(addr) < 0 ? -1 : 0;
+}
+
+/* Returns 0 and the group when a group is up, 1 without a group and -1 when the state is not tracked */
+int p2p_tracker_get_group(struct p2p_group *group) {
+    if (!p2p_tracker_is_running())
+        return -1;
+    p2p_receive_all();
+    if (p2p.group.ifname[0] == '\0')
+        return 1;
+    memcpy(group, &p2p.group, sizeof(*group));
+    return 0;
+}
+
+int p2p_tracker_get_device_addr(char *addr, int size) {
+    if (!p2p_tracker_is_running())
+        return -1;
+    p2p_receive_all();
+    if (p2p.device_addr[0] == '\0')
+        return -1;
+    snprintf(addr, size, "%s", p2p.device_addr);
+    return 0;
+}
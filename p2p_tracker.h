@@ -0,0 +1,68 @@
+/* Copyright (c) 2020 Wi-Fi Alliance                                                */
+
+/* Permission to use, copy, modify, and/or distribute this software for any         */
+/* purpose with or without fee is hereby granted, provided that the above           */
+/* copyright notice and this permission notice appear in all copies.                */
+
+/* THE SOFTWARE IS PROVIDED 'AS IS' AND THE AUTHOR DISCLAIMS ALL                    */
+/* WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED                    */
+/* WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL                     */
+/* THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR                       */
+/* CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING                        */
+/* FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF                       */
+/* CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT                       */
+/* OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS                          */
+/* SOFTWARE. */
+
+
+#ifndef _INDIGO_P2P_TRACKER_
+#define _INDIGO_P2P_TRACKER_  1
+
+/* P2P state of wpa_supplicant tracked from the events of an attached monitor.
+ * The monitor sockets are served by the event loop between the requests, and
+ * the handlers wait for the state changes with p2p_tracker_wait(). The peers,
+ * the group interface and its role are answered from the tracked state
+ * instead of wpa_supplicant or "iw dev" queries.
+ */
+
+#define P2P_PEERS_MAX                   32
+#define P2P_GROUP_WAIT_TIMEOUT_MS       10000
+#define P2P_PEER_WAIT_TIMEOUT_MS        10000
+
+enum {
+    P2P_ROLE_NONE = 0,
+    P2P_ROLE_GO = 1,
+    P2P_ROLE_CLIENT = 2
+};
+
+/* Events for p2p_tracker_expect() and p2p_tracker_wait() */
+#define P2P_EVENT_DEVICE_FOUND          (1 << 0)
+#define P2P_EVENT_GO_NEG_SUCCESS        (1 << 1)
+#define P2P_EVENT_GO_NEG_FAILURE        (1 << 2)
+#define P2P_EVENT_GROUP_STARTED         (1 << 3)
+#define P2P_EVENT_GROUP_FAILURE         (1 << 4)
+#define P2P_EVENT_GROUP_REMOVED         (1 << 5)
+
+struct p2p_peer {
+    char addr[18];
+    char name[64];
+};
+
+struct p2p_group {
+    char ifname[32];
+    int role;
+    int freq;
+    char ssid[64];
+    char go_dev_addr[18];
+};
+
+int p2p_tracker_start(char *ifname);
+void p2p_tracker_stop();
+int p2p_tracker_is_running();
+void p2p_tracker_expect(int events);
+int p2p_tracker_wait(int events, int timeout_ms);
+int p2p_tracker_wait_peer(char *addr, int timeout_ms);
+int p2p_tracker_get_group(struct p2p_group *group);
+int p2p_tracker_get_device_addr(char *addr, int size);
+
+#endif /* _INDIGO_P2P_TRACKER_ */
@@ -31,6 +31,7 @@
 #include "eloop.h"
 #include "indigo_api.h"
 #include "utils.h"
+#include "tracepoint.h"
 
 
 struct sockaddr_in *tool_addr; // For HTTP Post
@@ -42,10 +43,16 @@ static void control_receive_message(int sock, void *eloop_ctx, void *sock_ctx) {
     char buffer[BUFFER_LEN]; // buffer to receive the message
     struct packet_wrapper req, resp;  // packet wrapper for the received message and response
     struct indigo_api *api = NULL;    // used for API search, validation and handler call
+    struct api_call_sample sample;    // latency, size and outcome of this message
+    unsigned long long start_us, step_us;
+    struct tlv_hdr *status;
 
     (void) eloop_ctx;
     (void) sock_ctx;
 
+    memset(&sample, 0, sizeof(sample));
+    start_us = get_api_metrics_time_us();
+
     /* Receive request */
     fromlen = sizeof(from);
     len = recvfrom(sock, buffer, BUFFER_LEN, 0, (struct sockaddr *) &from, (socklen_t*)&fromlen);
@@ -56,11 +63,14 @@ static void control_receive_message(int sock, void *eloop_ctx, void *sock_ctx) {
         indigo_logger(LOG_LEVEL_DEBUG, "Server: Receive the packet");
     }
     tool_addr = (struct sockaddr_in *)&from;
+    sample.bytes_in = len;
+    QT_TRACE1(packet_receive, len);
 
     /* Parse request to HDR and TLV. Response NACK if parser fails. Otherwises, ACK. */
     memset(&req, 0, sizeof(struct packet_wrapper));
     memset(&resp, 0, sizeof(struct packet_wrapper));
     ret = parse_packet(&req, buffer, len);
+    QT_TRACE4(parse_done, req.hdr.type, req.hdr.seq, req.tlv_num, ret);
     if (ret == 0) {
         indigo_logger(LOG_LEVEL_DEBUG, "Server: Parsed packet successfully");
     } else {
@@ -69,6 +79,13 @@ static void control_receive_message(int sock, void *eloop_ctx, void *sock_ctx) {
         len = assemble_packet(buffer, BUFFER_LEN, &resp);
 
         sendto(sock, (const char *)buffer, len, MSG_CONFIRM, (const struct sockaddr *) &from, fromlen);
+        QT_TRACE3(ack_send, req.hdr.type, 0x31, len);
+        sample.bytes_out += len;
+        /* parse_packet() rejects the unknown APIs too. Count them as unknown, not as parse failures. */
+        if (sample.bytes_in < sizeof(struct message_hdr) || get_api_by_id(req.hdr.type)) {
+            sample.parse_failed = 1;
+        }
+        sample.error = 1;
         goto done;
     }
 
@@ -76,35 +93,60 @@ static void control_receive_message(int sock, void *eloop_ctx, void *sock_ctx) {
     api = get_api_by_id(req.hdr.type);
     if (api) {
         indigo_logger(LOG_LEVEL_DEBUG, "API %s: Found handler", api->name);
+        qt_eloop_set_stall_tag(api->name);
     } else {
         indigo_logger(LOG_LEVEL_ERROR, "API Unknown (0x%04x): No registered handler", req.hdr.type);
         fill_wrapper_ack(&resp, req.hdr.seq, 0x31, "Unable to find the API handler");
         len = assemble_packet(buffer, BUFFER_LEN, &resp);
         sendto(sock, (const char *)buffer, len, MSG_CONFIRM, (const struct sockaddr *) &from, fromlen);
+        QT_TRACE3(ack_send, req.hdr.type, 0x31, len);
+        sample.bytes_out += len;
+        sample.error = 1;
         goto done;
     }
 
     /* Verify. Optional. If validation is failed, then return NACK. */
+    step_us = get_api_metrics_time_us();
     if (api->verify == NULL || (api->verify && api->verify(&req, &resp) == 0)) {
+        sample.verify_us = get_api_metrics_time_us() - step_us;
+        QT_TRACE3(verify, api->name, 0, sample.verify_us);
         indigo_logger(LOG_LEVEL_INFO, "API %s: Return ACK", api->name);
         fill_wrapper_ack(&resp, req.hdr.seq, 0x30, "ACK: Command received");
         len = assemble_packet(buffer, BUFFER_LEN, &resp);
         sendto(sock, (const char *)buffer, len, MSG_CONFIRM, (const struct sockaddr *) &from, fromlen);
+        QT_TRACE3(ack_send, req.hdr.type, 0x30, len);
+        sample.bytes_out += len;
         free_packet_wrapper(&resp);
     } else {
+        sample.verify_us = get_api_metrics_time_us() - step_us;
+        QT_TRACE3(verify, api->name, 1, sample.verify_us);
         indigo_logger(LOG_LEVEL_ERROR, "API %s: Failed to verify and return NACK", api->name);
         fill_wrapper_ack(&resp, req.hdr.seq, 1, "Unable to find the API handler");
         len = assemble_packet(buffer, BUFFER_LEN, &resp);
         sendto(sock, (const char *)buffer, len, MSG_CONFIRM, (const struct sockaddr *) &from, fromlen);
+        QT_TRACE3(ack_send, req.hdr.type, 1, len);
+        sample.bytes_out += len;
+        sample.error = 1;
         goto done;
     }
 
     /* Optional, use timer to handle the execution */
     /* Handle & Response. Call API handle(), assemble packet by response wrapper and send back to source address. */
+    step_us = get_api_metrics_time_us();
+    QT_TRACE2(handle_start, api->name, req.hdr.seq);
     if (api->handle && api->handle(&req, &resp) == 0) {
+        sample.handle_us = get_api_metrics_time_us() - step_us;
+        QT_TRACE3(handle_end, api->name, 0, sample.handle_us);
         indigo_logger(LOG_LEVEL_INFO, "API %s: Return execution result", api->name);
+        /* The handler reports failures in the status TLV */
+        status = find_wrapper_tlv_by_id(&resp, TLV_STATUS);
+        if (status && status->len > 0 && status->value[0] != TLV_VALUE_STATUS_OK) {
+            sample.error = 1;
+        }
         len = assemble_packet(buffer, BUFFER_LEN, &resp);
         sendto(sock, (const char *)buffer, len, MSG_CONFIRM, (const struct sockaddr *) &from, fromlen);
+        QT_TRACE3(response_send, api->name, req.hdr.type, len);
+        sample.bytes_out += len;
 #ifdef CONFIG_ZEPHYR
         if(!strcmp(api->name, "DEVICE_RESET")) {
 		k_msleep(CONFIG_WFA_QT_REBOOT_TIMEOUT_MS);
@@ -112,10 +154,15 @@ static void control_receive_message(int sock, void *eloop_ctx, void *sock_ctx) {
 	}
 #endif
     } else {
+        sample.handle_us = get_api_metrics_time_us() - step_us;
+        QT_TRACE3(handle_end, api->name, 1, sample.handle_us);
+        sample.error = 1;
         indigo_logger(LOG_LEVEL_DEBUG, "API %s (0x%04x): No handle function", api ? api->name : "Unknown", req.hdr.type);
     }
 
 done:
+    sample.total_us = get_api_metrics_time_us() - start_us;
+    record_api_metrics(api, &sample);
     /* Clean up resource */
     free_packet_wrapper(&req);
     free_packet_wrapper(&resp);
@@ -155,5 +202,6 @@ int control_socket_init(int port) {
         close(s);
         return -1;
     }
+    QT_ELOOP_HANDLER_NAME(control_receive_message);
     return s;
 }
@@ -0,0 +1,631 @@
+/* Copyright (c) 2020 Wi-Fi Alliance                                                */
+
+/* Permission to use, copy, modify, and/or distribute this software for any         */
+/* purpose with or without fee is hereby granted, provided that the above           */
+/* copyright notice and this permission notice appear in all copies.                */
+
+/* THE SOFTWARE IS PROVIDED 'AS IS' AND THE AUTHOR DISCLAIMS ALL                    */
+/* WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED                    */
+/* WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL                     */
+/* THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR                       */
+/* CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING                        */
+/* FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF                       */
+/* CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT                       */
+/* OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS                          */
+/* SOFTWARE. */
+
+
+/* Replay benchmark of the control app.
+ *
+ * Replays recorded control messages to a running app over UDP from several
+ * concurrent clients and reports the latency, throughput and NACK rate per API.
+ * The inputs are replayed in the order given and can be
+ * - capture files written by "app -c" (and read by "test.py file"),
+ * - pcap files, where the UDP datagrams to the control port are replayed,
+ * - scripts with one request per line: "<api id> [<tlv id>=<value> ...]",
+ *   "sleep <ms>" and "#" comments. A value with spaces can be "quoted".
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <ctype.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "vendor_specific.h"
+
+#define REPLAY_MSG_LEN          1536
+#define REPLAY_LINE_LEN         4096
+#define REPLAY_MAX_CLIENTS      64
+#define REPLAY_MAX_APIS         256
+#define REPLAY_TIMEOUT_MS       30000
+
+#define REPLAY_HDR_LEN          7
+#define REPLAY_TLV_HDR_LEN      3
+#define REPLAY_API_VERSION      0x01
+#define REPLAY_CMD_RESPONSE     0x0000
+#define REPLAY_CMD_ACK          0x0001
+#define REPLAY_TLV_STATUS       0xa001
+#define REPLAY_STATUS_OK        0x30
+
+#define PCAP_MAGIC_USEC         0xa1b2c3d4
+#define PCAP_MAGIC_NSEC         0xa1b23c4d
+#define PCAP_LINKTYPE_ETHERNET  1
+#define PCAP_LINKTYPE_RAW       101
+#define PCAP_LINKTYPE_SLL       113
+#define PCAP_LINKTYPE_SLL2      276
+
+struct replay_msg {
+    unsigned char *data;
+    int len;
+    /* Wait before sending, from "sleep" lines */
+    int delay_ms;
+};
+
+struct replay_api {
+    unsigned short id;
+    unsigned int count;
+    unsigned int nacks;
+    unsigned int errors;
+    unsigned int timeouts;
+    /* ACK and response latency of the answered requests */
+    unsigned int samples, max_samples;
+    unsigned int *ack_us;
+    unsigned int *total_us;
+};
+
+enum {
+    CLIENT_SEND,
+    CLIENT_DELAY,
+    CLIENT_WAIT_ACK,
+    CLIENT_WAIT_RESPONSE,
+    CLIENT_DONE
+};
+
+struct replay_client {
+    int sock;
+    int state;
+    int index;
+    int iteration;
+    unsigned short seq;
+    unsigned long long sent_us;
+    unsigned long long ack_us;
+    unsigned long long deadline_us;
+};
+
+static struct replay_msg *msgs;
+static int msg_count, pending_delay_ms;
+static struct replay_api apis[REPLAY_MAX_APIS];
+static int api_count;
+static int verbose;
+
+static unsigned long long replay_now_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static int add_msg(const unsigned char *data, int len) {
+    struct replay_msg *tmp;
+
+    if (len < REPLAY_HDR_LEN || len > REPLAY_MSG_LEN || data[0] != REPLAY_API_VERSION) {
+        fprintf(stderr, "Skip a message which is not a control message (%d bytes)\n", len);
+        return 0;
+    }
+    tmp = realloc(msgs, (msg_count + 1) * sizeof(*msgs));
+    if (tmp == NULL)
+        return -1;
+    msgs = tmp;
+    msgs[msg_count].data = malloc(len);
+    if (msgs[msg_count].data == NULL)
+        return -1;
+    memcpy(msgs[msg_count].data, data, len);
+    msgs[msg_count].len = len;
+    msgs[msg_count].delay_ms = pending_delay_ms;
+    pending_delay_ms = 0;
+    msg_count++;
+    return 0;
+}
+
+/* "0x01, 0x50, 0x02, ..." as written by "app -c" */
+static int load_capture_file(const char *text) {
+    unsigned char buffer[REPLAY_MSG_LEN];
+    const char *p = text;
+    char *end;
+    int len = 0;
+
+    while (*p) {
+        while (*p && (isspace((unsigned char)*p) || *p == ','))
+            p++;
+        if (*p == 0)
+            break;
+        if (len == REPLAY_MSG_LEN)
+            return -1;
+        buffer[len++] = strtoul(p, &end, 16) & 0xff;
+        if (end == p)
+            return -1;
+        p = end;
+    }
+    return add_msg(buffer, len);
+}
+
+static unsigned int pcap_u32(const unsigned char *p, int swapped) {
+    if (swapped)
+        return (unsigned int)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+    return (unsigned int)p[3] << 24 | p[2] << 16 | p[1] << 8 | p[0];
+}
+
+/* Replay the UDP payloads of the IPv4 packets sent to the control port */
+static int load_pcap_file(const unsigned char *data, long size, int port) {
+    unsigned int magic, linktype, caplen;
+    const unsigned char *pkt, *ip, *udp;
+    long offset = 24;
+    int swapped, l2len, iplen, proto;
+
+    magic = pcap_u32(data, 0);
+    swapped = (magic != PCAP_MAGIC_USEC && magic != PCAP_MAGIC_NSEC);
+    linktype = pcap_u32(data + 20, swapped) & 0xffff;
+
+    while (offset + 16 <= size) {
+        caplen = pcap_u32(data + offset + 8, swapped);
+        pkt = data + offset + 16;
+        offset += 16 + caplen;
+        if (offset > size)
+            break;
+
+        switch (linktype) {
+        case PCAP_LINKTYPE_ETHERNET:
+            l2len = 14;
+            proto = caplen >= 14 ? pkt[12] << 8 | pkt[13] : 0;
+            /* 802.1Q */
+            if (proto == 0x8100 && caplen >= 18) {
+                l2len = 18;
+                proto = pkt[16] << 8 | pkt[17];
+            }
+            break;
+        case PCAP_LINKTYPE_SLL:
+            l2len = 16;
+            proto = caplen >= 16 ? pkt[14] << 8 | pkt[15] : 0;
+            break;
+        case PCAP_LINKTYPE_SLL2:
+            l2len = 20;
+            proto = caplen >= 20 ? pkt[0] << 8 | pkt[1] : 0;
+            break;
+        case PCAP_LINKTYPE_RAW:
+            l2len = 0;
+            proto = 0x0800;
+            break;
+        default:
+            fprintf(stderr, "Unsupported pcap link type %u\n", linktype);
+            return -1;
+        }
+        if (proto != 0x0800 || caplen < (unsigned int)l2len + 20)
+            continue;
+        ip = pkt + l2len;
+        iplen = (ip[0] & 0x0f) * 4;
+        if ((ip[0] >> 4) != 4 || ip[9] != IPPROTO_UDP || caplen < (unsigned int)(l2len + iplen + 8))
+            continue;
+        udp = ip + iplen;
+        if ((udp[2] << 8 | udp[3]) != port)
+            continue;
+        if (add_msg(udp + 8, (int)caplen - l2len - iplen - 8) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int script_error(const char *fn, int line, const char *reason) {
+    fprintf(stderr, "%s:%d: %s\n", fn, line, reason);
+    return -1;
+}
+
+static int load_script_file(const char *fn, char *text) {
+    unsigned char buffer[REPLAY_MSG_LEN];
+    char *line, *next, *p, *end, *value;
+    int len, value_len, line_no = 0;
+    unsigned long id;
+
+    for (line = text; line; line = next) {
+        next = strchr(line, '\n');
+        if (next)
+            *next++ = 0;
+        line_no++;
+        p = line;
+        while (isspace((unsigned char)*p))
+            p++;
+        if (*p == 0 || *p == '#')
+            continue;
+        if (strncmp(p, "sleep", 5) == 0) {
+            pending_delay_ms += atoi(p + 5);
+            continue;
+        }
+
+        id = strtoul(p, &end, 0);
+        if (end == p || id > 0xffff)
+            return script_error(fn, line_no, "Expected an API ID");
+        buffer[0] = REPLAY_API_VERSION;
+        buffer[1] = id >> 8;
+        buffer[2] = id & 0xff;
+        buffer[3] = buffer[4] = 0;
+        buffer[5] = buffer[6] = 0xff;
+        len = REPLAY_HDR_LEN;
+
+        for (p = end; ; ) {
+            while (isspace((unsigned char)*p))
+                p++;
+            if (*p == 0 || *p == '#')
+                break;
+            id = strtoul(p, &end, 0);
+            if (end == p || *end != '=' || id > 0xffff)
+                return script_error(fn, line_no, "Expected <tlv id>=<value>");
+            value = end + 1;
+            if (*value == '"') {
+                value++;
+                end = strchr(value, '"');
+                if (end == NULL)
+                    return script_error(fn, line_no, "Unterminated quote");
+                value_len = end - value;
+                p = end + 1;
+            } else {
+                for (end = value; *end && !isspace((unsigned char)*end); end++)
+                    ;
+                value_len = end - value;
+                p = end;
+            }
+            if (value_len > 255 || len + REPLAY_TLV_HDR_LEN + value_len > REPLAY_MSG_LEN)
+                return script_error(fn, line_no, "TLV value is too long");
+            buffer[len++] = id >> 8;
+            buffer[len++] = id & 0xff;
+            buffer[len++] = value_len;
+            memcpy(buffer + len, value, value_len);
+            len += value_len;
+        }
+        if (add_msg(buffer, len) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int load_file(const char *fn, int port) {
+    unsigned char *data;
+    long size;
+    FILE *fp;
+    int ret;
+
+    fp = fopen(fn, "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to open %s: %s\n", fn, strerror(errno));
+        return -1;
+    }
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    data = malloc(size + 1);
+    if (data == NULL || fread(data, 1, size, fp) != (size_t)size) {
+        fprintf(stderr, "Failed to read %s\n", fn);
+        fclose(fp);
+        free(data);
+        return -1;
+    }
+    fclose(fp);
+    data[size] = 0;
+
+    if (size >= 24 && (pcap_u32(data, 0) == PCAP_MAGIC_USEC || pcap_u32(data, 0) == PCAP_MAGIC_NSEC ||
+        pcap_u32(data, 1) == PCAP_MAGIC_USEC || pcap_u32(data, 1) == PCAP_MAGIC_NSEC))
+        ret = load_pcap_file(data, size, port);
+    else if (strncmp((char *)data, "0x", 2) == 0 && strchr((char *)data, ','))
+        ret = load_capture_file((char *)data);
+    else
+        ret = load_script_file(fn, (char *)data);
+    free(data);
+    return ret;
+}
+
+static struct replay_api* get_replay_api(unsigned short id) {
+    int i;
+
+    for (i = 0; i < api_count; i++) {
+        if (apis[i].id == id)
+            return &apis[i];
+    }
+    if (api_count == REPLAY_MAX_APIS)
+        return NULL;
+    apis[api_count].id = id;
+    return &apis[api_count++];
+}
+
+static void add_sample(struct replay_api *api, unsigned int ack_us, unsigned int total_us) {
+    unsigned int *tmp;
+
+    if (api->samples == api->max_samples) {
+        api->max_samples = api->max_samples ? api->max_samples * 2 : 64;
+        tmp = realloc(api->ack_us, api->max_samples * sizeof(unsigned int));
+        if (tmp == NULL)
+            return;
+        api->ack_us = tmp;
+        tmp = realloc(api->total_us, api->max_samples * sizeof(unsigned int));
+        if (tmp == NULL)
+            return;
+        api->total_us = tmp;
+    }
+    api->ack_us[api->samples] = ack_us;
+    api->total_us[api->samples] = total_us;
+    api->samples++;
+}
+
+static int compare_uint(const void *a, const void *b) {
+    unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Nearest-rank percentile */
+static unsigned int percentile(unsigned int *sorted, unsigned int count, int pct) {
+    unsigned long rank = ((unsigned long)count * pct + 99) / 100;
+
+    if (count == 0)
+        return 0;
+    return sorted[rank ? rank - 1 : 0];
+}
+
+/* Value of the status TLV or -1 */
+static int find_status(const unsigned char *data, int len) {
+    int offset = REPLAY_HDR_LEN, id, tlv_len;
+
+    while (offset + REPLAY_TLV_HDR_LEN <= len) {
+        id = data[offset] << 8 | data[offset + 1];
+        tlv_len = data[offset + 2];
+        if (id == REPLAY_TLV_STATUS && tlv_len > 0 && offset + REPLAY_TLV_HDR_LEN < len)
+            return data[offset + REPLAY_TLV_HDR_LEN];
+        offset += REPLAY_TLV_HDR_LEN + tlv_len;
+    }
+    return -1;
+}
+
+static unsigned short msg_api(struct replay_msg *msg) {
+    return msg->data[1] << 8 | msg->data[2];
+}
+
+/* Move to the next message, or to the next round of the sequence */
+static void client_next(struct replay_client *client, int iterations) {
+    client->index++;
+    if (client->index == msg_count) {
+        client->index = 0;
+        client->iteration++;
+    }
+    client->state = client->iteration == iterations ? CLIENT_DONE : CLIENT_SEND;
+}
+
+static void client_send(struct replay_client *client, struct sockaddr_in *server, int timeout_ms, unsigned long long now) {
+    struct replay_msg *msg = &msgs[client->index];
+
+    if (client->state == CLIENT_SEND && msg->delay_ms) {
+        client->state = CLIENT_DELAY;
+        client->deadline_us = now + msg->delay_ms * 1000ULL;
+        return;
+    }
+    /* Give each request its own sequence number to drop late answers */
+    client->seq++;
+    msg->data[3] = client->seq >> 8;
+    msg->data[4] = client->seq & 0xff;
+    client->sent_us = now;
+    client->deadline_us = now + timeout_ms * 1000ULL;
+    client->state = CLIENT_WAIT_ACK;
+    if (sendto(client->sock, msg->data, msg->len, 0, (struct sockaddr *)server, sizeof(*server)) < 0)
+        fprintf(stderr, "Failed to send: %s\n", strerror(errno));
+}
+
+static void client_receive(struct replay_client *client, int iterations) {
+    unsigned char buffer[REPLAY_MSG_LEN];
+    struct replay_msg *msg = &msgs[client->index];
+    struct replay_api *api;
+    unsigned long long now;
+    int len, type, status;
+
+    len = recv(client->sock, buffer, sizeof(buffer), 0);
+    if (len < REPLAY_HDR_LEN)
+        return;
+    if ((buffer[3] << 8 | buffer[4]) != client->seq)
+        return;
+    if (client->state != CLIENT_WAIT_ACK && client->state != CLIENT_WAIT_RESPONSE)
+        return;
+    now = replay_now_us();
+    type = buffer[1] << 8 | buffer[2];
+    status = find_status(buffer, len);
+    api = get_replay_api(msg_api(msg));
+
+    if (type == REPLAY_CMD_ACK && client->state == CLIENT_WAIT_ACK) {
+        client->ack_us = now;
+        if (status == REPLAY_STATUS_OK) {
+            client->state = CLIENT_WAIT_RESPONSE;
+            return;
+        }
+        if (api) {
+            api->count++;
+            api->nacks++;
+        }
+        if (verbose)
+            printf("API 0x%04x: NACK\n", msg_api(msg));
+    } else if (type == REPLAY_CMD_RESPONSE && client->state == CLIENT_WAIT_RESPONSE) {
+        if (api) {
+            api->count++;
+            if (status != REPLAY_STATUS_OK)
+                api->errors++;
+            add_sample(api, client->ack_us - client->sent_us, now - client->sent_us);
+        }
+        if (verbose)
+            printf("API 0x%04x: %s in %llu us\n", msg_api(msg),
+                status == REPLAY_STATUS_OK ? "OK" : "failed", now - client->sent_us);
+    } else {
+        return;
+    }
+    client_next(client, iterations);
+}
+
+static void print_report(unsigned long long elapsed_us) {
+    unsigned int total = 0, nacks = 0, errors = 0, timeouts = 0;
+    unsigned int *ack, *all;
+    int i;
+
+    printf("%-8s %7s %6s %6s %8s %9s %9s %9s %9s %9s\n", "API", "count", "nack", "error", "timeout",
+        "ack p50", "p50", "p90", "p99", "max (us)");
+    for (i = 0; i < api_count; i++) {
+        ack = apis[i].ack_us;
+        all = apis[i].total_us;
+        if (apis[i].samples) {
+            qsort(ack, apis[i].samples, sizeof(unsigned int), compare_uint);
+            qsort(all, apis[i].samples, sizeof(unsigned int), compare_uint);
+        }
+        printf("0x%04x   %7u %6u %6u %8u %9u %9u %9u %9u %9u\n", apis[i].id, apis[i].count + apis[i].timeouts,
+            apis[i].nacks, apis[i].errors, apis[i].timeouts, percentile(ack, apis[i].samples, 50),
+            percentile(all, apis[i].samples, 50), percentile(all, apis[i].samples, 90),
+            percentile(all, apis[i].samples, 99), percentile(all, apis[i].samples, 100));
+        total += apis[i].count + apis[i].timeouts;
+        nacks += apis[i].nacks;
+        errors += apis[i].errors;
+        timeouts += apis[i].timeouts;
+    }
+    printf("%u requests in %llu.%03llu s, %.1f requests/s, NACK rate %.2f%%, %u errors, %u timeouts\n",
+        total, elapsed_us / 1000000, elapsed_us / 1000 % 1000,
+        elapsed_us ? total * 1000000.0 / elapsed_us : 0.0,
+        total ? nacks * 100.0 / total : 0.0, errors, timeouts);
+}
+
+static void usage(const char *name) {
+    printf("usage:\n");
+    printf("%s [-s <server ip>] [-p <port>] [-c <clients>] [-n <iterations>] [-t <timeout ms>] [-v] <file>...\n\n", name);
+    printf("usage:\n");
+    printf("  -s = address of the control app, default 127.0.0.1\n");
+    printf("  -p = control port of the app, also used to select the pcap packets, default %d\n", SERVICE_PORT_DEFAULT);
+    printf("  -c = number of concurrent clients, each replays the whole sequence, default 1\n");
+    printf("  -n = number of times each client replays the sequence, default 1\n");
+    printf("  -t = time to wait for the ACK and the response, default %d\n", REPLAY_TIMEOUT_MS);
+    printf("  -v = print every request\n");
+    printf("  file = capture file of \"app -c\", pcap file or replay script\n");
+}
+
+int main(int argc, char *argv[]) {
+    struct replay_client clients[REPLAY_MAX_CLIENTS];
+    struct pollfd fds[REPLAY_MAX_CLIENTS];
+    int map[REPLAY_MAX_CLIENTS];
+    struct sockaddr_in server;
+    const char *server_ip = "127.0.0.1";
+    int port = SERVICE_PORT_DEFAULT, client_count = 1, iterations = 1, timeout_ms = REPLAY_TIMEOUT_MS;
+    unsigned long long start_us, now, wait_us;
+    int c, i, nfds, active;
+    struct replay_api *api;
+
+    while ((c = getopt(argc, argv, "s:p:c:n:t:vh")) != -1) {
+        switch (c) {
+        case 's':
+            server_ip = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'c':
+            client_count = atoi(optarg);
+            break;
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        case 't':
+            timeout_ms = atoi(optarg);
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind == argc || client_count < 1 || client_count > REPLAY_MAX_CLIENTS || iterations < 1 || timeout_ms < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    for (i = optind; i < argc; i++) {
+        if (load_file(argv[i], port) < 0)
+            return 1;
+    }
+    if (msg_count == 0) {
+        fprintf(stderr, "No control message to replay\n");
+        return 1;
+    }
+
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(port);
+    if (inet_pton(AF_INET, server_ip, &server.sin_addr) != 1) {
+        fprintf(stderr, "Invalid server address %s\n", server_ip);
+        return 1;
+    }
+    memset(clients, 0, sizeof(clients));
+    for (i = 0; i < client_count; i++) {
+        clients[i].sock = socket(AF_INET, SOCK_DGRAM, 0);
+        if (clients[i].sock < 0) {
+            fprintf(stderr, "Failed to open socket: %s\n", strerror(errno));
+            return 1;
+        }
+        clients[i].state = CLIENT_SEND;
+        clients[i].seq = i << 8;
+    }
+    printf("Replay %d messages to %s:%d, %d clients x %d iterations\n", msg_count, server_ip, port,
+        client_count, iterations);
+
+    start_us = replay_now_us();
+    do {
+        now = replay_now_us();
+        wait_us = timeout_ms * 1000ULL;
+        nfds = active = 0;
+        for (i = 0; i < client_count; i++) {
+            struct replay_client *client = &clients[i];
+
+            if (client->state == CLIENT_DELAY && now >= client->deadline_us)
+                client_send(client, &server, timeout_ms, now);
+            else if (client->state == CLIENT_SEND)
+                client_send(client, &server, timeout_ms, now);
+            if ((client->state == CLIENT_WAIT_ACK || client->state == CLIENT_WAIT_RESPONSE) &&
+                now >= client->deadline_us) {
+                api = get_replay_api(msg_api(&msgs[client->index]));
+                if (api)
+                    api->timeouts++;
+                if (verbose)
+                    printf("API 0x%04x: timeout\n", msg_api(&msgs[client->index]));
+                client_next(client, iterations);
+                if (client->state == CLIENT_SEND)
+                    client_send(client, &server, timeout_ms, now);
+            }
+            if (client->state == CLIENT_DONE)
+                continue;
+            active++;
+            if (client->deadline_us > now && client->deadline_us - now < wait_us)
+                wait_us = client->deadline_us - now;
+            if (client->state == CLIENT_WAIT_ACK || client->state == CLIENT_WAIT_RESPONSE) {
+                fds[nfds].fd = client->sock;
+                fds[nfds].events = POLLIN;
+                map[nfds++] = i;
+            }
+        }
+        if (active == 0)
+            break;
+        if (poll(fds, nfds, (wait_us + 999) / 1000) > 0) {
+            for (i = 0; i < nfds; i++) {
+                if (fds[i].revents & POLLIN)
+                    client_receive(&clients[map[i]], iterations);
+            }
+        }
+    } while (1);
+
+    print_report(replay_now_us() - start_us);
+    for (i = 0; i < client_count; i++)
+        close(clients[i].sock);
+    return 0;
+}
@@ -0,0 +1,48 @@
+/* Copyright (c) 2020 Wi-Fi Alliance                                                */
+
+/* Permission to use, copy, modify, and/or distribute this software for any         */
+/* purpose with or without fee is hereby granted, provided that the above           */
+/* copyright notice and this permission notice appear in all copies.                */
+
+/* THE SOFTWARE IS PROVIDED 'AS IS' AND THE AUTHOR DISCLAIMS ALL                    */
+/* WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED                    */
+/* WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL                     */
+/* THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR                       */
+/* CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING                        */
+/* FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF                       */
+/* CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT                       */
+/* OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS                          */
+/* SOFTWARE. */
+
+
+/* Static tracepoints of the control app, for perf and bpftrace.
+ *
+ * Built with USDT=1 (-DCONFIG_USDT), the probes are the sys/sdt.h markers of the
+ * provider "controlappc". They are a nop instruction in the code and a note in the
+ * ELF file, e.g.
+ *   bpftrace -e 'usdt:./app:controlappc:handle_end { @[str(arg0)] = hist(arg2); }'
+ *   perf buildid-cache --add ./app; perf probe sdt_controlappc:ctrl_request
+ * Otherwise they compile to nothing and their arguments are not evaluated.
+ */
+
+#ifndef _TRACEPOINT_
+#define _TRACEPOINT_
+
+#ifdef CONFIG_USDT
+#include <sys/sdt.h>
+
+#define QT_TRACE0(name) DTRACE_PROBE(controlappc, name)
+#define QT_TRACE1(name, a1) DTRACE_PROBE1(controlappc, name, a1)
+#define QT_TRACE2(name, a1, a2) DTRACE_PROBE2(controlappc, name, a1, a2)
+#define QT_TRACE3(name, a1, a2, a3) DTRACE_PROBE3(controlappc, name, a1, a2, a3)
+#define QT_TRACE4(name, a1, a2, a3, a4) DTRACE_PROBE4(controlappc, name, a1, a2, a3, a4)
+#else
+#define QT_TRACE0(name) do { } while (0)
+#define QT_TRACE1(name, a1) do { (void)sizeof(a1); } while (0)
+#define QT_TRACE2(name, a1, a2) do { (void)sizeof(a1); (void)sizeof(a2); } while (0)
+#define QT_TRACE3(name, a1, a2, a3) do { (void)sizeof(a1); (void)sizeof(a2); (void)sizeof(a3); } while (0)
+#define QT_TRACE4(name, a1, a2, a3, a4) \
+    do { (void)sizeof(a1); (void)sizeof(a2); (void)sizeof(a3); (void)sizeof(a4); } while (0)
+#endif /* CONFIG_USDT */
+
+#endif /* _TRACEPOINT_ */
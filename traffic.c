@@ -0,0 +1,1155 @@
+/* Copyright (c) 2020 Wi-Fi Alliance                                                */
+
+/* Permission to use, copy, modify, and/or distribute this software for any         */
+/* purpose with or without fee is hereby granted, provided that the above           */
+/* copyright notice and this permission notice appear in all copies.                */
+
+/* THE SOFTWARE IS PROVIDED 'AS IS' AND THE AUTHOR DISCLAIMS ALL                    */
+/* WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED                    */
+/* WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL                     */
+/* THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR                       */
+/* CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING                        */
+/* FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF                       */
+/* CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT                       */
+/* OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS                          */
+/* SOFTWARE. */
+
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <net/ethernet.h>
+#include <netpacket/packet.h>
+#include <netinet/in.h>
+#include <netinet/if_ether.h>
+#include <netinet/ip.h>
+#include <netinet/ip_icmp.h>
+#include <arpa/inet.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <linux/sockios.h>
+
+#include "vendor_specific.h"
+#include "utils.h"
+#include "traffic.h"
+#include "tracepoint.h"
+
+struct traffic_flow {
+    int in_use;
+    int finished;               /* all packets of a counted flow are sent */
+    struct traffic_config config;
+    struct traffic_stats stats;
+    uint16_t echo_id;
+    int header_len;
+    int size;
+    uint64_t start_ns;
+    uint64_t interval_ns;
+    uint64_t icmp_sum;
+    char *buffers;              /* TRAFFIC_BURST_MAX packets of size bytes */
+    /* Receive window used to tell reordered packets from duplicated ones */
+    int has_seq;
+    uint32_t highest_seq;
+    unsigned char seen[TRAFFIC_SEQ_WINDOW / 8];
+    struct traffic_latency latency;
+    /* SO_TIMESTAMPING: the OPT_ID key of every sent packet maps to its
+     * sequence number, the TX timestamps are kept by sequence number.
+     */
+    uint32_t tx_key;
+    uint32_t *key_seq;
+    struct traffic_tx_timestamp *tx_ts;
+};
+
+struct traffic_tx_timestamp {
+    uint32_t seq;
+    uint64_t sw_ns;
+    uint64_t hw_ns;
+};
+
+#define TRAFFIC_TS_FLAGS        (SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_TX_HARDWARE | \
+                                 SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_RX_HARDWARE | \
+                                 SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_RAW_HARDWARE | \
+                                 SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY)
+#define TRAFFIC_TS_CMSG_SIZE    256
+
+struct traffic_state {
+    int running;
+    int stop;
+    int cond_ready;
+    pthread_t sender;
+    pthread_t receiver;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;      /* a flow is added or the threads stop */
+    struct traffic_flow flows[TRAFFIC_MAX_FLOWS];
+};
+
+static struct traffic_state traffic = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+struct traffic_echo_state {
+    int running;
+    int stop;
+    int sock;
+    int timestamping;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    struct traffic_echo_stats stats;
+};
+
+static struct traffic_echo_state echo = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+uint64_t traffic_now_ns() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t traffic_timespec_ns(const struct timespec *ts) {
+    return (uint64_t)ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+/* Enable SO_TIMESTAMPING with flags on sock. Hardware timestamping on the
+ * NIC of ifname is best effort, the kernel software clock is used without it.
+ */
+static int traffic_enable_timestamping(int sock, char *ifname, int flags) {
+    struct hwtstamp_config hwconfig;
+    struct ifreq ifr;
+
+    if (ifname && strlen(ifname) && (flags & SOF_TIMESTAMPING_RAW_HARDWARE)) {
+        memset(&hwconfig, 0, sizeof(hwconfig));
+        hwconfig.tx_type = HWTSTAMP_TX_ON;
+        hwconfig.rx_filter = HWTSTAMP_FILTER_ALL;
+        memset(&ifr, 0, sizeof(ifr));
+        snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", ifname);
+        ifr.ifr_data = (void *)&hwconfig;
+        if (ioctl(sock, SIOCSHWTSTAMP, &ifr) < 0)
+            indigo_logger(LOG_LEVEL_DEBUG, "No hardware timestamping on %s (%s)", ifname, strerror(errno));
+    }
+    if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0) {
+        indigo_logger(LOG_LEVEL_WARNING, "SO_TIMESTAMPING is not supported (%s)", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* Read the software and raw hardware timestamps and, for the error queue,
+ * the OPT_ID key of a message. Return 1 if a timestamp is found.
+ */
+static int traffic_read_timestamps(struct msghdr *msg, uint64_t *sw_ns, uint64_t *hw_ns, uint32_t *key) {
+    struct scm_timestamping tss;
+    struct sock_extended_err serr;
+    struct cmsghdr *cmsg;
+    int found = 0;
+
+    *sw_ns = 0;
+    *hw_ns = 0;
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING) {
+            memcpy(&tss, CMSG_DATA(cmsg), sizeof(tss));
+            *sw_ns = traffic_timespec_ns(&tss.ts[0]);
+            *hw_ns = traffic_timespec_ns(&tss.ts[2]);
+            found = 1;
+        } else if (key && cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) {
+            memcpy(&serr, CMSG_DATA(cmsg), sizeof(serr));
+            if (serr.ee_errno == ENOMSG && serr.ee_origin == SO_EE_ORIGIN_TIMESTAMPING)
+                *key = serr.ee_data;
+        }
+    }
+    return found;
+}
+
+void traffic_latency_reset(struct traffic_latency *latency) {
+    memset(latency, 0, sizeof(*latency));
+}
+
+static int traffic_latency_bucket(uint64_t us) {
+    int msb, index;
+
+    if (us < LATENCY_SUB_BUCKETS)
+        return us;
+    msb = 63 - __builtin_clzll(us);
+    index = (msb - LATENCY_SUB_BUCKET_BITS + 1) * LATENCY_SUB_BUCKETS +
+            ((us >> (msb - LATENCY_SUB_BUCKET_BITS)) & (LATENCY_SUB_BUCKETS - 1));
+    return index < LATENCY_BUCKETS ? index : LATENCY_BUCKETS - 1;
+}
+
+/* The largest value that falls in the bucket */
+static uint64_t traffic_latency_bucket_value(int index) {
+    int shift;
+
+    if (index < LATENCY_SUB_BUCKETS)
+        return index;
+    shift = index / LATENCY_SUB_BUCKETS - 1;
+    return ((uint64_t)(LATENCY_SUB_BUCKETS + index % LATENCY_SUB_BUCKETS + 1) << shift) - 1;
+}
+
+void traffic_latency_add(struct traffic_latency *latency, uint64_t rtt_us) {
+    uint64_t diff;
+
+    if (latency->count == 0 || rtt_us < latency->min_us)
+        latency->min_us = rtt_us;
+    if (rtt_us > latency->max_us)
+        latency->max_us = rtt_us;
+    if (latency->count) {
+        diff = rtt_us > latency->last_us ? rtt_us - latency->last_us : latency->last_us - rtt_us;
+        latency->jitter_us += ((double)diff - latency->jitter_us) / 16;
+    }
+    latency->last_us = rtt_us;
+    latency->sum_us += rtt_us;
+    latency->count++;
+    latency->buckets[traffic_latency_bucket(rtt_us)]++;
+}
+
+uint64_t traffic_latency_percentile(struct traffic_latency *latency, int percent) {
+    unsigned int target, total = 0;
+    int i;
+
+    if (latency->count == 0)
+        return 0;
+    target = ((uint64_t)latency->count * percent + 99) / 100;
+    for (i = 0; i < LATENCY_BUCKETS; i++) {
+        total += latency->buckets[i];
+        if (total >= target)
+            break;
+    }
+    if (i == LATENCY_BUCKETS)
+        return latency->max_us;
+    /* The bucket bound can be above the real maximum */
+    return traffic_latency_bucket_value(i) < latency->max_us ? traffic_latency_bucket_value(i) : latency->max_us;
+}
+
+void traffic_latency_summary(struct traffic_latency *latency, struct traffic_stats *stats) {
+    stats->rtt_min = latency->min_us;
+    stats->rtt_max = latency->max_us;
+    stats->rtt_avg = latency->count ? latency->sum_us / latency->count : 0;
+    stats->rtt_p99 = traffic_latency_percentile(latency, 99);
+    stats->jitter = latency->jitter_us;
+}
+
+static int traffic_should_stop() {
+    return __atomic_load_n(&traffic.stop, __ATOMIC_ACQUIRE);
+}
+
+#define SEEN_BIT(seq)           ((seq) % TRAFFIC_SEQ_WINDOW)
+#define SEEN_TEST(f, seq)       ((f)->seen[SEEN_BIT(seq) / 8] & (1 << (SEEN_BIT(seq) % 8)))
+#define SEEN_SET(f, seq)        ((f)->seen[SEEN_BIT(seq) / 8] |= (1 << (SEEN_BIT(seq) % 8)))
+#define SEEN_CLEAR(f, seq)      ((f)->seen[SEEN_BIT(seq) / 8] &= ~(1 << (SEEN_BIT(seq) % 8)))
+
+/* Account one echoed sequence number. Caller holds traffic.lock.
+ * Return 0 for a duplicate so that its RTT is not counted twice.
+ */
+static int traffic_account_seq(struct traffic_flow *flow, uint32_t seq) {
+    uint32_t s;
+
+    if (!flow->has_seq || seq > flow->highest_seq) {
+        if (!flow->has_seq || seq - flow->highest_seq >= TRAFFIC_SEQ_WINDOW) {
+            memset(flow->seen, 0, sizeof(flow->seen));
+        } else {
+            for (s = flow->highest_seq + 1; s < seq; s++)
+                SEEN_CLEAR(flow, s);
+        }
+        SEEN_SET(flow, seq);
+        flow->highest_seq = seq;
+        flow->has_seq = 1;
+        flow->stats.received++;
+    } else if (flow->highest_seq - seq >= TRAFFIC_SEQ_WINDOW) {
+        /* Too late to track, count it as reordered */
+        flow->stats.received++;
+        flow->stats.reordered++;
+    } else if (SEEN_TEST(flow, seq)) {
+        flow->stats.duplicated++;
+        return 0;
+    } else {
+        SEEN_SET(flow, seq);
+        flow->stats.received++;
+        flow->stats.reordered++;
+    }
+    return 1;
+}
+
+/* Prepare the packet templates of a flow. The ICMP checksum of the fixed part is summed once */
+static int traffic_flow_init_buffers(struct traffic_flow *flow) {
+    struct traffic_payload *payload;
+    struct icmphdr *icmphdr;
+    char *packet;
+    int i;
+
+    flow->header_len = flow->config.pkt_type == DATA_TYPE_ICMP ? (int)sizeof(struct icmphdr) : 0;
+    flow->size = flow->config.packet_size;
+    if (flow->size < flow->header_len + (int)sizeof(struct traffic_payload))
+        flow->size = flow->header_len + sizeof(struct traffic_payload);
+    if (flow->size > TRAFFIC_PKT_MAX_SIZE)
+        flow->size = TRAFFIC_PKT_MAX_SIZE;
+
+    flow->buffers = malloc(TRAFFIC_BURST_MAX * flow->size);
+    if (!flow->buffers)
+        return -1;
+
+    for (i = 0; i < TRAFFIC_BURST_MAX; i++) {
+        packet = flow->buffers + i * flow->size;
+        memset(packet, 0x0A, flow->size);
+        payload = (struct traffic_payload *)(packet + flow->header_len);
+        memset(payload, 0, sizeof(*payload));
+        payload->magic = htonl(TRAFFIC_MAGIC);
+        if (flow->header_len) {
+            icmphdr = (struct icmphdr *)packet;
+            memset(icmphdr, 0, sizeof(*icmphdr));
+            icmphdr->type = ICMP_ECHO;
+            icmphdr->un.echo.id = htons(flow->echo_id);
+        }
+    }
+    if (flow->header_len)
+        flow->icmp_sum = icmp_checksum_partial(flow->buffers, flow->size, 0);
+
+    return 0;
+}
+
+/* Send one burst of a flow without blocking. Caller holds traffic.lock */
+static int traffic_flow_send(struct traffic_flow *flow, int count, uint64_t now_ns) {
+    struct mmsghdr msgs[TRAFFIC_BURST_MAX];
+    struct iovec iovs[TRAFFIC_BURST_MAX];
+    struct traffic_payload *payload;
+    struct icmphdr *icmphdr;
+    char *packet;
+    uint32_t seq;
+    int i;
+
+    memset(msgs, 0, sizeof(struct mmsghdr) * count);
+    for (i = 0; i < count; i++) {
+        packet = flow->buffers + i * flow->size;
+        seq = flow->stats.sent + i + 1;
+        payload = (struct traffic_payload *)(packet + flow->header_len);
+        payload->seq = htonl(seq);
+        payload->tx_ns = now_ns;
+        if (flow->header_len) {
+            icmphdr = (struct icmphdr *)packet;
+            icmphdr->un.echo.sequence = htons(seq & 0xffff);
+            icmphdr->checksum = icmp_checksum_fold(
+                icmp_checksum_partial(&payload->seq, sizeof(payload->seq) + sizeof(payload->tx_ns),
+                    icmp_checksum_partial(&icmphdr->un.echo.sequence, sizeof(icmphdr->un.echo.sequence), flow->icmp_sum)));
+        }
+        iovs[i].iov_base = packet;
+        iovs[i].iov_len = flow->size;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    count = sendmmsg(flow->config.sock, msgs, count, MSG_DONTWAIT);
+#ifdef CONFIG_USDT
+    for (i = 0; i < count; i++)
+        QT_TRACE3(loopback_send, flow->config.sock, flow->stats.sent + i + 1, flow->size);
+#endif /* CONFIG_USDT */
+    /* The kernel gives every sent datagram the next OPT_ID key */
+    for (i = 0; flow->key_seq && i < count; i++)
+        flow->key_seq[(flow->tx_key + i) % TRAFFIC_SEQ_WINDOW] = flow->stats.sent + i + 1;
+    if (flow->key_seq && count > 0)
+        flow->tx_key += count;
+
+    return count;
+}
+
+static void* traffic_sender_thread(void *arg) {
+    struct traffic_flow *flow;
+    struct timespec ts;
+    uint64_t now_ns, next_ns, deadline_ns;
+    int64_t due;
+    int i, k, n, rr = 0;
+
+    (void)arg;
+
+    pthread_mutex_lock(&traffic.lock);
+    while (!traffic_should_stop()) {
+        now_ns = traffic_now_ns();
+        next_ns = now_ns + TRAFFIC_RECV_POLL_MS * 1000000ULL;
+
+        /* Round robin, at most one burst per flow and round */
+        for (k = 0; k < TRAFFIC_MAX_FLOWS; k++) {
+            i = (rr + k) % TRAFFIC_MAX_FLOWS;
+            flow = &traffic.flows[i];
+            if (!flow->in_use || flow->finished)
+                continue;
+
+            /* Number of packets whose deadline has already passed */
+            if (flow->interval_ns)
+                due = (int64_t)((now_ns - flow->start_ns) / flow->interval_ns) + 1 - flow->stats.sent;
+            else
+                due = TRAFFIC_BURST_MAX;
+            if (due <= 0) {
+                deadline_ns = flow->start_ns + (uint64_t)flow->stats.sent * flow->interval_ns;
+                if (deadline_ns < next_ns)
+                    next_ns = deadline_ns;
+                continue;
+            }
+            if (due > TRAFFIC_BURST_MAX)
+                due = TRAFFIC_BURST_MAX;
+            if (flow->config.packet_count > 0 && due > flow->config.packet_count - flow->stats.sent)
+                due = flow->config.packet_count - flow->stats.sent;
+
+            n = traffic_flow_send(flow, due, now_ns);
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+                    /* Socket buffer is full. Retry shortly without losing the packets */
+                    n = 0;
+                    if (now_ns + 1000000ULL < next_ns)
+                        next_ns = now_ns + 1000000ULL;
+                } else {
+                    indigo_logger(LOG_LEVEL_WARNING, "Flow %d: send failed on packet %d (%s)",
+                                  i, flow->stats.sent + 1, strerror(errno));
+                    /* Keep the pacing. The packets are accounted as lost */
+                    n = due;
+                }
+            }
+            flow->stats.sent += n;
+            if (flow->config.packet_count > 0 && flow->stats.sent >= flow->config.packet_count)
+                flow->finished = 1;
+            else if (n > 0)
+                next_ns = now_ns;
+        }
+        rr = (rr + 1) % TRAFFIC_MAX_FLOWS;
+
+        if (next_ns > now_ns) {
+            ts.tv_sec = next_ns / 1000000000ULL;
+            ts.tv_nsec = next_ns % 1000000000ULL;
+            pthread_cond_timedwait(&traffic.wakeup, &traffic.lock, &ts);
+        } else {
+            /* Let the receiver and the eloop thread take the lock between two rounds */
+            pthread_mutex_unlock(&traffic.lock);
+            sched_yield();
+            pthread_mutex_lock(&traffic.lock);
+        }
+    }
+    pthread_mutex_unlock(&traffic.lock);
+
+    return NULL;
+}
+
+/* Keep the TX timestamps queued on the error queue of a flow. Caller holds traffic.lock */
+static void traffic_flow_read_errqueue(struct traffic_flow *flow) {
+    char control[TRAFFIC_TS_CMSG_SIZE];
+    struct traffic_tx_timestamp *entry;
+    struct msghdr msg;
+    uint64_t sw_ns, hw_ns;
+    uint32_t key, seq;
+
+    while (1) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(flow->config.sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+            break;
+        key = 0;
+        if (!traffic_read_timestamps(&msg, &sw_ns, &hw_ns, &key))
+            continue;
+        /* Software and hardware timestamps may come in two messages */
+        seq = flow->key_seq[key % TRAFFIC_SEQ_WINDOW];
+        entry = &flow->tx_ts[seq % TRAFFIC_SEQ_WINDOW];
+        if (entry->seq != seq) {
+            entry->seq = seq;
+            entry->sw_ns = 0;
+            entry->hw_ns = 0;
+        }
+        if (sw_ns)
+            entry->sw_ns = sw_ns;
+        if (hw_ns)
+            entry->hw_ns = hw_ns;
+    }
+}
+
+/* RTT of seq from the kernel timestamps, on the NIC clock if both ends have one */
+static int traffic_flow_kernel_rtt(struct traffic_flow *flow, uint32_t seq, struct msghdr *msg, uint64_t *rtt_ns) {
+    struct traffic_tx_timestamp *entry = &flow->tx_ts[seq % TRAFFIC_SEQ_WINDOW];
+    uint64_t sw_ns, hw_ns;
+
+    if (entry->seq != seq || !traffic_read_timestamps(msg, &sw_ns, &hw_ns, NULL))
+        return 0;
+    if (entry->hw_ns && hw_ns && hw_ns >= entry->hw_ns) {
+        *rtt_ns = hw_ns - entry->hw_ns;
+        return 1;
+    }
+    if (entry->sw_ns && sw_ns && sw_ns >= entry->sw_ns) {
+        *rtt_ns = sw_ns - entry->sw_ns;
+        return 1;
+    }
+    return 0;
+}
+
+/* Account the echoes of a flow. Caller holds traffic.lock */
+static void traffic_flow_receive(struct traffic_flow *flow, char buffers[][TRAFFIC_PKT_MAX_SIZE],
+                                 struct mmsghdr *msgs, int count) {
+    struct traffic_payload *payload;
+    struct icmphdr *icmphdr;
+    uint64_t now_ns = traffic_now_ns(), rtt_ns;
+    uint32_t seq;
+    int i, offset;
+
+    for (i = 0; i < count; i++) {
+        offset = 0;
+        if (flow->config.pkt_type == DATA_TYPE_ICMP) {
+            /* Raw socket: skip the IP header and match our echo replies by id */
+            offset = (buffers[i][0] & 0x0f) << 2;
+            icmphdr = (struct icmphdr *)(buffers[i] + offset);
+            offset += sizeof(struct icmphdr);
+            if ((int)msgs[i].msg_len < offset + (int)sizeof(struct traffic_payload) ||
+                icmphdr->type != ICMP_ECHOREPLY || ntohs(icmphdr->un.echo.id) != flow->echo_id)
+                continue;
+        }
+        payload = (struct traffic_payload *)(buffers[i] + offset);
+        if (msgs[i].msg_len >= offset + sizeof(struct traffic_payload) && ntohl(payload->magic) == TRAFFIC_MAGIC) {
+            seq = ntohl(payload->seq);
+            QT_TRACE3(loopback_receive, flow->config.sock, seq, msgs[i].msg_len);
+            if (!traffic_account_seq(flow, seq))
+                continue;
+            if (flow->tx_ts && traffic_flow_kernel_rtt(flow, seq, &msgs[i].msg_hdr, &rtt_ns)) {
+                traffic_latency_add(&flow->latency, rtt_ns / 1000);
+                flow->stats.timestamped++;
+            } else if (now_ns >= payload->tx_ns) {
+                traffic_latency_add(&flow->latency, (now_ns - payload->tx_ns) / 1000);
+            }
+        } else {
+            flow->stats.received++;
+        }
+    }
+}
+
+static void* traffic_receiver_thread(void *arg) {
+    static char buffers[TRAFFIC_BURST_MAX][TRAFFIC_PKT_MAX_SIZE];
+    static char controls[TRAFFIC_BURST_MAX][TRAFFIC_TS_CMSG_SIZE];
+    struct mmsghdr msgs[TRAFFIC_BURST_MAX];
+    struct iovec iovs[TRAFFIC_BURST_MAX];
+    struct pollfd pfds[TRAFFIC_MAX_FLOWS];
+    int index[TRAFFIC_MAX_FLOWS];
+    struct traffic_flow *flow;
+    int i, j, n, nfds;
+
+    (void)arg;
+
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0; i < TRAFFIC_BURST_MAX; i++) {
+        iovs[i].iov_base = buffers[i];
+        iovs[i].iov_len = TRAFFIC_PKT_MAX_SIZE;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    while (!traffic_should_stop()) {
+        nfds = 0;
+        pthread_mutex_lock(&traffic.lock);
+        for (i = 0; i < TRAFFIC_MAX_FLOWS; i++) {
+            if (!traffic.flows[i].in_use)
+                continue;
+            pfds[nfds].fd = traffic.flows[i].config.sock;
+            pfds[nfds].events = POLLIN;
+            index[nfds] = i;
+            nfds++;
+        }
+        pthread_mutex_unlock(&traffic.lock);
+
+        if (poll(pfds, nfds, TRAFFIC_RECV_POLL_MS) <= 0)
+            continue;
+
+        pthread_mutex_lock(&traffic.lock);
+        for (i = 0; i < nfds; i++) {
+            flow = &traffic.flows[index[i]];
+            /* The flow may be stopped while polling */
+            if (!(pfds[i].revents & (POLLIN | POLLERR)) || !flow->in_use || flow->config.sock != pfds[i].fd)
+                continue;
+            /* TX timestamps first, so that the echoes find them */
+            if (flow->tx_ts)
+                traffic_flow_read_errqueue(flow);
+            if (!(pfds[i].revents & POLLIN))
+                continue;
+            for (j = 0; j < TRAFFIC_BURST_MAX; j++) {
+                msgs[j].msg_hdr.msg_control = flow->tx_ts ? controls[j] : NULL;
+                msgs[j].msg_hdr.msg_controllen = flow->tx_ts ? TRAFFIC_TS_CMSG_SIZE : 0;
+            }
+            n = recvmmsg(pfds[i].fd, msgs, TRAFFIC_BURST_MAX, MSG_DONTWAIT, NULL);
+            if (n < 0) {
+                /* ICMP port unreachable on a connected UDP socket is reported here */
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNREFUSED)
+                    indigo_logger(LOG_LEVEL_WARNING, "Flow %d: receive failed (%s)", index[i], strerror(errno));
+                continue;
+            }
+            traffic_flow_receive(flow, buffers, msgs, n);
+        }
+        pthread_mutex_unlock(&traffic.lock);
+    }
+
+    return NULL;
+}
+
+/* Caller holds traffic.lock */
+static void traffic_flow_fill_stats(int flow_id, struct traffic_stats *stats) {
+    struct traffic_flow *flow = &traffic.flows[flow_id];
+
+    memcpy(stats, &flow->stats, sizeof(*stats));
+    stats->flow_id = flow_id;
+    traffic_latency_summary(&flow->latency, stats);
+    stats->lost = stats->sent - stats->received;
+    if (stats->lost < 0)
+        stats->lost = 0;
+}
+
+static int traffic_threads_start() {
+    pthread_condattr_t attr;
+
+    if (!traffic.cond_ready) {
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&traffic.wakeup, &attr);
+        pthread_condattr_destroy(&attr);
+        traffic.cond_ready = 1;
+    }
+
+    __atomic_store_n(&traffic.stop, 0, __ATOMIC_RELEASE);
+    if (pthread_create(&traffic.receiver, NULL, traffic_receiver_thread, NULL)) {
+        indigo_logger(LOG_LEVEL_ERROR, "Failed to create the loopback receiver thread");
+        return -1;
+    }
+    if (pthread_create(&traffic.sender, NULL, traffic_sender_thread, NULL)) {
+        indigo_logger(LOG_LEVEL_ERROR, "Failed to create the loopback sender thread");
+        __atomic_store_n(&traffic.stop, 1, __ATOMIC_RELEASE);
+        pthread_join(traffic.receiver, NULL);
+        return -1;
+    }
+    traffic.running = 1;
+
+    return 0;
+}
+
+static void traffic_threads_stop() {
+    if (!traffic.running)
+        return;
+
+    pthread_mutex_lock(&traffic.lock);
+    __atomic_store_n(&traffic.stop, 1, __ATOMIC_RELEASE);
+    pthread_cond_signal(&traffic.wakeup);
+    pthread_mutex_unlock(&traffic.lock);
+    pthread_join(traffic.sender, NULL);
+    pthread_join(traffic.receiver, NULL);
+    traffic.running = 0;
+}
+
+/* Add a flow on a connected UDP or raw ICMP socket. Return the flow id */
+int traffic_flow_start(struct traffic_config *config) {
+    struct traffic_flow *flow = NULL;
+    int i;
+
+    if (!config || config->sock <= 0) {
+        return -1;
+    }
+
+    for (i = 0; i < TRAFFIC_MAX_FLOWS; i++) {
+        if (!traffic.flows[i].in_use) {
+            flow = &traffic.flows[i];
+            break;
+        }
+    }
+    if (!flow) {
+        indigo_logger(LOG_LEVEL_ERROR, "No free traffic flow, %d flows are running", TRAFFIC_MAX_FLOWS);
+        return -1;
+    }
+
+    pthread_mutex_lock(&traffic.lock);
+    memset(flow, 0, sizeof(*flow));
+    memcpy(&flow->config, config, sizeof(flow->config));
+    flow->echo_id = (getpid() + i) & 0xffff;
+    if (traffic_flow_init_buffers(flow)) {
+        pthread_mutex_unlock(&traffic.lock);
+        indigo_logger(LOG_LEVEL_ERROR, "Failed to allocate the traffic flow buffers");
+        return -1;
+    }
+    if (config->timestamping) {
+        flow->key_seq = calloc(TRAFFIC_SEQ_WINDOW, sizeof(*flow->key_seq));
+        flow->tx_ts = calloc(TRAFFIC_SEQ_WINDOW, sizeof(*flow->tx_ts));
+        if (!flow->key_seq || !flow->tx_ts ||
+            traffic_enable_timestamping(config->sock, config->ifname, TRAFFIC_TS_FLAGS)) {
+            indigo_logger(LOG_LEVEL_WARNING, "Flow %d: timestamping is off, the RTT uses the app clock", i);
+            free(flow->key_seq);
+            free(flow->tx_ts);
+            flow->key_seq = NULL;
+            flow->tx_ts = NULL;
+            flow->config.timestamping = 0;
+        }
+    }
+    flow->interval_ns = config->interval > 0 ? (uint64_t)(config->interval * 1000000000.0) : 0;
+    flow->start_ns = traffic_now_ns();
+    flow->in_use = 1;
+    if (traffic.cond_ready)
+        pthread_cond_signal(&traffic.wakeup);
+    pthread_mutex_unlock(&traffic.lock);
+
+    if (!traffic.running && traffic_threads_start()) {
+        traffic_flow_stop(i, NULL);
+        return -1;
+    }
+
+    indigo_logger(LOG_LEVEL_INFO, "Flow %d starts: %s on %s count %d size %d interval %lf timestamping %d",
+                  i, config->pkt_type == DATA_TYPE_ICMP ? "icmp" : "udp",
+                  strlen(config->ifname) ? config->ifname : "default",
+                  config->packet_count, config->packet_size, config->interval, flow->config.timestamping);
+    return i;
+}
+
+/* Wait for a counted flow to send all packets, then give the echoes up to drain_ms to come back */
+int traffic_flow_wait(int flow_id, int drain_ms) {
+    struct traffic_stats stats;
+    uint64_t deadline_ns;
+    int finished;
+
+    if (flow_id < 0 || flow_id >= TRAFFIC_MAX_FLOWS || !traffic.flows[flow_id].in_use ||
+        traffic.flows[flow_id].config.packet_count < 0) {
+        return -1;
+    }
+
+    do {
+        pthread_mutex_lock(&traffic.lock);
+        finished = traffic.flows[flow_id].finished;
+        pthread_mutex_unlock(&traffic.lock);
+        if (!finished)
+            usleep(10000);
+    } while (!finished);
+
+    deadline_ns = traffic_now_ns() + (uint64_t)drain_ms * 1000000ULL;
+    while (1) {
+        traffic_flow_get_stats(flow_id, &stats);
+        if (stats.received >= stats.sent || traffic_now_ns() >= deadline_ns)
+            break;
+        usleep(10000);
+    }
+    return stats.received;
+}
+
+int traffic_flow_stop(int flow_id, struct traffic_stats *stats) {
+    struct traffic_flow *flow;
+    struct traffic_stats result;
+    int i, count = 0;
+
+    if (stats)
+        memset(stats, 0, sizeof(*stats));
+    if (flow_id < 0 || flow_id >= TRAFFIC_MAX_FLOWS || !traffic.flows[flow_id].in_use) {
+        return 0;
+    }
+
+    flow = &traffic.flows[flow_id];
+    pthread_mutex_lock(&traffic.lock);
+    traffic_flow_fill_stats(flow_id, &result);
+    flow->in_use = 0;
+    close(flow->config.sock);
+    flow->config.sock = 0;
+    free(flow->buffers);
+    flow->buffers = NULL;
+    free(flow->key_seq);
+    flow->key_seq = NULL;
+    free(flow->tx_ts);
+    flow->tx_ts = NULL;
+    for (i = 0; i < TRAFFIC_MAX_FLOWS; i++) {
+        if (traffic.flows[i].in_use)
+            count++;
+    }
+    pthread_mutex_unlock(&traffic.lock);
+
+    if (count == 0)
+        traffic_threads_stop();
+
+    indigo_logger(LOG_LEVEL_INFO, "Flow %d stops: sent %d received %d lost %d reordered %d duplicated %d",
+                  flow_id, result.sent, result.received, result.lost, result.reordered, result.duplicated);
+    indigo_logger(LOG_LEVEL_INFO, "Flow %d RTT(us): min %u avg %u max %u p99 %u jitter %u timestamped %d",
+                  flow_id, result.rtt_min, result.rtt_avg, result.rtt_max, result.rtt_p99, result.jitter,
+                  result.timestamped);
+    if (stats)
+        memcpy(stats, &result, sizeof(result));
+
+    return result.received;
+}
+
+int traffic_flow_get_stats(int flow_id, struct traffic_stats *stats) {
+    if (flow_id < 0 || flow_id >= TRAFFIC_MAX_FLOWS || !traffic.flows[flow_id].in_use) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&traffic.lock);
+    traffic_flow_fill_stats(flow_id, stats);
+    pthread_mutex_unlock(&traffic.lock);
+
+    return 0;
+}
+
+int traffic_flow_count() {
+    int i, count = 0;
+
+    for (i = 0; i < TRAFFIC_MAX_FLOWS; i++) {
+        if (traffic.flows[i].in_use)
+            count++;
+    }
+    return count;
+}
+
+/* Stop every flow. The stats are the sum of all flows, the RTT is over all echoes */
+int traffic_stop_all(struct traffic_stats *stats) {
+    static struct traffic_latency latency;
+    struct traffic_latency *flow_latency;
+    struct traffic_stats total, flow_stats;
+    int i, j;
+
+    memset(&total, 0, sizeof(total));
+    total.flow_id = -1;
+    traffic_latency_reset(&latency);
+
+    for (i = 0; i < TRAFFIC_MAX_FLOWS; i++) {
+        if (!traffic.flows[i].in_use)
+            continue;
+
+        /* Merge the histogram before the flow is released */
+        pthread_mutex_lock(&traffic.lock);
+        flow_latency = &traffic.flows[i].latency;
+        if (flow_latency->count) {
+            if (latency.count == 0 || flow_latency->min_us < latency.min_us)
+                latency.min_us = flow_latency->min_us;
+            if (flow_latency->max_us > latency.max_us)
+                latency.max_us = flow_latency->max_us;
+            if (flow_latency->jitter_us > latency.jitter_us)
+                latency.jitter_us = flow_latency->jitter_us;
+            latency.sum_us += flow_latency->sum_us;
+            latency.count += flow_latency->count;
+            for (j = 0; j < LATENCY_BUCKETS; j++)
+                latency.buckets[j] += flow_latency->buckets[j];
+        }
+        pthread_mutex_unlock(&traffic.lock);
+
+        traffic_flow_stop(i, &flow_stats);
+        total.sent += flow_stats.sent;
+        total.received += flow_stats.received;
+        total.lost += flow_stats.lost;
+        total.reordered += flow_stats.reordered;
+        total.duplicated += flow_stats.duplicated;
+        total.timestamped += flow_stats.timestamped;
+    }
+    traffic_latency_summary(&latency, &total);
+    if (stats)
+        memcpy(stats, &total, sizeof(total));
+
+    return total.received;
+}
+
+static void* traffic_echo_thread(void *arg) {
+    static char buffers[TRAFFIC_BURST_MAX][TRAFFIC_PKT_MAX_SIZE];
+    static char controls[TRAFFIC_BURST_MAX][TRAFFIC_TS_CMSG_SIZE];
+    struct sockaddr_storage addrs[TRAFFIC_BURST_MAX];
+    struct mmsghdr msgs[TRAFFIC_BURST_MAX];
+    struct iovec iovs[TRAFFIC_BURST_MAX];
+    uint64_t rx_ns[TRAFFIC_BURST_MAX], hw_ns, now_ns, residence_us, residence_sum, residence_max;
+    struct timespec now;
+    unsigned long long bytes;
+    int i, n, sent, ret, timestamped;
+
+    (void)arg;
+
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0; i < TRAFFIC_BURST_MAX; i++) {
+        iovs[i].iov_base = buffers[i];
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &addrs[i];
+    }
+
+    while (!__atomic_load_n(&echo.stop, __ATOMIC_ACQUIRE)) {
+        for (i = 0; i < TRAFFIC_BURST_MAX; i++) {
+            iovs[i].iov_len = TRAFFIC_PKT_MAX_SIZE;
+            msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+            msgs[i].msg_hdr.msg_control = echo.timestamping ? controls[i] : NULL;
+            msgs[i].msg_hdr.msg_controllen = echo.timestamping ? TRAFFIC_TS_CMSG_SIZE : 0;
+        }
+        n = recvmmsg(echo.sock, msgs, TRAFFIC_BURST_MAX, MSG_WAITFORONE, NULL);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                indigo_logger(LOG_LEVEL_WARNING, "Loopback server receive failed (%s)", strerror(errno));
+            continue;
+        }
+
+        /* Echo the batch back with the received lengths */
+        bytes = 0;
+        for (i = 0; i < n; i++) {
+            iovs[i].iov_len = msgs[i].msg_len;
+            bytes += msgs[i].msg_len;
+            QT_TRACE2(loopback_echo, echo.sock, msgs[i].msg_len);
+            /* Take the RX timestamp out, the control data must not be sent back */
+            rx_ns[i] = 0;
+            if (echo.timestamping)
+                traffic_read_timestamps(&msgs[i].msg_hdr, &rx_ns[i], &hw_ns, NULL);
+            msgs[i].msg_hdr.msg_control = NULL;
+            msgs[i].msg_hdr.msg_controllen = 0;
+        }
+        for (sent = 0; sent < n; sent += ret) {
+            ret = sendmmsg(echo.sock, &msgs[sent], n - sent, 0);
+            if (ret <= 0) {
+                if (ret < 0 && errno == EINTR) {
+                    ret = 0;
+                    continue;
+                }
+                break;
+            }
+        }
+
+        /* Time the datagrams spent between the kernel receive and the echo */
+        timestamped = 0;
+        residence_sum = 0;
+        residence_max = 0;
+        if (echo.timestamping) {
+            clock_gettime(CLOCK_REALTIME, &now);
+            now_ns = traffic_timespec_ns(&now);
+            for (i = 0; i < sent; i++) {
+                if (!rx_ns[i] || rx_ns[i] > now_ns)
+                    continue;
+                residence_us = (now_ns - rx_ns[i]) / 1000;
+                residence_sum += residence_us;
+                if (residence_us > residence_max)
+                    residence_max = residence_us;
+                timestamped++;
+            }
+        }
+
+        pthread_mutex_lock(&echo.lock);
+        echo.stats.timestamped += timestamped;
+        echo.stats.residence_sum_us += residence_sum;
+        if (residence_max > echo.stats.residence_max_us)
+            echo.stats.residence_max_us = residence_max;
+        echo.stats.received += n;
+        echo.stats.echoed += sent;
+        echo.stats.dropped += n - sent;
+        echo.stats.bytes += bytes;
+        echo.stats.batches++;
+        if ((unsigned int)n > echo.stats.max_batch)
+            echo.stats.max_batch = n;
+        pthread_mutex_unlock(&echo.lock);
+    }
+
+    return NULL;
+}
+
+/* Start the echo thread on a bound UDP socket */
+int traffic_echo_start(int sock, int timestamping) {
+    struct timeval timeout;
+#ifdef SO_BUSY_POLL
+    int busy_poll = TRAFFIC_ECHO_BUSY_POLL_US;
+#endif
+
+    if (sock <= 0) {
+        return -1;
+    }
+    if (echo.running) {
+        traffic_echo_stop(NULL);
+    }
+
+    pthread_mutex_lock(&echo.lock);
+    memset(&echo.stats, 0, sizeof(echo.stats));
+    pthread_mutex_unlock(&echo.lock);
+    echo.sock = sock;
+    echo.timestamping = timestamping &&
+        !traffic_enable_timestamping(sock, NULL, SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE);
+    __atomic_store_n(&echo.stop, 0, __ATOMIC_RELEASE);
+
+    timeout.tv_sec = 0;
+    timeout.tv_usec = TRAFFIC_RECV_POLL_MS * 1000;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeout, sizeof(timeout));
+#ifdef SO_BUSY_POLL
+    /* Best effort. It needs CAP_NET_ADMIN and driver support */
+    setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &busy_poll, sizeof(busy_poll));
+#endif
+
+    if (pthread_create(&echo.thread, NULL, traffic_echo_thread, NULL)) {
+        indigo_logger(LOG_LEVEL_ERROR, "Failed to create the loopback echo thread");
+        return -1;
+    }
+    echo.running = 1;
+
+    return 0;
+}
+
+/* Stop the echo thread and close its socket */
+int traffic_echo_stop(struct traffic_echo_stats *stats) {
+    struct traffic_echo_stats result;
+
+    if (!echo.running) {
+        if (stats)
+            traffic_echo_get_stats(stats);
+        return 0;
+    }
+
+    __atomic_store_n(&echo.stop, 1, __ATOMIC_RELEASE);
+    pthread_join(echo.thread, NULL);
+    close(echo.sock);
+    echo.sock = 0;
+    echo.running = 0;
+
+    traffic_echo_get_stats(&result);
+    indigo_logger(LOG_LEVEL_INFO, "Loopback server stops: received %u echoed %u dropped %u bytes %llu batches %u max batch %u",
+                  result.received, result.echoed, result.dropped, result.bytes, result.batches, result.max_batch);
+    if (result.timestamped)
+        indigo_logger(LOG_LEVEL_INFO, "Loopback server residence(us): avg %llu max %u",
+                      result.residence_sum_us / result.timestamped, result.residence_max_us);
+    if (stats)
+        memcpy(stats, &result, sizeof(result));
+
+    return result.received;
+}
+
+int traffic_echo_is_running() {
+    return echo.running;
+}
+
+/* Counters of the running server, or of the last one after it stops */
+void traffic_echo_get_stats(struct traffic_echo_stats *stats) {
+    pthread_mutex_lock(&echo.lock);
+    memcpy(stats, &echo.stats, sizeof(*stats));
+    pthread_mutex_unlock(&echo.lock);
+}
+
+/* Open an ARP packet socket on ifname and read the local MAC and IPv4 address */
+static int traffic_arp_open(const char *ifname, int *ifindex, unsigned char *mac, struct in_addr *ip) {
+    struct sockaddr_ll addr;
+    struct ifreq ifr;
+    int sock;
+
+    sock = socket(AF_PACKET, SOCK_DGRAM | SOCK_CLOEXEC, htons(ETH_P_ARP));
+    if (sock < 0) {
+        indigo_logger(LOG_LEVEL_ERROR, "Failed to open ARP socket (%s)", strerror(errno));
+        return -1;
+    }
+
+    memset(&ifr, 0, sizeof(ifr));
+    snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", ifname);
+    if (ioctl(sock, SIOCGIFINDEX, &ifr) < 0) {
+        indigo_logger(LOG_LEVEL_ERROR, "Failed to get the index of %s (%s)", ifname, strerror(errno));
+        goto fail;
+    }
+    *ifindex = ifr.ifr_ifindex;
+    if (ioctl(sock, SIOCGIFHWADDR, &ifr) < 0) {
+        indigo_logger(LOG_LEVEL_ERROR, "Failed to get the MAC address of %s (%s)", ifname, strerror(errno));
+        goto fail;
+    }
+    memcpy(mac, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+    /* Without an address the requests go out as ARP probes from 0.0.0.0 */
+    ip->s_addr = INADDR_ANY;
+    ifr.ifr_addr.sa_family = AF_INET;
+    if (ioctl(sock, SIOCGIFADDR, &ifr) == 0)
+        *ip = ((struct sockaddr_in *)&ifr.ifr_addr)->sin_addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sll_family = AF_PACKET;
+    addr.sll_protocol = htons(ETH_P_ARP);
+    addr.sll_ifindex = *ifindex;
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        indigo_logger(LOG_LEVEL_ERROR, "Failed to bind ARP socket to %s (%s)", ifname, strerror(errno));
+        goto fail;
+    }
+
+    return sock;
+fail:
+    close(sock);
+    return -1;
+}
+
+/* Count the ARP replies from target that are queued on the socket */
+static int traffic_arp_receive(int sock, struct in_addr *target) {
+    struct sockaddr_ll from;
+    struct ether_arp reply;
+    socklen_t from_len;
+    ssize_t len;
+    int count = 0;
+
+    while (1) {
+        from_len = sizeof(from);
+        len = recvfrom(sock, &reply, sizeof(reply), MSG_DONTWAIT, (struct sockaddr *)&from, &from_len);
+        if (len < 0)
+            break;
+        if (len < (ssize_t)sizeof(reply) || from.sll_pkttype != PACKET_HOST)
+            continue;
+        if (ntohs(reply.arp_op) != ARPOP_REPLY || memcmp(reply.arp_spa, &target->s_addr, 4))
+            continue;
+        count++;
+    }
+
+    return count;
+}
+
+/* Send count broadcast ARP requests for target_ip on ifname, one every
+ * interval seconds, and count the replies. Replies are collected while
+ * waiting for the next request and for one more interval after the last.
+ */
+int traffic_arp_send(const char *ifname, const char *target_ip, int count, double interval, int *sent) {
+    struct sockaddr_ll dest;
+    struct ether_arp request;
+    struct in_addr target, local;
+    struct pollfd pfd;
+    uint64_t next_ns, deadline_ns, now_ns, interval_ns;
+    int sock, ifindex, wait_ms, received = 0;
+
+    *sent = 0;
+    if (inet_pton(AF_INET, target_ip, &target) != 1) {
+        indigo_logger(LOG_LEVEL_ERROR, "Invalid ARP target %s", target_ip);
+        return -1;
+    }
+    sock = traffic_arp_open(ifname, &ifindex, request.arp_sha, &local);
+    if (sock < 0)
+        return -1;
+
+    request.arp_hrd = htons(ARPHRD_ETHER);
+    request.arp_pro = htons(ETH_P_IP);
+    request.arp_hln = ETH_ALEN;
+    request.arp_pln = 4;
+    request.arp_op = htons(ARPOP_REQUEST);
+    memcpy(request.arp_spa, &local.s_addr, 4);
+    memset(request.arp_tha, 0, ETH_ALEN);
+    memcpy(request.arp_tpa, &target.s_addr, 4);
+
+    memset(&dest, 0, sizeof(dest));
+    dest.sll_family = AF_PACKET;
+    dest.sll_protocol = htons(ETH_P_ARP);
+    dest.sll_ifindex = ifindex;
+    dest.sll_halen = ETH_ALEN;
+    memset(dest.sll_addr, 0xff, ETH_ALEN);
+
+    if (interval <= 0)
+        interval = 1;
+    interval_ns = (uint64_t)(interval * 1e9);
+    pfd.fd = sock;
+    pfd.events = POLLIN;
+
+    next_ns = traffic_now_ns();
+    deadline_ns = next_ns + interval_ns * count;
+    while (1) {
+        now_ns = traffic_now_ns();
+        if (*sent < count && now_ns >= next_ns) {
+            if (sendto(sock, &request, sizeof(request), 0, (struct sockaddr *)&dest, sizeof(dest)) < 0) {
+                indigo_logger(LOG_LEVEL_WARNING, "Failed to send ARP request on %s (%s)", ifname, strerror(errno));
+                break;
+            }
+            (*sent)++;
+            next_ns += interval_ns;
+            continue;
+        }
+        if (now_ns >= deadline_ns)
+            break;
+        wait_ms = (int)(((*sent < count ? next_ns : deadline_ns) - now_ns + 999999) / 1000000);
+        if (poll(&pfd, 1, wait_ms) > 0)
+            received += traffic_arp_receive(sock, &target);
+    }
+    received += traffic_arp_receive(sock, &target);
+    close(sock);
+
+    return received;
+}
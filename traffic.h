@@ -0,0 +1,135 @@
+/* Copyright (c) 2020 Wi-Fi Alliance                                                */
+
+/* Permission to use, copy, modify, and/or distribute this software for any         */
+/* purpose with or without fee is hereby granted, provided that the above           */
+/* copyright notice and this permission notice appear in all copies.                */
+
+/* THE SOFTWARE IS PROVIDED 'AS IS' AND THE AUTHOR DISCLAIMS ALL                    */
+/* WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED                    */
+/* WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL                     */
+/* THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR                       */
+/* CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING                        */
+/* FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF                       */
+/* CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT                       */
+/* OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS                          */
+/* SOFTWARE. */
+
+
+#ifndef _INDIGO_TRAFFIC_
+#define _INDIGO_TRAFFIC_  1
+
+#include <stdint.h>
+
+/* Loopback traffic engine.
+ * Up to TRAFFIC_MAX_FLOWS flows run at the same time, each one on its own
+ * socket, interface, packet type, size and rate. One sender thread paces all
+ * flows against absolute deadlines, visits them round robin and sends at most
+ * one sendmmsg() burst per flow and round. One receiver thread polls the flow
+ * sockets and uses the sequence number in every payload to count loss,
+ * reordering and duplicates per flow.
+ * The echo thread serves the loopback server side with recvmmsg()/sendmmsg().
+ * With timestamping, a flow takes the RTT from SO_TIMESTAMPING TX timestamps
+ * read from the error queue and RX timestamps read from the cmsgs. The NIC
+ * clock is used when both are available, else the kernel software clock, so
+ * the scheduling delays of the app are left out of the RTT.
+ * The flow API is called from the eloop thread only.
+ * The ARP engine sends broadcast requests on an AF_PACKET socket and counts
+ * the replies in the calling thread.
+ */
+
+#define TRAFFIC_MAGIC               0x51544c42      /* "QTLB" */
+#define TRAFFIC_MAX_FLOWS           8
+#define TRAFFIC_BURST_MAX           32
+#define TRAFFIC_PKT_MAX_SIZE        1600
+#define TRAFFIC_SEQ_WINDOW          4096
+#define TRAFFIC_RECV_POLL_MS        100
+#define TRAFFIC_ECHO_BUSY_POLL_US   50
+
+/* RTT histogram: 8 linear sub-buckets per power of two microseconds */
+#define LATENCY_SUB_BUCKET_BITS     3
+#define LATENCY_SUB_BUCKETS         (1 << LATENCY_SUB_BUCKET_BITS)
+#define LATENCY_BUCKETS             (LATENCY_SUB_BUCKETS * 30)
+
+/* Payload header. It follows the ICMP header for ICMP echo requests.
+ * The rest of the packet is filled with 0x0A as before.
+ */
+struct traffic_payload {
+    uint32_t magic;
+    uint32_t seq;
+    uint64_t tx_ns;
+} __attribute__((packed));
+
+struct traffic_config {
+    int sock;                   /* connected UDP or raw ICMP socket, owned by the engine */
+    int pkt_type;               /* DATA_TYPE_UDP or DATA_TYPE_ICMP */
+    int packet_count;           /* -1: send until traffic_flow_stop() */
+    int packet_size;
+    double interval;            /* seconds between two packets */
+    char ifname[32];            /* interface the socket is bound to */
+    int timestamping;           /* take the RTT from kernel or NIC timestamps */
+};
+
+/* Counters of the loopback echo server */
+struct traffic_echo_stats {
+    unsigned int received;
+    unsigned int echoed;
+    unsigned int dropped;
+    unsigned long long bytes;
+    unsigned int batches;
+    unsigned int max_batch;
+    /* With timestamping: kernel receive to echo send, in microseconds */
+    unsigned int timestamped;
+    unsigned long long residence_sum_us;
+    unsigned int residence_max_us;
+};
+
+/* Fixed memory RTT accounting shared by the UDP engine and the ICMP path */
+struct traffic_latency {
+    unsigned int count;
+    uint64_t min_us;
+    uint64_t max_us;
+    uint64_t sum_us;
+    uint64_t last_us;
+    double jitter_us;           /* RFC 3550 style smoothed RTT variation */
+    unsigned int buckets[LATENCY_BUCKETS];
+};
+
+struct traffic_stats {
+    int flow_id;
+    int sent;
+    int received;
+    int lost;
+    int reordered;
+    int duplicated;
+    int timestamped;            /* RTT samples taken from kernel or NIC timestamps */
+    /* RTT summary in microseconds */
+    unsigned int rtt_min;
+    unsigned int rtt_avg;
+    unsigned int rtt_max;
+    unsigned int rtt_p99;
+    unsigned int jitter;
+};
+
+/* Flow API. A flow id is returned by traffic_flow_start() */
+int traffic_flow_start(struct traffic_config *config);
+int traffic_flow_wait(int flow_id, int drain_ms);
+int traffic_flow_stop(int flow_id, struct traffic_stats *stats);
+int traffic_flow_get_stats(int flow_id, struct traffic_stats *stats);
+int traffic_flow_count();
+int traffic_stop_all(struct traffic_stats *stats);
+
+/* Echo engine. Every datagram received on sock is sent back to its source */
+int traffic_echo_start(int sock, int timestamping);
+int traffic_echo_stop(struct traffic_echo_stats *stats);
+int traffic_echo_is_running();
+void traffic_echo_get_stats(struct traffic_echo_stats *stats);
+
+/* ARP engine. Returns the number of replies from target_ip or -1 */
+int traffic_arp_send(const char *ifname, const char *target_ip, int count, double interval, int *sent);
+
+uint64_t traffic_now_ns();
+void traffic_latency_reset(struct traffic_latency *latency);
+void traffic_latency_add(struct traffic_latency *latency, uint64_t rtt_us);
+uint64_t traffic_latency_percentile(struct traffic_latency *latency, int percent);
+void traffic_latency_summary(struct traffic_latency *latency, struct traffic_stats *stats);
+#endif /* _INDIGO_TRAFFIC_ */
@@ -28,10 +28,17 @@
 #include <sys/time.h>
 #endif
 #include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/syscall.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <linux/if.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
 #include <netinet/ip_icmp.h>
@@ -39,13 +46,15 @@
 #include <ifaddrs.h>
 #include <stdint.h>
 #include <errno.h>
-typedef uint8_t u_int8_t;
-typedef uint16_t u_int16_t;
-typedef uint32_t u_int32_t;
 
 #include "vendor_specific.h"
 #include "utils.h"
 #include "eloop.h"
+#include "wpas_config.h"
+#include "indigo_packet.h"
+#include "indigo_api.h"
+#include "tracepoint.h"
+#include "wpa_ctrl.h"
 
 /* Log */
 int stdout_level = LOG_LEVEL_DEBUG;
@@ -57,7 +66,6 @@ int configured_interface_count = 0;
 struct interface_info interfaces[16];
 int band_mbssid_cnt[16];
 struct interface_info* default_interface;
-static struct loopback_info loopback;
 /* bridge used for wireless interfaces */
 char wlans_bridge[32];
 
@@ -71,8 +79,6 @@ extern struct sockaddr_in *tool_addr;
 int use_openwrt_wpad = 0;
 #endif
 
-void send_continuous_loopback_packet(void *eloop_ctx, void *sock_ctx);
-
 void debug_print_timestamp(void) {
     time_t rawtime;
     struct tm *info;
@@ -169,6 +175,7 @@ void indigo_logger(int level, const char *fmt, ...) {
         va_end(ap);
     }
 #endif
+    free(format);
 }
 
 void open_tc_app_log() {
@@ -184,6 +191,75 @@ void open_tc_app_log() {
 #endif
 }
 
+static const char* eloop_kind_name(int kind) {
+    switch (kind) {
+    case ELOOP_KIND_SOCK:
+        return "socket";
+    case ELOOP_KIND_TIMEOUT:
+        return "timeout";
+    case ELOOP_KIND_SIGNAL:
+        return "signal";
+    case ELOOP_KIND_POST:
+        return "post";
+    default:
+        return "unknown";
+    }
+}
+
+/* Dump the eloop callback statistics, e.g. on SIGUSR1 */
+void log_eloop_stats() {
+    struct eloop_handler_stats stats[ELOOP_STATS_HANDLERS];
+    char buffer[S_BUFFER_LEN];
+    int i, count;
+
+    count = qt_eloop_get_stats(stats, ELOOP_STATS_HANDLERS);
+    indigo_logger(LOG_LEVEL_INFO, "eloop statistics of %d callbacks", count);
+    for (i = 0; i < count; i++) {
+        /* The entries stay after qt_eloop_reset_stats(), skip the ones not run since */
+        if (stats[i].count == 0)
+            continue;
+        indigo_logger(LOG_LEVEL_INFO, "%s %s: count %u avg %llu us max %llu us stalls %u",
+            eloop_kind_name(stats[i].kind), stats[i].name ? stats[i].name : "unnamed",
+            stats[i].count, stats[i].total_ns / stats[i].count / 1000,
+            stats[i].max_ns / 1000, stats[i].stalls);
+        format_latency_histogram(buffer, sizeof(buffer), stats[i].hist, ELOOP_HIST_BUCKETS);
+        indigo_logger(LOG_LEVEL_INFO, "  duration%s", buffer);
+        if (stats[i].kind == ELOOP_KIND_TIMEOUT || stats[i].kind == ELOOP_KIND_POST) {
+            format_latency_histogram(buffer, sizeof(buffer), stats[i].late_hist, ELOOP_HIST_BUCKETS);
+            indigo_logger(LOG_LEVEL_INFO, "  late avg %llu us max %llu us:%s",
+                stats[i].late_total_ns / stats[i].count / 1000,
+                stats[i].late_max_ns / 1000, buffer);
+        }
+    }
+}
+
+/* eloop stall handler */
+void log_eloop_stall(const char *name, const char *tag, unsigned int elapsed_ms) {
+    indigo_logger(LOG_LEVEL_WARNING, "%s held the event loop for %u ms%s%s",
+        name ? name : "Unnamed callback", elapsed_ms, tag ? " handling " : "", tag ? tag : "");
+}
+
+/* Sum up the eloop callback statistics and optionally start over */
+void get_eloop_stats_summary(struct eloop_stats_summary *summary, int reset) {
+    struct eloop_handler_stats stats[ELOOP_STATS_HANDLERS];
+    int i, count;
+
+    memset(summary, 0, sizeof(*summary));
+    count = qt_eloop_get_stats(stats, ELOOP_STATS_HANDLERS);
+    for (i = 0; i < count; i++) {
+        summary->callbacks += stats[i].count;
+        summary->stalls += stats[i].stalls;
+        if (stats[i].max_ns / 1000 >= summary->max_us) {
+            summary->max_us = stats[i].max_ns / 1000;
+            summary->max_name = stats[i].name;
+        }
+        if (stats[i].late_max_ns / 1000 > summary->late_max_us)
+            summary->late_max_us = stats[i].late_max_ns / 1000;
+    }
+    if (reset)
+        qt_eloop_reset_stats();
+}
+
 /* Close file handle and upload test case control app log */
 void close_tc_app_log() {
 #if UPLOAD_TC_APP_LOG
@@ -199,7 +275,7 @@ void close_tc_app_log() {
 
 /* System */
 int pipe_command(char *buffer, int buffer_size, char *cmd, char *parameter[]) {
-    int pipefds[2], len;
+    int pipefds[2], len, status = 0;
     pid_t pid;
 
     if (pipe(pipefds) == -1){
@@ -207,6 +283,7 @@ int pipe_command(char *buffer, int buffer_size, char *cmd, char *parameter[]) {
         return -1;
     }
 
+    QT_TRACE1(command_spawn, cmd);
     pid = fork();
     if (pid == -1) {
         indigo_logger(LOG_LEVEL_ERROR, "Failed to fork");
@@ -225,11 +302,24 @@ int pipe_command(char *buffer, int buffer_size, char *cmd, char *parameter[]) {
         len = read(pipefds[0], buffer, buffer_size);
         indigo_logger(LOG_LEVEL_DEBUG_VERBOSE, "Pipe system call= %s, Return length= %d, result= %s", cmd, len, buffer);
         close(pipefds[0]);
-        wait(NULL); /* Parent waits for the child to terminate */
+        wait(&status); /* Parent waits for the child to terminate */
+        QT_TRACE2(command_exit, cmd, status);
     }
     return len;
 }
 
+#ifdef CONFIG_USDT
+int traced_system(const char *command) {
+    int ret;
+
+    QT_TRACE1(command_spawn, command);
+    /* The parentheses call the libc function instead of the system() macro */
+    ret = (system)(command);
+    QT_TRACE2(command_exit, command, ret);
+    return ret;
+}
+#endif /* CONFIG_USDT */
+
 char* read_file(char *fn) {
     struct stat st;
     int fd, size;
@@ -240,7 +330,7 @@ char* read_file(char *fn) {
     size = st.st_size;
 
     fd = open(fn, O_RDONLY);
-    if (fd) {
+    if (fd >= 0) {
         buffer = (char*)malloc(sizeof(char)*(size+1));
         memset(buffer, 0, size+1);
         read(fd, buffer, size);
@@ -294,36 +384,23 @@ static char* indigo_strrstr(char *input, const char *token) {
 
 /* Loopback */
 int loopback_socket = 0;
+static int loopback_timestamping = 0;
 
-static void loopback_server_receive_message(int sock, void *eloop_ctx, void *sock_ctx) {
-    struct sockaddr_storage from;
-    unsigned char buffer[BUFFER_LEN];
-    ssize_t fromlen, len;
-
-    (void)eloop_ctx;
-    (void)sock_ctx;
-
-    fromlen = sizeof(from);
-    len = recvfrom(sock, buffer, BUFFER_LEN, 0, (struct sockaddr *) &from, (socklen_t *)&fromlen);
-    if (len < 0) {
-        indigo_logger(LOG_LEVEL_ERROR, "Loopback server recvfrom[server] error");
-        return ;
-    }
-
-    indigo_logger(LOG_LEVEL_INFO, "Loopback server received length = %d", len);
-
-    len = sendto(sock, (const char *)buffer, len, MSG_CONFIRM, (struct sockaddr *)&from, sizeof(from));
+/* Take the loopback RTT from kernel or NIC timestamps for the next server or flows */
+void loopback_set_timestamping(int enable) {
+    loopback_timestamping = enable;
+}
 
-    indigo_logger(LOG_LEVEL_INFO, "Loopback server echo back length = %d", len);
+int loopback_get_timestamping() {
+    return loopback_timestamping;
 }
 
 static void loopback_server_timeout(void *eloop_ctx, void *timeout_ctx) {
-    int s = (intptr_t)eloop_ctx;
-
+    (void)eloop_ctx;
     (void)timeout_ctx;
 
-    qt_eloop_unregister_read_sock(s);
-    close(s);
+    /* The echo thread owns and closes the socket */
+    traffic_echo_stop(NULL);
     loopback_socket = 0;
     indigo_logger(LOG_LEVEL_INFO, "Loopback server stops");
 }
@@ -362,13 +439,15 @@ int loopback_server_start(char *local_ip, char *local_port, int timeout) {
         sprintf(local_port, "%d", ntohs(addr.sin_port));
     }
 
-    /* Register to eloop and ready for the socket event */
-    if (qt_eloop_register_read_sock(s, loopback_server_receive_message, NULL, NULL)) {
-        indigo_logger(LOG_LEVEL_ERROR, "Failed to initiate ControlAppC");
+    /* Echo on a dedicated thread so that the eloop keeps serving the control commands */
+    if (traffic_echo_start(s, loopback_timestamping)) {
+        indigo_logger(LOG_LEVEL_ERROR, "Failed to start the loopback echo thread");
+        close(s);
         return -1;
     }
     loopback_socket = s;
     qt_eloop_register_timeout(timeout, 0, loopback_server_timeout, (void*)(intptr_t)s, NULL);
+    QT_ELOOP_HANDLER_NAME(loopback_server_timeout);
     indigo_logger(LOG_LEVEL_INFO, "Loopback Client starts ip %s port %s", local_ip, local_port);
 
     return 0;
@@ -377,8 +456,7 @@ int loopback_server_start(char *local_ip, char *local_port, int timeout) {
 int loopback_server_stop() {
     if (loopback_socket) {
         qt_eloop_cancel_timeout(loopback_server_timeout, (void*)(intptr_t)loopback_socket, NULL);
-        qt_eloop_unregister_read_sock(loopback_socket);
-        close(loopback_socket);
+        traffic_echo_stop(NULL);
         loopback_socket = 0;
     }
     return 0;
@@ -388,264 +466,131 @@ int loopback_server_status() {
     return !!loopback_socket;
 }
 
-unsigned short icmp_checksum(unsigned short *buf, int size)
-{
-    unsigned long sum = 0;
-    while (size > 1) {
-        sum += *buf;
-        buf++;
-        size -= 2;
-    }
-    if (size == 1)
-        sum += *(unsigned char *)buf;
-    sum = (sum & 0xffff) + (sum >> 16);
-    sum = (sum & 0xffff) + (sum >> 16);
-    return ~sum;
+/* Counters of the running server, or of the last one after it stops */
+void loopback_server_get_stats(struct traffic_echo_stats *stats) {
+    traffic_echo_get_stats(stats);
 }
 
-void setup_icmphdr(u_int8_t type, u_int8_t code, u_int16_t id,
-    u_int16_t seq, struct icmphdr *icmphdr, int packet_size)
+/* One's complement sum of buf added to sum, 32 bits at a time.
+ * The result is not folded so that partial sums of several areas can be added.
+ */
+uint64_t icmp_checksum_partial(const void *buf, int size, uint64_t sum)
 {
-    memset(icmphdr, 0, sizeof(struct icmphdr));
-    icmphdr->type = type;
-    icmphdr->code = code;
-    icmphdr->un.echo.id = id;
-    icmphdr->un.echo.sequence = seq;
-    icmphdr->checksum = icmp_checksum((unsigned short *)icmphdr, packet_size);
-}
-
-void send_one_loopback_icmp_packet(struct loopback_info *info) {
-    int n;
-    char server_reply[1600];
-    struct in_addr insaddr;
-    struct icmphdr *icmphdr, *recv_icmphdr;
-    struct iphdr *recv_iphdr;
-    struct sockaddr_in addr;
-
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = inet_addr(info->target_ip);
-
-    icmphdr = (struct icmphdr *)&info->message;
-
-    info->pkt_sent++;
-    setup_icmphdr(ICMP_ECHO, 0, 0, info->pkt_sent, icmphdr, info->pkt_size);
-
-    n = sendto(info->sock, (char *)info->message, info->pkt_size, 0, (struct sockaddr *)&addr, sizeof(addr));
-    if (n < 0) {
-        indigo_logger(LOG_LEVEL_WARNING, "Send failed on icmp packet %d", info->pkt_sent);
-        goto done;
+    const unsigned char *p = buf;
+    uint32_t word;
+    uint16_t half = 0;
+
+    while (size >= 4) {
+        memcpy(&word, p, 4);
+        sum += word;
+        p += 4;
+        size -= 4;
+    }
+    if (size >= 2) {
+        memcpy(&half, p, 2);
+        sum += half;
+        p += 2;
+        size -= 2;
     }
-    indigo_logger(LOG_LEVEL_INFO, "Packet %d: Send icmp %d bytes data to ip %s",
-                  info->pkt_sent, n, info->target_ip);
-
-    memset(&server_reply, 0, sizeof(server_reply));
-    n = recv(info->sock, server_reply, sizeof(server_reply), 0);
-    if (n < 0) {
-        indigo_logger(LOG_LEVEL_WARNING, "recv failed on icmp packet %d", info->pkt_sent);
-        goto done;
-    } else {
-        recv_iphdr = (struct iphdr *)server_reply;
-        recv_icmphdr = (struct icmphdr *)(server_reply + (recv_iphdr->ihl << 2));
-        insaddr.s_addr = recv_iphdr->saddr;
-
-        if (!strcmp(info->target_ip, inet_ntoa(insaddr)) && recv_icmphdr->type == ICMP_ECHOREPLY) {
-            indigo_logger(LOG_LEVEL_INFO, "icmp echo reply from %s, Receive echo %d bytes data", info->target_ip, n - 20);
-            info->pkt_rcv++;
-        } else {
-            indigo_logger(LOG_LEVEL_INFO, "Received packet is not the ICMP reply from the DUT");
-        }
+    if (size == 1) {
+        half = 0;
+        memcpy(&half, p, 1);
+        sum += half;
     }
-
-done:
-    qt_eloop_register_timeout(0, info->rate * 1000000, send_continuous_loopback_packet, info, NULL);
+    return sum;
 }
 
-void send_one_loopback_udp_packet(struct loopback_info *info) {
-    char server_reply[1600];
-    ssize_t recv_len = 0, send_len = 0;
-
-    memset(&server_reply, 0, sizeof(server_reply));
-
-    info->pkt_sent++;
-    send_len = send(info->sock, info->message, strlen(info->message), 0);
-    if (send_len < 0) {
-        indigo_logger(LOG_LEVEL_INFO, "Send failed on packet %d", info->pkt_sent);
-        // In case Tool doesn't send stop or doesn't receive stop
-        if (info->pkt_sent < 1000)
-            qt_eloop_register_timeout(0, info->rate*1000000, send_continuous_loopback_packet, info, NULL);
-        return;
-    }
-    indigo_logger(LOG_LEVEL_INFO, "Packet %d: Send loopback %d bytes data",
-            info->pkt_sent, send_len);
-
-    recv_len = recv(info->sock, server_reply, sizeof(server_reply), 0);
-    if (recv_len < 0) {
-        indigo_logger(LOG_LEVEL_INFO, "recv failed on packet %d", info->pkt_sent);
-        // In case Tool doesn't send stop or doesn't receive stop
-        if (info->pkt_sent < 1000)
-            qt_eloop_register_timeout(0, info->rate*1000000, send_continuous_loopback_packet, info, NULL);
-        return;
-    }
-    info->pkt_rcv++;
-    indigo_logger(LOG_LEVEL_INFO, "Receive echo %d bytes data", recv_len);
-
-    qt_eloop_register_timeout(0, info->rate*1000000, send_continuous_loopback_packet, info, NULL);
+unsigned short icmp_checksum_fold(uint64_t sum)
+{
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return ~sum;
 }
 
-void send_continuous_loopback_packet(void *eloop_ctx, void *sock_ctx) {
-    struct loopback_info *info = (struct loopback_info *)eloop_ctx;
-
-    (void)eloop_ctx;
-    (void)sock_ctx;
-
-    if (info->pkt_type == DATA_TYPE_ICMP) {
-        send_one_loopback_icmp_packet(info);
-    } else {
-        send_one_loopback_udp_packet(info);
-    }
+unsigned short icmp_checksum(unsigned short *buf, int size)
+{
+    return icmp_checksum_fold(icmp_checksum_partial(buf, size, 0));
 }
 
-/* Stop to send continuous loopback data */
-int stop_loopback_data(int *pkt_sent)
+/* Stop to send continuous loopback data. The stats are the sum of all flows */
+int stop_loopback_data(struct traffic_stats *stats)
 {
-    if (loopback.sock <= 0)
-        return 0;
-
-    qt_eloop_cancel_timeout(send_continuous_loopback_packet, &loopback, NULL);
-    close(loopback.sock);
-    loopback.sock = 0;
-    if (pkt_sent)
-        *pkt_sent = loopback.pkt_sent;
+    return traffic_stop_all(stats);
+}
 
-    return loopback.pkt_rcv;
+/* Stop one continuous loopback flow */
+int stop_loopback_flow(int flow_id, struct traffic_stats *stats)
+{
+    return traffic_flow_stop(flow_id, stats);
 }
 
-int send_udp_data(char *target_ip, int target_port, int packet_count, int packet_size, double rate) {
-    int s = 0, i = 0;
+/* Open the socket of a loopback flow, bind it to ifname and connect it to the target.
+ * Without ifname, use the bridge, the P2P group interface or the wireless interface.
+ */
+static int loopback_open_socket(int pkt_type, char *target_ip, int target_port, char *ifname,
+                                struct timeval *timeout, char *bound_ifname, int bound_ifname_size) {
+    int s;
     struct sockaddr_in addr;
-    int pkt_sent = 0, pkt_rcv = 0;
-    char message[1600], server_reply[1600];
-    char ifname[32];
-    ssize_t recv_len = 0, send_len = 0;
-    struct timeval timeout;
 
-    /* Open UDP socket */
-    s = socket(PF_INET, SOCK_DGRAM, 0);
+    if (pkt_type == DATA_TYPE_ICMP) {
+        s = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP);
+    } else {
+        s = socket(PF_INET, SOCK_DGRAM, 0);
+    }
     if (s < 0) {
         indigo_logger(LOG_LEVEL_ERROR, "Failed to open socket");
         return -1;
     }
 
-    if (rate < 1) {
-        timeout.tv_sec = 0;
-        timeout.tv_usec = rate * 1000000;
-    } else {
-        timeout.tv_sec = 1;
-        timeout.tv_usec = 0;
-    }
-    if (is_bridge_created()) {
-        snprintf(ifname, sizeof(ifname), "%s", get_wlans_bridge());
+    if (ifname && strlen(ifname)) {
+        snprintf(bound_ifname, bound_ifname_size, "%s", ifname);
+    } else if (is_bridge_created()) {
+        snprintf(bound_ifname, bound_ifname_size, "%s", get_wlans_bridge());
 #ifdef CONFIG_P2P
-    } else if (get_p2p_group_if(ifname, sizeof(ifname)) != 0)
-        snprintf(ifname, sizeof(ifname), "%s", get_wireless_interface());
+    } else if (get_p2p_group_if(bound_ifname, bound_ifname_size) != 0) {
+        snprintf(bound_ifname, bound_ifname_size, "%s", get_wireless_interface());
+    }
 #else
+    } else {
+        snprintf(bound_ifname, bound_ifname_size, "%s", get_wireless_interface());
     }
 #endif /* End Of CONFIG_P2P */
-    const int len = strnlen(ifname, IFNAMSIZ);
-    if (setsockopt(s, SOL_SOCKET, SO_BINDTODEVICE, ifname, len) < 0) {
-        indigo_logger(LOG_LEVEL_ERROR, "failed to bind the interface %s", ifname);
+    if (setsockopt(s, SOL_SOCKET, SO_BINDTODEVICE, bound_ifname, strnlen(bound_ifname, IFNAMSIZ)) < 0) {
+        indigo_logger(LOG_LEVEL_ERROR, "failed to bind the interface %s", bound_ifname);
+        close(s);
         return -1;
     }
+    indigo_logger(LOG_LEVEL_DEBUG, "Bind the interface %s", bound_ifname);
 
-    setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, (const char *)&timeout, sizeof(timeout));
-    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeout, sizeof(timeout));
+    setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, (const char *)timeout, sizeof(*timeout));
 
+    /* A connected raw socket only receives the ICMP packets of the target */
     memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
     if (target_ip) {
         addr.sin_addr.s_addr = inet_addr(target_ip);
     }
     addr.sin_port = htons(target_port);
-
     if (connect(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
         indigo_logger(LOG_LEVEL_ERROR, "Connect failed. Error");
         close(s);
         return -1;
     }
 
-    indigo_logger(LOG_LEVEL_INFO, "packet_count %d rate %lf\n",
-                  packet_count, rate);
-
-    /* Continuous data case: reply OK and use eloop timeout to send data */
-    if (packet_count == -1) {
-        loopback.sock = s;
-        loopback.pkt_type = DATA_TYPE_UDP;
-        loopback.rate = rate;
-        loopback.pkt_sent = loopback.pkt_rcv = 0;
-        memset(loopback.message, 0, sizeof(loopback.message));
-        for (i = 0; (i < packet_size) && (i < (int)sizeof(loopback.message)); i++)
-            loopback.message[i] = 0x0A;
-        qt_eloop_register_timeout(0, 0, send_continuous_loopback_packet, &loopback, NULL);
-        indigo_logger(LOG_LEVEL_INFO, "Send continuous loopback data to ip %s port %u",
-                      target_ip, target_port);
-        return 0;
-    }
-
-    memset(message, 0, sizeof(message));
-    for (i = 0; (i < packet_size) && (i < (int)sizeof(message)); i++)
-        message[i] = 0x0A;
-
-    for (pkt_sent = 1; pkt_sent <= packet_count; pkt_sent++) {
-        memset(&server_reply, 0, sizeof(server_reply));
-
-        send_len = send(s, message, strlen(message), 0);
-        if (send_len < 0) {
-            indigo_logger(LOG_LEVEL_INFO, "Send failed on packet %d", pkt_sent);
-            usleep(rate*1000000);
-            continue;
-        }
-        indigo_logger(LOG_LEVEL_INFO, "Packet %d: Send loopback %d bytes data to ip %s port %u",
-                      pkt_sent, send_len, target_ip, target_port);
-
-        recv_len = recv(s, server_reply, sizeof(server_reply), 0);
-        if (recv_len < 0) {
-            indigo_logger(LOG_LEVEL_INFO, "recv failed on packet %d", pkt_sent);
-            if (rate > 1)
-                usleep((rate-1)*1000000);
-            continue;
-        }
-        pkt_rcv++;
-        usleep(rate*1000000);
-
-        indigo_logger(LOG_LEVEL_INFO, "Receive echo %d bytes data", recv_len);
-    }
-    close(s);
-
-    return pkt_rcv;
+    return s;
 }
 
-int send_icmp_data(char *target_ip, int packet_count, int packet_size, double rate)
-{
-    int n, sock;
-    size_t i;
-    unsigned char buf[1600], server_reply[1600];
-    char ifname[32];
-    struct sockaddr_in addr;
-    struct in_addr insaddr;
-    struct icmphdr *icmphdr, *recv_icmphdr;
-    struct iphdr *recv_iphdr;
+/* Run one flow. A counted flow returns the received count, a continuous flow
+ * keeps running and its id is returned in stats->flow_id.
+ */
+static int send_loopback_data(int pkt_type, char *target_ip, int target_port, char *ifname,
+                              int packet_count, int packet_size, double rate, struct traffic_stats *stats) {
+    int s, flow_id;
     struct timeval timeout;
-    int pkt_sent = 0, pkt_rcv = 0;
-
-	sock = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP);
-	if (sock < 0) {
-        return -1;
-	}
+    struct traffic_config config;
 
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = inet_addr(target_ip);
+    if (stats)
+        memset(stats, 0, sizeof(*stats));
 
     if (rate < 1) {
         timeout.tv_sec = 0;
@@ -655,109 +600,59 @@ int send_icmp_data(char *target_ip, int packet_count, int packet_size, double ra
         timeout.tv_usec = 0;
     }
 
-    if (is_bridge_created()) {
-        snprintf(ifname, sizeof(ifname), "%s", get_wlans_bridge());
-#ifdef CONFIG_P2P
-    } else if (get_p2p_group_if(ifname, sizeof(ifname)) != 0)
-        snprintf(ifname, sizeof(ifname), "%s", get_wireless_interface());
-#else
-    }
-#endif /* End Of CONFIG_P2P */
-    const int len = strnlen(ifname, IFNAMSIZ);
-    if (setsockopt(sock, SOL_SOCKET, SO_BINDTODEVICE, ifname, len) < 0) {
-        indigo_logger(LOG_LEVEL_ERROR, "failed to bind the interface %s", ifname);
+    memset(&config, 0, sizeof(config));
+    s = loopback_open_socket(pkt_type, target_ip, target_port, ifname, &timeout, config.ifname, sizeof(config.ifname));
+    if (s < 0) {
         return -1;
     }
-    indigo_logger(LOG_LEVEL_DEBUG, "Bind the interface %s", ifname);
 
-    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (const char *)&timeout, sizeof(timeout));
-    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeout, sizeof(timeout));
+    indigo_logger(LOG_LEVEL_INFO, "packet_count %d rate %lf\n",
+                  packet_count, rate);
+
+    config.sock = s;
+    config.pkt_type = pkt_type;
+    config.packet_count = packet_count;
+    config.packet_size = packet_size;
+    config.interval = rate;
+    config.timestamping = loopback_timestamping;
+    flow_id = traffic_flow_start(&config);
+    if (flow_id < 0) {
+        close(s);
+        return -1;
+    }
 
-    /* Continuous data case: reply OK and use eloop timeout to send data */
+    /* Continuous data case: reply OK and let the traffic engine send data until stop */
     if (packet_count == -1) {
-        memset(&loopback, 0, sizeof(loopback));
-        loopback.sock = sock;
-        loopback.pkt_type = DATA_TYPE_ICMP;
-        loopback.rate = rate;
-        loopback.pkt_size = packet_size;
-        snprintf(loopback.target_ip, sizeof(loopback.target_ip), "%s", target_ip);
-        for (i = sizeof(struct icmphdr); (i < (size_t)packet_size) && (i < sizeof(loopback.message)); i++)
-            loopback.message[i] = 0x0A;
-        qt_eloop_register_timeout(0, 0, send_continuous_loopback_packet, &loopback, NULL);
-        indigo_logger(LOG_LEVEL_INFO, "Send continuous loopback data to ip %s", loopback.target_ip);
+        indigo_logger(LOG_LEVEL_INFO, "Send continuous loopback data to ip %s port %u on %s",
+                      target_ip, target_port, config.ifname);
+        if (stats)
+            stats->flow_id = flow_id;
         return 0;
     }
 
-    icmphdr = (struct icmphdr *)&buf;
-    memset(&buf, 0, sizeof(buf));
-    for (i = sizeof(struct icmphdr); (i < (size_t)packet_size) && (i < sizeof(buf)); i++)
-        buf[i] = 0x0A;
+    /* Give the last echoes the same time the per packet receive timeout used to */
+    traffic_flow_wait(flow_id, timeout.tv_sec * 1000 + timeout.tv_usec / 1000);
 
-    for (pkt_sent = 1; pkt_sent <= packet_count; pkt_sent++) {
-        memset(&server_reply, 0, sizeof(server_reply));
-        setup_icmphdr(ICMP_ECHO, 0, 0, pkt_sent, icmphdr, packet_size);
+    return traffic_flow_stop(flow_id, stats);
+}
 
-        n = sendto(sock, (char *)buf, packet_size, 0, (struct sockaddr *)&addr, sizeof(addr));
-        if (n < 0) {
-            indigo_logger(LOG_LEVEL_WARNING, "Send failed on icmp packet %d", pkt_sent);
-            usleep(rate * 1000000);
-            continue;
-        }
-        indigo_logger(LOG_LEVEL_INFO, "Packet %d: Send icmp %d bytes data to ip %s",
-                      pkt_sent, n, target_ip);
-
-        n = recv(sock, server_reply, sizeof(server_reply), 0);
-        if (n < 0) {
-            indigo_logger(LOG_LEVEL_WARNING, "recv failed on icmp packet %d", pkt_sent);
-            if (rate > 1)
-                usleep((rate - 1) * 1000000);
-            continue;
-        } else {
-            recv_iphdr = (struct iphdr *)server_reply;
-            recv_icmphdr = (struct icmphdr *)(server_reply + (recv_iphdr->ihl << 2));
-            insaddr.s_addr = recv_iphdr->saddr;
-
-            if (!strcmp(target_ip, inet_ntoa(insaddr)) && recv_icmphdr->type == ICMP_ECHOREPLY) {
-                /* IP header 20 bytes */
-                indigo_logger(LOG_LEVEL_INFO, "icmp echo reply from %s, Receive echo %d bytes data", target_ip, n - 20);
-                pkt_rcv++;
-            } else {
-                indigo_logger(LOG_LEVEL_INFO, "Received packet is not the ICMP reply from the Destination");
-            }
-        }
-        usleep(rate * 1000000);
-    }
+int send_udp_data(char *target_ip, int target_port, char *ifname, int packet_count, int packet_size, double rate, struct traffic_stats *stats) {
+    return send_loopback_data(DATA_TYPE_UDP, target_ip, target_port, ifname, packet_count, packet_size, rate, stats);
+}
 
-    close(sock);
-    return pkt_rcv;
+int send_icmp_data(char *target_ip, char *ifname, int packet_count, int packet_size, double rate, struct traffic_stats *stats)
+{
+    return send_loopback_data(DATA_TYPE_ICMP, target_ip, 0, ifname, packet_count, packet_size, rate, stats);
 }
 
+/* Send *send_count broadcast ARP requests, one every rate seconds, on the wireless interface */
 int send_broadcast_arp(char *target_ip, int *send_count, int rate) {
-    char buffer[S_BUFFER_LEN];
-    FILE *fp;
-    int recv = 0;
+    int count = *send_count, recv;
 
-#ifdef _OPENWRT_
-    snprintf(buffer, sizeof(buffer), "arping -I %s %s -c %d -b | grep broadcast", get_wireless_interface(), target_ip, *send_count);
-#else
-    snprintf(buffer, sizeof(buffer), "arping -i %s %s -c %d -W %d | grep packet", get_wireless_interface(), target_ip, *send_count, rate);
-#endif
-    fp = popen(buffer, "r");
-    if (fp == NULL)
-        return 0;
-#ifdef _OPENWRT_
-    //Format: Sent 3 probe(s) (3 broadcast(s))
-    fgets(buffer, sizeof(buffer), fp);
-    sscanf(buffer, "%*s %d", send_count);
-    //Format: Received 0 reply (0 request(s), 0 broadcast(s))
-    fgets(buffer, sizeof(buffer), fp);
-    sscanf(buffer, "%*s %d", &recv);
-#else
-    //arping output format: 1 packets transmitted, 1 packets received,   0% unanswered (0 extra)
-    fscanf(fp, "%d %*s %*s %d", send_count, &recv);
-#endif
-    indigo_logger(LOG_LEVEL_INFO, "ARP TEST - send: %d recv: %d", *send_count, recv );
-    pclose(fp);
+    recv = traffic_arp_send(get_wireless_interface(), target_ip, count, rate, send_count);
+    if (recv < 0)
+        recv = 0;
+    indigo_logger(LOG_LEVEL_INFO, "ARP TEST - send: %d recv: %d", *send_count, recv);
 
     return recv;
 }
@@ -871,16 +766,405 @@ int add_interface_to_bridge(char *br, char *ifname) {
 int reset_bridge(char *br) {
     char cmd[S_BUFFER_LEN];
 
-    /* Bring down bridge */
-    control_interface(br, "down");
-    sprintf(cmd, "brctl delbr %s", br);
-    system(cmd);
+    /* RTM_DELLINK removes the bridge whether it is up or not */
+    if (netlink_delete_link(br)) {
+        /* Bring down bridge */
+        control_interface(br, "down");
+        sprintf(cmd, "brctl delbr %s", br);
+        system(cmd);
+    }
 
     bridge_created = 0;
 
     return 0;
 }
 
+/* Find the running processes named exec_file, like pidof */
+static int find_process_pids(char *exec_file, pid_t *pids, int max) {
+    char path[64], comm[32];
+    struct dirent *entry;
+    DIR *dir;
+    FILE *fp;
+    int count = 0;
+    pid_t pid;
+
+    dir = opendir("/proc");
+    if (dir == NULL)
+        return 0;
+    while ((entry = readdir(dir)) != NULL && count < max) {
+        pid = atoi(entry->d_name);
+        if (pid <= 0 || pid == getpid())
+            continue;
+        snprintf(path, sizeof(path), "/proc/%d/comm", pid);
+        fp = fopen(path, "r");
+        if (fp == NULL)
+            continue;
+        memset(comm, 0, sizeof(comm));
+        if (fgets(comm, sizeof(comm), fp)) {
+            comm[strcspn(comm, "\n")] = 0;
+            /* comm is truncated to 15 characters */
+            if (strncmp(comm, exec_file, 15) == 0)
+                pids[count++] = pid;
+        }
+        fclose(fp);
+    }
+    closedir(dir);
+
+    return count;
+}
+
+/* Wait until pid exits. A pidfd reports the exit itself, kill(0) polling is the fallback */
+static int wait_process_exit(pid_t pid, int timeout_ms) {
+    struct pollfd pfd;
+    uint64_t deadline_ns;
+    int fd = -1;
+
+#ifdef SYS_pidfd_open
+    fd = syscall(SYS_pidfd_open, pid, 0);
+#endif
+    if (fd >= 0) {
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        fd = poll(&pfd, 1, timeout_ms);
+        close(pfd.fd);
+        return fd > 0 ? 0 : -1;
+    }
+    deadline_ns = traffic_now_ns() + (uint64_t)timeout_ms * 1000000ULL;
+    while (kill(pid, 0) == 0 || errno != ESRCH) {
+        if (traffic_now_ns() >= deadline_ns)
+            return -1;
+        usleep(PROCESS_EXIT_POLL_MS * 1000);
+    }
+    return 0;
+}
+
+/* Stop every process named exec_file and wait until they have exited.
+ * SIGKILL is sent to the ones still alive after timeout_ms.
+ * Return the number of stopped processes.
+ */
+int stop_process_and_wait(char *exec_file, int timeout_ms) {
+    pid_t pids[PROCESS_STOP_MAX_PIDS];
+    int i, count;
+
+    count = find_process_pids(exec_file, pids, PROCESS_STOP_MAX_PIDS);
+    for (i = 0; i < count; i++)
+        kill(pids[i], SIGTERM);
+    for (i = 0; i < count; i++) {
+        if (wait_process_exit(pids[i], timeout_ms)) {
+            indigo_logger(LOG_LEVEL_WARNING, "%s (%d) does not exit, kill it", exec_file, pids[i]);
+            kill(pids[i], SIGKILL);
+            wait_process_exit(pids[i], timeout_ms);
+        }
+    }
+
+    return count;
+}
+
+/* reset_step callback */
+int stop_process(char *exec_file) {
+    return stop_process_and_wait(exec_file, PROCESS_STOP_TIMEOUT_MS);
+}
+
+static void* reset_step_run(void *arg) {
+    struct reset_step *step = (struct reset_step *)arg;
+    uint64_t start_ns = traffic_now_ns();
+
+    step->result = step->fn(step->arg);
+    step->elapsed_ms = (traffic_now_ns() - start_ns) / 1000000;
+
+    return NULL;
+}
+
+/* Run independent teardown steps concurrently and wait for all of them */
+void run_reset_steps(struct reset_step *steps, int count) {
+    pthread_t threads[RESET_STEPS_MAX];
+    int started[RESET_STEPS_MAX];
+    uint64_t start_ns = traffic_now_ns();
+    int i;
+
+    if (count > RESET_STEPS_MAX)
+        count = RESET_STEPS_MAX;
+    for (i = 0; i < count; i++) {
+        started[i] = !pthread_create(&threads[i], NULL, reset_step_run, &steps[i]);
+        if (!started[i])
+            reset_step_run(&steps[i]);
+    }
+    for (i = 0; i < count; i++) {
+        if (started[i])
+            pthread_join(threads[i], NULL);
+        indigo_logger(LOG_LEVEL_DEBUG, "Reset step %s: %d in %u ms", steps[i].name, steps[i].result, steps[i].elapsed_ms);
+    }
+    indigo_logger(LOG_LEVEL_INFO, "Reset steps done in %llu ms",
+                  (unsigned long long)((traffic_now_ns() - start_ns) / 1000000));
+}
+
+/* Send one rtnetlink request and wait for its ACK. Return 0 or the negative errno */
+static int netlink_request(int sock, struct nlmsghdr *nlh) {
+    char buffer[NETLINK_BUFFER_LEN];
+    struct nlmsghdr *reply;
+    struct nlmsgerr *err;
+    int len;
+
+    nlh->nlmsg_flags |= NLM_F_REQUEST | NLM_F_ACK;
+    if (send(sock, nlh, nlh->nlmsg_len, 0) < 0)
+        return -errno;
+    while (1) {
+        len = recv(sock, buffer, sizeof(buffer), 0);
+        if (len < 0)
+            return -errno;
+        for (reply = (struct nlmsghdr *)buffer; NLMSG_OK(reply, (unsigned int)len); reply = NLMSG_NEXT(reply, len)) {
+            if (reply->nlmsg_seq != nlh->nlmsg_seq || reply->nlmsg_type != NLMSG_ERROR)
+                continue;
+            err = (struct nlmsgerr *)NLMSG_DATA(reply);
+            return err->error;
+        }
+    }
+}
+
+static int netlink_open() {
+    struct timeval timeout = { NETLINK_TIMEOUT_MS / 1000, (NETLINK_TIMEOUT_MS % 1000) * 1000 };
+    int sock;
+
+    sock = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (sock < 0)
+        return -1;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    return sock;
+}
+
+/* Delete every address of ifname, like "ip addr flush dev", and wait for each ACK */
+int netlink_flush_interface_addr(char *ifname) {
+    struct {
+        struct nlmsghdr nlh;
+        struct ifaddrmsg ifa;
+    } dump;
+    char buffer[NETLINK_BUFFER_LEN];
+    char *requests = NULL;
+    struct nlmsghdr *nlh, *del;
+    struct ifaddrmsg *ifa;
+    struct ifreq ifr;
+    int sock, len, ifindex, count = 0, done = 0, i, ret = -1;
+
+    sock = netlink_open();
+    if (sock < 0)
+        return -1;
+    memset(&ifr, 0, sizeof(ifr));
+    snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", ifname);
+    if (ioctl(sock, SIOCGIFINDEX, &ifr) < 0) {
+        close(sock);
+        return -1;
+    }
+    ifindex = ifr.ifr_ifindex;
+
+    /* Collect the addresses of the interface */
+    memset(&dump, 0, sizeof(dump));
+    dump.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(dump.ifa));
+    dump.nlh.nlmsg_type = RTM_GETADDR;
+    dump.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    dump.nlh.nlmsg_seq = 1;
+    dump.ifa.ifa_family = AF_UNSPEC;
+    requests = malloc(NETLINK_MAX_ADDRS * NETLINK_ADDR_MSG_LEN);
+    if (requests == NULL || send(sock, &dump, dump.nlh.nlmsg_len, 0) < 0)
+        goto done;
+    while (!done) {
+        len = recv(sock, buffer, sizeof(buffer), 0);
+        if (len < 0)
+            goto done;
+        for (nlh = (struct nlmsghdr *)buffer; NLMSG_OK(nlh, (unsigned int)len); nlh = NLMSG_NEXT(nlh, len)) {
+            if (nlh->nlmsg_type == NLMSG_DONE || nlh->nlmsg_type == NLMSG_ERROR) {
+                done = 1;
+                break;
+            }
+            ifa = (struct ifaddrmsg *)NLMSG_DATA(nlh);
+            if (nlh->nlmsg_type != RTM_NEWADDR || (int)ifa->ifa_index != ifindex ||
+                nlh->nlmsg_len > NETLINK_ADDR_MSG_LEN || count >= NETLINK_MAX_ADDRS)
+                continue;
+            memcpy(requests + count * NETLINK_ADDR_MSG_LEN, nlh, nlh->nlmsg_len);
+            count++;
+        }
+    }
+
+    /* Delete them. Secondary addresses may go away with their primary */
+    for (i = 0; i < count; i++) {
+        del = (struct nlmsghdr *)(requests + i * NETLINK_ADDR_MSG_LEN);
+        del->nlmsg_type = RTM_DELADDR;
+        del->nlmsg_flags = 0;
+        del->nlmsg_seq = i + 2;
+        len = netlink_request(sock, del);
+        if (len < 0 && len != -EADDRNOTAVAIL && len != -ENOENT) {
+            indigo_logger(LOG_LEVEL_WARNING, "Failed to delete an address of %s (%s)", ifname, strerror(-len));
+            goto done;
+        }
+    }
+    ret = 0;
+done:
+    free(requests);
+    close(sock);
+    return ret;
+}
+
+/* Delete the link ifname. A missing link is not an error */
+int netlink_delete_link(char *ifname) {
+    struct {
+        struct nlmsghdr nlh;
+        struct ifinfomsg ifi;
+        char attrs[64];
+    } req;
+    struct rtattr *rta;
+    int sock, ret;
+
+    if (strlen(ifname) >= IFNAMSIZ)
+        return -1;
+    sock = netlink_open();
+    if (sock < 0)
+        return -1;
+    memset(&req, 0, sizeof(req));
+    req.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(req.ifi));
+    req.nlh.nlmsg_type = RTM_DELLINK;
+    req.nlh.nlmsg_seq = 1;
+    req.ifi.ifi_family = AF_UNSPEC;
+    rta = (struct rtattr *)((char *)&req + NLMSG_ALIGN(req.nlh.nlmsg_len));
+    rta->rta_type = IFLA_IFNAME;
+    rta->rta_len = RTA_LENGTH(strlen(ifname) + 1);
+    memcpy(RTA_DATA(rta), ifname, strlen(ifname) + 1);
+    req.nlh.nlmsg_len = NLMSG_ALIGN(req.nlh.nlmsg_len) + RTA_ALIGN(rta->rta_len);
+
+    ret = netlink_request(sock, &req.nlh);
+    close(sock);
+    if (ret == -ENODEV)
+        ret = 0;
+    return ret ? -1 : 0;
+}
+
+/* Run cmd, e.g. a driver load, and wait until ifname is registered. Return 0 if it appeared */
+int run_and_wait_netdev(char *cmd, char *ifname, int timeout_ms) {
+    char path[S_BUFFER_LEN], buffer[NETLINK_BUFFER_LEN];
+    struct sockaddr_nl addr;
+    struct pollfd pfd;
+    struct timespec start, now;
+    int sock, elapsed_ms = 0, ret = -1;
+
+    /* Subscribe before the command, the link event may come before system() returns */
+    sock = netlink_open();
+    if (sock >= 0) {
+        memset(&addr, 0, sizeof(addr));
+        addr.nl_family = AF_NETLINK;
+        addr.nl_groups = RTMGRP_LINK;
+        if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            close(sock);
+            sock = -1;
+        }
+    }
+    system(cmd);
+
+    snprintf(path, sizeof(path), "/sys/class/net/%s", ifname);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (1) {
+        if (file_exists(path)) {
+            ret = 0;
+            break;
+        }
+        if (elapsed_ms >= timeout_ms)
+            break;
+        /* Any link event wakes up the check. Without the socket, poll the interface */
+        pfd.fd = sock;
+        pfd.events = POLLIN;
+        if (poll(&pfd, sock >= 0 ? 1 : 0, sock >= 0 ? timeout_ms - elapsed_ms : PROCESS_EXIT_POLL_MS * 20) > 0) {
+            while (recv(sock, buffer, sizeof(buffer), MSG_DONTWAIT) > 0)
+                ;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed_ms = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+    }
+    if (sock >= 0)
+        close(sock);
+    indigo_logger(LOG_LEVEL_DEBUG, "%s %s after %d ms", ifname, ret ? "did not appear" : "appeared", elapsed_ms);
+    return ret;
+}
+
+/* Wait until the daemon has created its control interface socket */
+int wait_ctrl_interface(char *path, int timeout_ms) {
+    int elapsed_ms;
+
+    for (elapsed_ms = 0; !file_exists(path); elapsed_ms += CTRL_WAIT_POLL_MS) {
+        if (elapsed_ms >= timeout_ms) {
+            indigo_logger(LOG_LEVEL_WARNING, "%s did not appear after %d ms", path, timeout_ms);
+            return -1;
+        }
+        usleep(CTRL_WAIT_POLL_MS * 1000);
+    }
+    indigo_logger(LOG_LEVEL_DEBUG, "%s appeared after %d ms", path, elapsed_ms);
+    return 0;
+}
+
+/* Control connection attached as a monitor, for wait_ctrl_event() */
+struct wpa_ctrl* open_ctrl_monitor(char *path) {
+    struct wpa_ctrl *ctrl;
+
+    ctrl = wpa_ctrl_open(path);
+    if (ctrl && wpa_ctrl_attach(ctrl)) {
+        wpa_ctrl_close(ctrl);
+        ctrl = NULL;
+    }
+    if (ctrl == NULL)
+        indigo_logger(LOG_LEVEL_WARNING, "Failed to monitor the events of %s", path);
+    return ctrl;
+}
+
+void close_ctrl_monitor(struct wpa_ctrl *ctrl) {
+    if (ctrl) {
+        wpa_ctrl_detach(ctrl);
+        wpa_ctrl_close(ctrl);
+    }
+}
+
+/* Wait for an event starting with one of the NULL terminated events. Returns the index of the
+ * event, copied without its level to buffer, or -1 after timeout_ms. Without a monitor the
+ * whole timeout elapses as a plain sleep would */
+int wait_ctrl_event(struct wpa_ctrl *monitor, const char *events[], char *buffer, int buffer_size, int timeout_ms) {
+    char msg[S_BUFFER_LEN * 2], *event;
+    struct pollfd pfd;
+    struct timespec start, now;
+    int i, elapsed_ms = 0;
+    size_t len;
+
+    if (monitor == NULL) {
+        usleep(timeout_ms * 1000);
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (elapsed_ms < timeout_ms) {
+        pfd.fd = wpa_ctrl_get_fd(monitor);
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, timeout_ms - elapsed_ms) > 0) {
+            while (wpa_ctrl_pending(monitor) > 0) {
+                len = sizeof(msg) - 1;
+                if (wpa_ctrl_recv(monitor, msg, &len))
+                    break;
+                msg[len] = '\0';
+                event = msg;
+                if (event[0] == '<' && strchr(event, '>'))
+                    event = strchr(event, '>') + 1;
+                for (i = 0; events[i]; i++) {
+                    if (strncmp(event, events[i], strlen(events[i])) == 0) {
+                        clock_gettime(CLOCK_MONOTONIC, &now);
+                        indigo_logger(LOG_LEVEL_DEBUG, "%s after %ld ms", event,
+                            (long)((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000));
+                        if (buffer)
+                            snprintf(buffer, buffer_size, "%s", event);
+                        return i;
+                    }
+                }
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed_ms = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+    }
+    indigo_logger(LOG_LEVEL_WARNING, "No %s event after %d ms", events[0], timeout_ms);
+    return -1;
+}
+
 int add_wireless_interface(char *ifname) {
     char cmd[S_BUFFER_LEN];
 
@@ -922,6 +1206,9 @@ int set_interface_ip(char *ifname, char *ip) {
 
 int reset_interface_ip(char *ifname) {
     char cmd[S_BUFFER_LEN];
+
+    if (netlink_flush_interface_addr(ifname) == 0)
+        return 0;
     /* If the system doesn't support ip command, please use ifconfig. E.g., */
     /* sprintf(cmd, "ifconfig %s 0.0.0.0", ifname); */
     sprintf(cmd, "ip addr flush dev %s", ifname);
@@ -953,15 +1240,15 @@ void detect_del_arp_entry(char *ip) {
     return;
 }
 
-int add_all_wireless_interface_to_bridge(char *br) {
-    int i;
+static void add_wireless_interface_to_bridge(void *if_info, void *ctx) {
+    struct interface_info *wlan = (struct interface_info *)if_info;
 
-    for (i = 0; i < interface_count; i++) {
-        if (interfaces[i].identifier != UNUSED_IDENTIFIER) {
-            control_interface(interfaces[i].ifname, "up");
-            add_interface_to_bridge(br, interfaces[i].ifname);
-        }
-    }
+    control_interface(wlan->ifname, "up");
+    add_interface_to_bridge((char *)ctx, wlan->ifname);
+}
+
+int add_all_wireless_interface_to_bridge(char *br) {
+    iterate_all_wlan_interfaces_parallel(add_wireless_interface_to_bridge, br);
 
     return 0;
 }
@@ -1325,6 +1612,60 @@ void iterate_all_wlan_interfaces(void (*callback_fn)(void *)) {
     return ;
 }
 
+struct wlan_band_worker {
+    pthread_t thread;
+    int band;
+    int started;
+    void (*callback_fn)(void *, void *);
+    void *ctx;
+};
+
+/* Run the callback on the interfaces of one band, in order */
+static void* wlan_band_worker_run(void *arg) {
+    struct wlan_band_worker *worker = (struct wlan_band_worker *)arg;
+    int i;
+
+    for (i = 0; i < interface_count; i++) {
+        if (interfaces[i].identifier != UNUSED_IDENTIFIER && interfaces[i].band == worker->band) {
+            worker->callback_fn((void *)&interfaces[i], worker->ctx);
+        }
+    }
+
+    return NULL;
+}
+
+/* Like iterate_all_wlan_interfaces(), but the bands are independent radios
+ * and run concurrently, one worker per band. The VAPs of a band run in order
+ * on its worker. Return once every worker is done.
+ */
+void iterate_all_wlan_interfaces_parallel(void (*callback_fn)(void *, void *), void *ctx) {
+    struct wlan_band_worker workers[WLAN_BAND_COUNT];
+    uint64_t start_ns = traffic_now_ns();
+    int i, band, count = 0;
+
+    memset(workers, 0, sizeof(workers));
+    for (band = 0; band < WLAN_BAND_COUNT; band++) {
+        workers[band].band = band;
+        workers[band].callback_fn = callback_fn;
+        workers[band].ctx = ctx;
+        if (!is_band_enabled(band))
+            continue;
+        if (pthread_create(&workers[band].thread, NULL, wlan_band_worker_run, &workers[band])) {
+            /* Fall back to the caller's thread */
+            wlan_band_worker_run(&workers[band]);
+            continue;
+        }
+        workers[band].started = 1;
+        count++;
+    }
+    for (i = 0; i < WLAN_BAND_COUNT; i++) {
+        if (workers[i].started)
+            pthread_join(workers[i].thread, NULL);
+    }
+    indigo_logger(LOG_LEVEL_DEBUG, "Bring-up of %d band(s) took %llu ms", count,
+                  (unsigned long long)((traffic_now_ns() - start_ns) / 1000000));
+}
+
 /* This API is useful only when for provisioning multiple VAPs */
 int is_band_enabled(int band) {
     int i;
@@ -1546,6 +1887,98 @@ int get_key_value(char *value, char *buffer, char *token) {
     return 0;
 }
 
+static int kv_entry_compare(const void *a, const void *b) {
+    const struct key_value_entry *ea = a, *eb = b;
+    int len = ea->key_len < eb->key_len ? ea->key_len : eb->key_len;
+    int ret;
+
+    ret = memcmp(ea->key, eb->key, len);
+    if (ret == 0) {
+        ret = ea->key_len - eb->key_len;
+    }
+    /* Keep duplicated keys in reply order so the first one wins */
+    if (ret == 0) {
+        ret = (ea->key < eb->key) ? -1 : (ea->key > eb->key);
+    }
+    return ret;
+}
+
+/* Tokenize the reply once and sort the keys. The entries point into buffer,
+ * so the buffer must stay untouched while the index is in use.
+ */
+int kv_index_build(struct key_value_index *index, const char *buffer) {
+    const char *line, *eol, *eq;
+
+    if (!index || !buffer) {
+        return -1;
+    }
+
+    index->count = 0;
+    for (line = buffer; *line; line = eol) {
+        eol = strchr(line, '\n');
+        if (!eol) {
+            eol = line + strlen(line);
+        }
+        eq = memchr(line, '=', eol - line);
+        if (eq && eq != line) {
+            if (index->count >= KV_INDEX_MAX_ENTRIES) {
+                indigo_logger(LOG_LEVEL_WARNING, "Key/value index is full, ignore the remaining lines");
+                break;
+            }
+            index->entries[index->count].key = line;
+            index->entries[index->count].key_len = eq - line;
+            index->entries[index->count].value = eq + 1;
+            index->entries[index->count].value_len = eol - eq - 1;
+            index->count++;
+        }
+        if (*eol == '\n') {
+            eol++;
+        }
+    }
+
+    qsort(index->entries, index->count, sizeof(struct key_value_entry), kv_entry_compare);
+    return index->count;
+}
+
+int kv_index_get(struct key_value_index *index, const char *token, char *value, int value_size) {
+    int low = 0, high, mid, len, ret, token_len;
+    const struct key_value_entry *entry;
+
+    if (!index || !token || !value || value_size <= 0) {
+        return -1;
+    }
+
+    token_len = strlen(token);
+    high = index->count - 1;
+    while (low <= high) {
+        mid = (low + high) / 2;
+        entry = &index->entries[mid];
+        len = entry->key_len < token_len ? entry->key_len : token_len;
+        ret = memcmp(entry->key, token, len);
+        if (ret == 0) {
+            ret = entry->key_len - token_len;
+        }
+        if (ret < 0) {
+            low = mid + 1;
+        } else {
+            high = mid - 1;
+        }
+    }
+    /* low is the first entry not less than token */
+    if (low >= index->count) {
+        return -1;
+    }
+    entry = &index->entries[low];
+    if (entry->key_len != token_len || memcmp(entry->key, token, token_len)) {
+        return -1;
+    }
+
+    len = entry->value_len < value_size - 1 ? entry->value_len : value_size - 1;
+    memcpy(value, entry->value, len);
+    value[len] = '\0';
+    return 0;
+}
+
 /*
  *       These were generated with: openssl x509 -outform der -in $pemname | openssl dgst -sha256
  *       "rsa_server1_w1_fi.pem": "a7407d995678712bb7adb4e7a75e89674aba363dea0b8308c63b006329b0de2d",
@@ -1574,39 +2007,51 @@ void get_server_cert_hash(char *pem_file, char *buffer) {
     }
 }
 
+/* Add "key=value\n" to every network profile. The in-memory model is updated and */
+/* serialized once, and a running wpa_supplicant gets the item by SET_NETWORK.      */
 int insert_wpa_network_config(char *config) {
-    FILE *f_ptr, *f_tmp_ptr;
     char *path = get_wpas_conf_file();
-    char *tmp_path = "/tmp/wpa_supplicant_tmp1.conf";
-    char *target_str = "}"; /* get the last line in network profile */
-    char buffer[S_BUFFER_LEN];
-
-    f_ptr = fopen(path, "r");
-    f_tmp_ptr = fopen(tmp_path, "w");
-
-    if (f_ptr == NULL || f_tmp_ptr == NULL) {
-        indigo_logger(LOG_LEVEL_ERROR, "Failed to open the files");
+    char *ctrl_path = NULL;
+    char item[S_BUFFER_LEN], *value = NULL;
+    int i, count;
+
+    memset(item, 0, sizeof(item));
+    snprintf(item, sizeof(item), "%s", config);
+    item[strcspn(item, "\r\n")] = '\0';
+    value = strchr(item, '=');
+    if (!value) {
+        indigo_logger(LOG_LEVEL_ERROR, "Invalid network config: %s", config);
         return -1;
     }
+    *value++ = '\0';
 
-    memset(buffer, 0, sizeof(buffer));
-    while ((fgets(buffer, S_BUFFER_LEN, f_ptr)) != NULL) {
-        if (strstr(buffer, target_str) != NULL) {
+    /* The control socket exists only when wpa_supplicant is running */
+    if (file_exists(get_wpas_ctrl_path())) {
+        ctrl_path = get_wpas_ctrl_path();
+    }
+
+    if (wpas_conf_is_loaded() || wpas_conf_load(path) == 0) {
+        count = wpas_conf_get_network_count();
+        for (i = 0; i < count; i++) {
             indigo_logger(LOG_LEVEL_DEBUG,
-                "insert config: %s into the wpa_supplicant conf.", config);
-            fputs(config, f_tmp_ptr);
+                "insert config: %s=%s into the network %d of wpa_supplicant conf.", item, value, i);
+            wpas_conf_set_network(i, item, value);
         }
 
-        fputs(buffer, f_tmp_ptr);
-    }
+        if (count && ctrl_path) {
+            wpas_conf_push_all_networks(ctrl_path, item);
+        }
 
-    fclose(f_ptr);
-    fclose(f_tmp_ptr);
+        if (wpas_conf_save(path) == 0) {
+            return 0;
+        }
+        /* Already pushed, only the file is left */
+        ctrl_path = NULL;
+    }
 
-    /* replace original file with new file */
-    remove(path);
-    rename(tmp_path, path);
-    return 0;
+    /* The config is beyond the model limits. Edit the file as text instead. */
+    indigo_logger(LOG_LEVEL_WARNING, "Unable to model %s. Edit the file directly", path);
+    return wpas_conf_edit_networks(path, ctrl_path, item, value);
 }
 
 void remove_pac_file(char *path) {
@@ -1801,3 +2246,249 @@ int file_exists(const char *fname)
 	struct stat s;
 	return stat(fname, &s) == 0;
 }
+
+/* Hardware detection cache. The results of the popen() probes of the startup are kept
+ * in HW_CACHE_FILE with a fingerprint of the Wi-Fi hardware, and are reused until the
+ * hardware or the app changes. The file is loaded and checked on the first lookup.
+ */
+struct hw_cache_entry {
+    char key[HW_CACHE_KEY_LEN];
+    char value[HW_CACHE_VALUE_LEN];
+};
+
+static struct hw_cache_entry hw_cache[HW_CACHE_MAX_ENTRIES];
+static int hw_cache_count = -1;
+static unsigned long long hw_cache_fingerprint;
+
+static unsigned long long fnv1a_hash(unsigned long long hash, const char *data) {
+    while (*data) {
+        hash ^= (unsigned char)*data++;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/* Hash of the first line of a sysfs attribute or of the target of a link */
+static unsigned long long hw_fingerprint_attr(unsigned long long hash, const char *dir, const char *name, const char *attr) {
+    char path[S_BUFFER_LEN], value[S_BUFFER_LEN];
+    ssize_t len;
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "%s/%s/%s", dir, name, attr);
+    memset(value, 0, sizeof(value));
+    len = readlink(path, value, sizeof(value) - 1);
+    if (len > 0) {
+        return fnv1a_hash(hash, strrchr(value, '/') ? strrchr(value, '/') + 1 : value);
+    }
+    fp = fopen(path, "r");
+    if (fp) {
+        if (fgets(value, sizeof(value), fp))
+            hash = fnv1a_hash(hash, value);
+        fclose(fp);
+    }
+    return hash;
+}
+
+/* Fingerprint of the Wi-Fi PHYs and PCI network controllers from sysfs, without forking */
+unsigned long long get_hw_fingerprint() {
+    const char *phy_dir = "/sys/class/ieee80211", *pci_dir = "/sys/bus/pci/devices";
+    unsigned long long fingerprint, hash;
+    char path[S_BUFFER_LEN], class[16];
+    struct dirent *entry;
+    DIR *dir;
+    FILE *fp;
+
+#ifdef _VERSION_
+    fingerprint = fnv1a_hash(0xcbf29ce484222325ULL, _VERSION_);
+#else
+    fingerprint = 0xcbf29ce484222325ULL;
+#endif
+    /* Sum of the entry hashes, which does not depend on the readdir() order */
+    dir = opendir(phy_dir);
+    if (dir) {
+        while ((entry = readdir(dir)) != NULL) {
+            if (entry->d_name[0] == '.')
+                continue;
+            hash = fnv1a_hash(0xcbf29ce484222325ULL, entry->d_name);
+            hash = hw_fingerprint_attr(hash, phy_dir, entry->d_name, "device/vendor");
+            hash = hw_fingerprint_attr(hash, phy_dir, entry->d_name, "device/device");
+            hash = hw_fingerprint_attr(hash, phy_dir, entry->d_name, "device/driver");
+            fingerprint += hash;
+        }
+        closedir(dir);
+    }
+    /* lspci lists the network controllers (class 0x0280) with or without a driver */
+    dir = opendir(pci_dir);
+    if (dir) {
+        while ((entry = readdir(dir)) != NULL) {
+            if (entry->d_name[0] == '.')
+                continue;
+            snprintf(path, sizeof(path), "%s/%s/class", pci_dir, entry->d_name);
+            memset(class, 0, sizeof(class));
+            fp = fopen(path, "r");
+            if (fp == NULL)
+                continue;
+            if (fgets(class, sizeof(class), fp) && strncmp(class, "0x0280", 6) == 0) {
+                hash = fnv1a_hash(0xcbf29ce484222325ULL, entry->d_name);
+                hash = hw_fingerprint_attr(hash, pci_dir, entry->d_name, "vendor");
+                hash = hw_fingerprint_attr(hash, pci_dir, entry->d_name, "device");
+                fingerprint += hash;
+            }
+            fclose(fp);
+        }
+        closedir(dir);
+    }
+    return fingerprint;
+}
+
+static void hw_cache_load() {
+    char line[S_BUFFER_LEN], *value;
+    unsigned long long fingerprint = 0;
+    int version = 0;
+    FILE *fp;
+
+    hw_cache_count = 0;
+    hw_cache_fingerprint = get_hw_fingerprint();
+    fp = fopen(HW_CACHE_FILE, "r");
+    if (fp == NULL)
+        return;
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\r\n")] = 0;
+        value = strchr(line, '=');
+        if (value == NULL)
+            continue;
+        *value++ = 0;
+        if (strcmp(line, "version") == 0) {
+            version = atoi(value);
+        } else if (strcmp(line, "fingerprint") == 0) {
+            fingerprint = strtoull(value, NULL, 16);
+        } else if (hw_cache_count < HW_CACHE_MAX_ENTRIES) {
+            strlcpy(hw_cache[hw_cache_count].key, line, sizeof(hw_cache[0].key));
+            strlcpy(hw_cache[hw_cache_count].value, value, sizeof(hw_cache[0].value));
+            hw_cache_count++;
+        }
+    }
+    fclose(fp);
+
+    if (version != HW_CACHE_VERSION || fingerprint != hw_cache_fingerprint) {
+        indigo_logger(LOG_LEVEL_INFO, "Hardware changed since %s was written, detect it again", HW_CACHE_FILE);
+        hw_cache_count = 0;
+    }
+}
+
+/* Cached result of a hardware detection. Return 0 if found */
+int hw_cache_get(const char *key, char *value, int value_size) {
+    unsigned long long fingerprint;
+    int i;
+
+    if (hw_cache_count < 0) {
+        hw_cache_load();
+    } else if ((fingerprint = get_hw_fingerprint()) != hw_cache_fingerprint) {
+        /* A radio was added or removed since the load */
+        hw_cache_fingerprint = fingerprint;
+        hw_cache_count = 0;
+    }
+    for (i = 0; i < hw_cache_count; i++) {
+        if (strcmp(hw_cache[i].key, key) == 0) {
+            snprintf(value, value_size, "%s", hw_cache[i].value);
+            indigo_logger(LOG_LEVEL_DEBUG, "Hardware detection cache: %s=%s", key, value);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* Store the result of a hardware detection. The file is replaced by a rename */
+int hw_cache_set(const char *key, const char *value) {
+    char tmp_file[S_BUFFER_LEN];
+    FILE *fp;
+    int i;
+
+    if (hw_cache_count < 0)
+        hw_cache_load();
+    for (i = 0; i < hw_cache_count; i++) {
+        if (strcmp(hw_cache[i].key, key) == 0)
+            break;
+    }
+    if (i == HW_CACHE_MAX_ENTRIES)
+        return -1;
+    if (i == hw_cache_count)
+        hw_cache_count++;
+    snprintf(hw_cache[i].key, sizeof(hw_cache[i].key), "%s", key);
+    snprintf(hw_cache[i].value, sizeof(hw_cache[i].value), "%s", value);
+
+    snprintf(tmp_file, sizeof(tmp_file), "%s.tmp", HW_CACHE_FILE);
+    fp = fopen(tmp_file, "w");
+    if (fp == NULL) {
+        indigo_logger(LOG_LEVEL_WARNING, "Failed to write %s", tmp_file);
+        return -1;
+    }
+    fprintf(fp, "version=%d\nfingerprint=%llx\n", HW_CACHE_VERSION, hw_cache_fingerprint);
+    for (i = 0; i < hw_cache_count; i++)
+        fprintf(fp, "%s=%s\n", hw_cache[i].key, hw_cache[i].value);
+    fclose(fp);
+    if (rename(tmp_file, HW_CACHE_FILE)) {
+        unlink(tmp_file);
+        return -1;
+    }
+    return 0;
+}
+
+/* Results of the last completed scan, filled by scan_results_update() */
+static struct {
+    struct scan_result entries[SCAN_RESULTS_MAX];
+    int count;
+    struct timespec updated;
+} scan_cache;
+
+/* Parse the SCAN_RESULTS of wpa_supplicant into the cache.
+ * "bssid / frequency / signal level / flags / ssid" and one tab separated line per BSS */
+int scan_results_update(struct wpa_ctrl *ctrl) {
+    static char response[L_BUFFER_LEN * 4];
+    struct scan_result *entry;
+    char *line, *fields[5], *saveptr = NULL;
+    size_t resp_len = sizeof(response) - 1;
+    int i;
+
+    memset(response, 0, sizeof(response));
+    if (wpa_ctrl_request(ctrl, "SCAN_RESULTS", strlen("SCAN_RESULTS"), response, &resp_len, NULL)) {
+        return -1;
+    }
+    response[resp_len] = '\0';
+
+    scan_cache.count = 0;
+    line = strtok_r(response, "\n", &saveptr);
+    /* Skip the header */
+    for (line = strtok_r(NULL, "\n", &saveptr); line && scan_cache.count < SCAN_RESULTS_MAX; line = strtok_r(NULL, "\n", &saveptr)) {
+        fields[0] = line;
+        for (i = 1; i < 5; i++) {
+            fields[i] = strchr(fields[i - 1], '\t');
+            if (fields[i] == NULL)
+                break;
+            *fields[i]++ = '\0';
+        }
+        if (i < 5)
+            continue;
+        entry = &scan_cache.entries[scan_cache.count++];
+        strlcpy(entry->bssid, fields[0], sizeof(entry->bssid));
+        entry->freq = atoi(fields[1]);
+        entry->signal = atoi(fields[2]);
+        strlcpy(entry->ssid, fields[4], sizeof(entry->ssid));
+    }
+    clock_gettime(CLOCK_MONOTONIC, &scan_cache.updated);
+    indigo_logger(LOG_LEVEL_DEBUG, "Cached %d scan results", scan_cache.count);
+    return scan_cache.count;
+}
+
+/* Cached scan results and their age. Returns -1 before the first completed scan */
+int scan_results_get(struct scan_result **results, int *age_ms) {
+    struct timespec now;
+
+    if (scan_cache.updated.tv_sec == 0 && scan_cache.updated.tv_nsec == 0) {
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    *age_ms = (now.tv_sec - scan_cache.updated.tv_sec) * 1000 + (now.tv_nsec - scan_cache.updated.tv_nsec) / 1000000;
+    *results = scan_cache.entries;
+    return scan_cache.count;
+}
@@ -19,6 +19,8 @@
 
 #include <stdbool.h>
 
+#include "traffic.h"
+
 #define S_BUFFER_LEN              512
 #define BUFFER_LEN                1536
 #define L_BUFFER_LEN              8192
@@ -57,6 +59,45 @@ enum {
     BAND_5GHZ = 1,
     BAND_6GHZ = 2
 };
+#define WLAN_BAND_COUNT     (BAND_6GHZ + 1)
+
+#define NETLINK_BUFFER_LEN          8192
+#define NETLINK_TIMEOUT_MS          1000
+#define NETLINK_MAX_ADDRS           32
+#define NETLINK_ADDR_MSG_LEN        256
+#define PROCESS_STOP_MAX_PIDS       8
+#define PROCESS_STOP_TIMEOUT_MS     3000
+#define PROCESS_EXIT_POLL_MS        5
+#define RESET_STEPS_MAX             8
+#define ELOOP_STALL_MS              50
+#define ELOOP_STATS_HANDLERS        32
+#define HW_CACHE_VERSION            1
+#define HW_CACHE_MAX_ENTRIES        16
+#define HW_CACHE_KEY_LEN            32
+#define HW_CACHE_VALUE_LEN          128
+#define CTRL_WAIT_POLL_MS           20
+#define WPAS_START_TIMEOUT_MS       2000
+#define SCAN_WAIT_TIMEOUT_MS        10000
+#define ANQP_WAIT_TIMEOUT_MS        10000
+#define SCAN_RESULTS_MAX            64
+
+/* Loop statistics summed over all callbacks, for the GET_LOOP_STATS API */
+struct eloop_stats_summary {
+    unsigned int callbacks;
+    unsigned int stalls;
+    unsigned int max_us;
+    const char *max_name;
+    unsigned int late_max_us;
+};
+
+/* One teardown step of a reset. Steps of a run_reset_steps() call must not depend on each other */
+struct reset_step {
+    const char *name;
+    int (*fn)(char *arg);
+    char *arg;
+    int result;
+    unsigned int elapsed_ms;
+};
 
 enum {
     PHYMODE_AUTO = 0,
@@ -123,17 +164,31 @@ struct bss_identifier_info {
     int transmitter;
 };
 
-struct loopback_info {
-    int sock;
-    double rate;
-    int pkt_sent;
-    int pkt_rcv;
-    int pkt_type;
-    int pkt_size;
-    char target_ip[64];
-    char message[1600];
+/* Index over a "key=value\n" reply from hostapd or wpa_supplicant */
+#define KV_INDEX_MAX_ENTRIES      128
+
+struct key_value_entry {
+    const char *key;
+    int key_len;
+    const char *value;
+    int value_len;
 };
 
+struct key_value_index {
+    int count;
+    struct key_value_entry entries[KV_INDEX_MAX_ENTRIES];
+};
+
+/* One BSS of the wpa_supplicant SCAN_RESULTS */
+struct scan_result {
+    char bssid[18];
+    int freq;
+    int signal;
+    char ssid[S_BUFFER_LEN];
+};
+
+struct wpa_ctrl;
+
 /* log and file API */
 void indigo_logger(int level, const char *fmt, ...);
 int pipe_command(char *buffer, int buffer_size, char *cmd, char *parameter[]);
@@ -142,6 +197,9 @@ int write_file(char *fn, char *buffer, int len);
 int append_file(char *fn, char *buffer, int len);
 void open_tc_app_log();
 void close_tc_app_log();
+void log_eloop_stats();
+void log_eloop_stall(const char *name, const char *tag, unsigned int elapsed_ms);
+void get_eloop_stats_summary(struct eloop_stats_summary *summary, int reset);
 
 /* network interface and loopback API */
 int get_mac_address(char *buffer, int size, char *interface);
@@ -150,10 +208,17 @@ int find_interface_ip(char *ipaddr, int ipaddr_len, char *name);
 int loopback_server_start(char *local_ip, char *local_port, int timeout);
 int loopback_server_stop();
 int loopback_server_status();
-int send_udp_data(char *target_ip, int target_port, int packet_count, int packet_size, double rate);
-int stop_loopback_data(int *pkt_sent);
+void loopback_server_get_stats(struct traffic_echo_stats *stats);
+void loopback_set_timestamping(int enable);
+int loopback_get_timestamping();
+int send_udp_data(char *target_ip, int target_port, char *ifname, int packet_count, int packet_size, double rate, struct traffic_stats *stats);
+int stop_loopback_data(struct traffic_stats *stats);
+int stop_loopback_flow(int flow_id, struct traffic_stats *stats);
 int send_broadcast_arp(char *target_ip, int *send_count, int rate);
-int send_icmp_data(char *target_ip, int packet_count, int packet_size, double rate);
+int send_icmp_data(char *target_ip, char *ifname, int packet_count, int packet_size, double rate, struct traffic_stats *stats);
+uint64_t icmp_checksum_partial(const void *buf, int size, uint64_t sum);
+unsigned short icmp_checksum_fold(uint64_t sum);
+unsigned short icmp_checksum(unsigned short *buf, int size);
 char* get_wlans_bridge();
 int set_wlans_bridge(char* br);
 int is_bridge_created();
@@ -163,6 +228,12 @@ int reset_bridge(char *br);
 int control_interface(char *ifname, char *op);
 int set_interface_ip(char *ifname, char *ip);
 int reset_interface_ip(char *ifname);
+int netlink_flush_interface_addr(char *ifname);
+int netlink_delete_link(char *ifname);
+int run_and_wait_netdev(char *cmd, char *ifname, int timeout_ms);
+int stop_process_and_wait(char *exec_file, int timeout_ms);
+int stop_process(char *exec_file);
+void run_reset_steps(struct reset_step *steps, int count);
 int add_wireless_interface(char *ifname);
 int delete_wireless_interface(char *ifname);
 void bridge_init(char *br);
@@ -202,6 +273,12 @@ char* get_wpas_conf_file();
 int set_wpas_conf_file(char* path);
 void set_wpas_debug_level(int level);
 char* get_wpas_debug_arguments();
+int wait_ctrl_interface(char *path, int timeout_ms);
+struct wpa_ctrl* open_ctrl_monitor(char *path);
+void close_ctrl_monitor(struct wpa_ctrl *ctrl);
+int wait_ctrl_event(struct wpa_ctrl *monitor, const char *events[], char *buffer, int buffer_size, int timeout_ms);
+int scan_results_update(struct wpa_ctrl *ctrl);
+int scan_results_get(struct scan_result **results, int *age_ms);
 
 /* service and environment API */
 char* get_wireless_interface();
@@ -220,14 +297,23 @@ int add_all_wireless_interface_to_bridge(char *br);
 void set_default_wireless_interface_info(int channel);
 int show_wireless_interface_info();
 void iterate_all_wlan_interfaces(void (*callback_fn)(void *));
+void iterate_all_wlan_interfaces_parallel(void (*callback_fn)(void *, void *), void *ctx);
 void get_server_cert_hash(char *pem_file, char *buffer);
 int insert_wpa_network_config(char *config);
 void remove_pac_file(char *path);
 int is_band_enabled(int band);
 
+#ifdef CONFIG_USDT
+/* Every system() of the app passes the command_spawn and command_exit tracepoints */
+int traced_system(const char *command);
+#define system(command) traced_system(command)
+#endif /* CONFIG_USDT */
+
 /* misc */
 size_t strlcpy(char *dest, const char *src, size_t siz);
 int get_key_value(char *value, char *buffer, char *token);
+int kv_index_build(struct key_value_index *index, const char *buffer);
+int kv_index_get(struct key_value_index *index, const char *token, char *value, int value_size);
 int verify_band_from_freq(int freq, int band);
 int get_center_freq_index(int channel, int width);
 int get_6g_center_freq_index(int channel, int width);
@@ -235,4 +321,9 @@ int is_ht40plus_chan(int chan);
 int is_ht40minus_chan(int chan);
 int http_file_post(char *host, int port, char *path, char *file_name);
 int file_exists(const char *fname);
+
+/* hardware detection cache */
+unsigned long long get_hw_fingerprint();
+int hw_cache_get(const char *key, char *value, int value_size);
+int hw_cache_set(const char *key, const char *value);
 #endif
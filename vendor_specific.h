@@ -71,6 +71,9 @@
 #define WIRELESS_INTERFACE_DEFAULT                  "wlan0"
 #define SERVICE_PORT_DEFAULT                        9004
 
+/* Results of the hardware detection, kept across the restarts of the app */
+#define HW_CACHE_FILE                               "/var/run/controlappc_hw.cache"
+
 /* Default bridge for wireless interfaces */
 #define BRIDGE_WLANS                                "br-wlans"
 
@@ -22,6 +22,7 @@
 
 #include "vendor_specific.h"
 #include "utils.h"
+#include "p2p_tracker.h"
 
 #ifdef HOSTAPD_SUPPORT_MBSSID_WAR
 extern int use_openwrt_wpad;
@@ -33,6 +34,10 @@ int detect_third_radio() {
     char buffer[BUFFER_LEN];
     int third_radio = 0;
 
+    /* Called at the start and by each device reset */
+    if (hw_cache_get("third_radio", buffer, sizeof(buffer)) == 0)
+        return atoi(buffer);
+
     fp = popen("iw dev", "r");
     if (fp) {
         while (fgets(buffer, sizeof(buffer), fp) != NULL) {
@@ -40,6 +45,7 @@ int detect_third_radio() {
                 third_radio = 1;
         }
         pclose(fp);
+        hw_cache_set("third_radio", third_radio ? "1" : "0");
     }
 
     return third_radio;
@@ -278,6 +284,16 @@ int get_p2p_mac_addr(char *mac_addr, size_t size) {
     FILE *fp;
     char buffer[S_BUFFER_LEN], *ptr, addr[32];
     int error = 1, match = 0;
+    struct p2p_group group;
+
+    /* The tracked state answers without running "iw dev" */
+    error = p2p_tracker_get_group(&group);
+    if (error == 0 && get_mac_address(mac_addr, size, group.ifname) == 0) {
+        return 0;
+    } else if (error == 1 && p2p_tracker_get_device_addr(mac_addr, size) == 0) {
+        return 0;
+    }
+    error = 1;
 
     fp = popen("iw dev", "r");
     if (fp) {
@@ -315,6 +331,14 @@ int get_p2p_group_if(char *if_name, size_t size) {
     FILE *fp;
     char buffer[S_BUFFER_LEN], *ptr, name[32];
     int error = 1;
+    struct p2p_group group;
+
+    /* The tracked group answers without running "iw dev". Without one, check
+     * "iw dev" as well in case the group was not seen by the tracker. */
+    if (p2p_tracker_get_group(&group) == 0) {
+        snprintf(if_name, size, "%s", group.ifname);
+        return 0;
+    }
 
     fp = popen("iw dev", "r");
     if (fp) {
@@ -41,6 +41,29 @@ static void check_platform1_default_conf();
  * Generic platform dependent API implementation
  */
 
+enum {
+    STA_PLATFORM_DEFAULT = 0,
+    STA_PLATFORM_1 = 1,
+    STA_PLATFORM_2 = 2
+};
+
+static void hook_sta_platform(int platform) {
+    if (platform == STA_PLATFORM_1) {
+        sta_drv_ops = &sta_driver_platform1_ops;
+        indigo_logger(LOG_LEVEL_INFO, "hook platform handlers for platform 1");
+
+        check_platform1_default_conf();
+    } else if (platform == STA_PLATFORM_2) {
+        sta_drv_ops = &sta_driver_platform2_ops;
+        indigo_logger(LOG_LEVEL_INFO, "hook platform handlers for platform 2");
+    } else {
+        /* set to platform 1 by default */
+        sta_drv_ops = &sta_driver_platform1_ops;
+        indigo_logger(LOG_LEVEL_INFO,
+            "Unable to find any supported drivers, hook the default platform handlers");
+    }
+}
+
 /* support multiple STA platforms detection */
 void detect_sta_vendor() {
     char cmd[S_BUFFER_LEN];
@@ -48,8 +71,15 @@ void detect_sta_vendor() {
     char *strbuf = NULL, *temp = NULL;
     int len = 0;
     int size = 1;
+    int platform = STA_PLATFORM_DEFAULT;
     FILE *fp;
 
+    /* lspci takes hundreds of milliseconds, reuse the result of the previous start */
+    if (hw_cache_get("sta_platform", buf, sizeof(buf)) == 0) {
+        hook_sta_platform(atoi(buf));
+        return;
+    }
+
     snprintf(cmd, sizeof(cmd), "lspci |grep \"Network controller\"");
 
     fp = popen(cmd, "r");
@@ -72,19 +102,13 @@ void detect_sta_vendor() {
     indigo_logger(LOG_LEVEL_INFO, "Device: %s", strbuf);
 
     if (strbuf && strstr(strbuf, desc_platform1)) {
-        sta_drv_ops = &sta_driver_platform1_ops;
-        indigo_logger(LOG_LEVEL_INFO, "hook platform handlers for platform 1");
-
-        check_platform1_default_conf();
+        platform = STA_PLATFORM_1;
     } else if (strbuf && strstr(strbuf, desc_platform2)) {
-        sta_drv_ops = &sta_driver_platform2_ops;
-        indigo_logger(LOG_LEVEL_INFO, "hook platform handlers for platform 2");
-    } else {
-        /* set to platform 1 by default */
-        sta_drv_ops = &sta_driver_platform1_ops;
-        indigo_logger(LOG_LEVEL_INFO,
-            "Unable to find any supported drivers, hook the default platform handlers");
+        platform = STA_PLATFORM_2;
     }
+    hook_sta_platform(platform);
+    snprintf(buf, sizeof(buf), "%d", platform);
+    hw_cache_set("sta_platform", buf);
 
     pclose(fp);
     free(strbuf);
@@ -96,6 +120,10 @@ int detect_third_radio() {
     char buffer[BUFFER_LEN];
     int third_radio = 0;
 
+    /* Called at the start and by each device reset */
+    if (hw_cache_get("third_radio", buffer, sizeof(buffer)) == 0)
+        return atoi(buffer);
+
     fp = popen("iw dev", "r");
     if (fp) {
         while (fgets(buffer, sizeof(buffer), fp) != NULL) {
@@ -103,6 +131,7 @@ int detect_third_radio() {
                 third_radio = 1;
         }
         pclose(fp);
+        hw_cache_set("third_radio", third_radio ? "1" : "0");
     }
 
     return third_radio;
@@ -222,10 +251,8 @@ void delete_sta_interface() {
 /* Be invoked when start controlApp */
 void vendor_init() {
     /* Make sure native hostapd/wpa_supplicant is inactive */
-    system("killall hostapd 1>/dev/null 2>/dev/null");
-    sleep(1);
-    system("killall wpa_supplicant 1>/dev/null 2>/dev/null");
-    sleep(1);
+    stop_process("hostapd");
+    stop_process("wpa_supplicant");
 
 #if defined(_OPENWRT_) && !defined(_WTS_OPENWRT_)
     char buffer[BUFFER_LEN];
@@ -314,6 +341,9 @@ void set_phy_mode() {
  * Platform-dependent implementation for STA platform 1
  */
 
+#define IWLWIFI_DBG_CFG_FILE    "/lib/firmware/iwl-dbg-cfg.ini"
+#define IWLWIFI_LOAD_TIMEOUT_MS 10000
+
 struct he_chwidth_config {
     int chwidth;
     char config[32];
@@ -329,7 +359,7 @@ struct he_chwidth_config he_chwidth_config_list[] = {
 };
 
 static void check_platform1_default_conf() {
-    char *fname = "/lib/firmware/iwl-dbg-cfg.ini";
+    char *fname = IWLWIFI_DBG_CFG_FILE;
     char buffer[S_BUFFER_LEN];
     FILE *f_ptr = NULL;
 
@@ -349,19 +379,61 @@ static void check_platform1_default_conf() {
     }
 }
 
+/* Configuration of the loaded iwlwifi driver: the module parameters and the ini file */
+static struct {
+    int loaded;
+    char params[S_BUFFER_LEN];
+    unsigned long long ini_hash;
+} iwlwifi_state;
+
+static unsigned long long iwlwifi_ini_hash() {
+    unsigned long long hash = 0xcbf29ce484222325ULL;
+    FILE *f_ptr;
+    int c;
+
+    f_ptr = fopen(IWLWIFI_DBG_CFG_FILE, "r");
+    if (f_ptr == NULL)
+        return 0;
+    while ((c = fgetc(f_ptr)) != EOF) {
+        hash ^= (unsigned char)c;
+        hash *= 0x100000001b3ULL;
+    }
+    fclose(f_ptr);
+    return hash;
+}
+
+/* Reload iwlwifi, unless it is loaded with the same parameters and ini file */
+static void reload_iwlwifi(char *params) {
+    char cmd[S_BUFFER_LEN];
+    unsigned long long ini_hash = iwlwifi_ini_hash();
+
+    if (iwlwifi_state.loaded && iwlwifi_state.ini_hash == ini_hash && strcmp(iwlwifi_state.params, params) == 0) {
+        indigo_logger(LOG_LEVEL_INFO, "iwlwifi is loaded with the same configuration, skip the reload");
+        return;
+    }
+
+    snprintf(cmd, sizeof(cmd), "sudo modprobe -r iwlwifi;sudo modprobe iwlwifi %s", params);
+    if (run_and_wait_netdev(cmd, get_wireless_interface(), IWLWIFI_LOAD_TIMEOUT_MS)) {
+        indigo_logger(LOG_LEVEL_WARNING, "%s is not back after the iwlwifi reload", get_wireless_interface());
+        iwlwifi_state.loaded = 0;
+        return;
+    }
+    iwlwifi_state.loaded = 1;
+    iwlwifi_state.ini_hash = ini_hash;
+    strlcpy(iwlwifi_state.params, params, sizeof(iwlwifi_state.params));
+}
+
 static void disable_11ax() {
-    system("sudo modprobe -r iwlwifi;sudo modprobe iwlwifi disable_11ax=1");
-    sleep(3);
+    reload_iwlwifi("disable_11ax=1");
 }
 
 static void reload_driver() {
-    system("sudo modprobe -r iwlwifi;sudo modprobe iwlwifi");
-    sleep(3);
+    reload_iwlwifi("");
 }
 
 static int set_he_channel_width(int chwidth) {
     FILE *f_ptr = NULL, *f_tmp_ptr = NULL;
-    char *path = "/lib/firmware/iwl-dbg-cfg.ini";
+    char *path = IWLWIFI_DBG_CFG_FILE;
     char *tmp_path = "/lib/firmware/iwl-dbg-cfg-tmp.ini";
     char *he_ie_str = "he_phy_cap=";
     int is_found = 0;
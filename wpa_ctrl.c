@@ -28,6 +28,7 @@
 #include "vendor_specific.h"
 #include "wpa_ctrl.h"
 #include "utils.h"
+#include "tracepoint.h"
 #ifdef CONFIG_NATIVE_WINDOWS
 #include "common.h"
 #endif /* CONFIG_NATIVE_WINDOWS */
@@ -120,7 +121,8 @@ struct wpa_ctrl * wpa_ctrl_open(const char *ctrl_path)
 
 	ctrl->local.sun_family = AF_UNIX;
 	snprintf(ctrl->local.sun_path, sizeof(ctrl->local.sun_path),
-		 "/tmp/wpa_ctrl_%d-%d", getpid(), counter++);
+		 "/tmp/wpa_ctrl_%d-%d", getpid(),
+		 __atomic_fetch_add(&counter, 1, __ATOMIC_RELAXED));
 	if (bind(ctrl->s, (struct sockaddr *) &ctrl->local,
 		    sizeof(ctrl->local)) < 0) {
 		close(ctrl->s);
@@ -190,6 +192,7 @@ int wpa_ctrl_request(struct wpa_ctrl *ctrl, const char *cmd, size_t cmd_len,
 		_cmd_len = cmd_len;
 	}
 
+	QT_TRACE2(ctrl_request, cmd, cmd_len);
 	if (send(ctrl->s, _cmd, _cmd_len, 0) < 0) {
 		return -1;
 	}
@@ -224,8 +227,10 @@ int wpa_ctrl_request(struct wpa_ctrl *ctrl, const char *cmd, size_t cmd_len,
 				continue;
 			}
 			*reply_len = res;
+			QT_TRACE2(ctrl_reply, reply, res);
 			break;
 		} else {
+			QT_TRACE2(ctrl_reply, reply, -2);
 			return -2;
 		}
 	}
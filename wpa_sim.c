@@ -0,0 +1,552 @@
+/* Copyright (c) 2020 Wi-Fi Alliance                                                */
+
+/* Permission to use, copy, modify, and/or distribute this software for any         */
+/* purpose with or without fee is hereby granted, provided that the above           */
+/* copyright notice and this permission notice appear in all copies.                */
+
+/* THE SOFTWARE IS PROVIDED 'AS IS' AND THE AUTHOR DISCLAIMS ALL                    */
+/* WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED                    */
+/* WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL                     */
+/* THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR                       */
+/* CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING                        */
+/* FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF                       */
+/* CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT                       */
+/* OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS                          */
+/* SOFTWARE. */
+
+
+/* Stand-in for hostapd and wpa_supplicant, for performance tests without Wi-Fi hardware.
+ *
+ * The binary takes the command line of the daemon it replaces and binds the same
+ * control sockets, <ctrl_interface>/<interface> and the -g global socket. It acts as
+ * hostapd when its name contains "hostapd", so it is used through links named
+ * after the real daemons and the -a and -s options of the app, e.g.
+ *   ln -s $PWD/wpa_sim /tmp/sim/hostapd; ln -s $PWD/wpa_sim /tmp/sim/wpa_supplicant
+ *   ./app -a /tmp/sim/hostapd -s /tmp/sim/wpa_supplicant
+ *
+ * Commands are answered with "OK" or a built-in reply after a delay. The file in the
+ * WPA_SIM_CONF environment variable can add rules, one per line:
+ *   delay <ms>                          default delay of the replies
+ *   reply <command>[*] <ms> [<text>]    reply to a command, or to a prefix with *
+ *   event <command>[*] <ms> <text>      send an event to the attached monitors
+ *   [hostapd] or [wpa_supplicant]       the following rules apply to one daemon only
+ * "\n" in a text is a new line. Rules of the file take precedence over the built-in ones.
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "vendor_specific.h"
+
+#define SIM_MAX_SOCKS           32
+#define SIM_MAX_MONITORS        8
+#define SIM_MAX_RULES           128
+#define SIM_MAX_PENDING         256
+#define SIM_CMD_LEN             64
+#define SIM_TEXT_LEN            2048
+#define SIM_LINE_LEN            4096
+#define SIM_SCAN_TIME_MS        100
+
+struct sim_sock {
+    int fd;
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    int monitor_count;
+    struct sockaddr_un monitors[SIM_MAX_MONITORS];
+    socklen_t monitor_len[SIM_MAX_MONITORS];
+};
+
+struct sim_rule {
+    int event;
+    /* Matches the commands starting with cmd */
+    int prefix;
+    int delay_ms;
+    char cmd[SIM_CMD_LEN];
+    char text[SIM_TEXT_LEN];
+};
+
+/* Reply or event waiting for its delay */
+struct sim_pending {
+    unsigned long long due_us;
+    int sock;
+    int event;
+    struct sockaddr_un to;
+    socklen_t to_len;
+    int len;
+    char text[SIM_TEXT_LEN];
+};
+
+static struct sim_sock socks[SIM_MAX_SOCKS];
+static int sock_count;
+static struct sim_rule rules[SIM_MAX_RULES];
+static int rule_count;
+static struct sim_pending pending[SIM_MAX_PENDING];
+static int pending_count;
+static int default_delay_ms;
+static int hostapd;
+static FILE *log_fp;
+static volatile sig_atomic_t terminate;
+
+/* Built-in replies and events, "OK" is the reply of everything else */
+static const struct sim_rule hostapd_rules[] = {
+    { 0, 0, 0, "PING", "PONG\n" },
+    { 0, 0, 0, "STATUS", "state=ENABLED\nphy=phy0\nfreq=2412\nchannel=1\nbss[0]=wlan0\nbssid[0]=02:00:00:00:00:00\nssid[0]=QT-SIM\nnum_sta[0]=0\n" },
+    { 0, 0, 0, "WPS_AP_PIN", "12345670\n" },
+    { 0, 0, 0, "WPS_PIN", "12345670\n" },
+    { 0, 0, 0, "GET_CONFIG", "bssid=02:00:00:00:00:00\nssid=QT-SIM\nwps_state=configured\nkey_mgmt=WPA-PSK\n" },
+};
+
+static const struct sim_rule wpas_rules[] = {
+    { 0, 0, 0, "PING", "PONG\n" },
+    { 0, 0, 0, "STATUS", "bssid=02:00:00:00:00:00\nfreq=2412\nssid=QT-SIM\nid=0\nmode=station\nkey_mgmt=WPA2-PSK\nwpa_state=COMPLETED\naddress=02:00:00:00:01:00\n" },
+    { 0, 0, 0, "ADD_NETWORK", "0\n" },
+    { 0, 0, 0, "ADD_CRED", "0\n" },
+    { 0, 0, 0, "WPS_PIN", "12345670\n" },
+    { 0, 0, 0, "LIST_NETWORKS", "network id / ssid / bssid / flags\n0\tQT-SIM\tany\t[CURRENT]\n" },
+    { 1, 0, 0, "SCAN", "<3>CTRL-EVENT-SCAN-STARTED " },
+    { 1, 0, SIM_SCAN_TIME_MS, "SCAN", "<3>CTRL-EVENT-SCAN-RESULTS " },
+    { 1, 0, SIM_SCAN_TIME_MS, "P2P_FIND", "<3>P2P-DEVICE-FOUND 02:00:00:00:02:00 p2p_dev_addr=02:00:00:00:02:00 pri_dev_type=1-0050F204-1 name='QT-SIM' config_methods=0x188 dev_capab=0x25 group_capab=0x0" },
+};
+
+static unsigned long long sim_now_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void sim_log(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+static void sim_log(const char *fmt, ...) {
+    struct timespec ts;
+    va_list ap;
+
+    if (log_fp == NULL)
+        return;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    fprintf(log_fp, "%ld.%06ld: ", (long)ts.tv_sec, ts.tv_nsec / 1000);
+    va_start(ap, fmt);
+    vfprintf(log_fp, fmt, ap);
+    va_end(ap);
+    fprintf(log_fp, "\n");
+    fflush(log_fp);
+}
+
+static void unescape(char *text) {
+    char *in = text, *out = text;
+
+    while (*in) {
+        if (in[0] == '\\' && in[1] == 'n') {
+            *out++ = '\n';
+            in += 2;
+        } else if (in[0] == '\\' && in[1] == 't') {
+            *out++ = '\t';
+            in += 2;
+        } else {
+            *out++ = *in++;
+        }
+    }
+    *out = 0;
+}
+
+static int load_rules(const char *fn) {
+    char line[SIM_LINE_LEN], kind[16], cmd[SIM_CMD_LEN], section[32];
+    struct sim_rule *rule;
+    int delay_ms, offset, line_no = 0, skip = 0;
+    FILE *fp;
+
+    fp = fopen(fn, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to open %s: %s\n", fn, strerror(errno));
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        line_no++;
+        line[strcspn(line, "\r\n")] = 0;
+        if (line[0] == 0 || line[0] == '#')
+            continue;
+        if (sscanf(line, "[%31[^]]]", section) == 1) {
+            skip = hostapd ? strcmp(section, "hostapd") != 0 : strcmp(section, "wpa_supplicant") != 0;
+            continue;
+        }
+        if (skip)
+            continue;
+        if (sscanf(line, "delay %d", &delay_ms) == 1) {
+            default_delay_ms = delay_ms;
+            continue;
+        }
+        if (sscanf(line, "%15s %63s %d %n", kind, cmd, &delay_ms, &offset) < 3 ||
+            (strcmp(kind, "reply") && strcmp(kind, "event"))) {
+            fprintf(stderr, "%s:%d: Expected \"reply|event <command> <ms> <text>\"\n", fn, line_no);
+            fclose(fp);
+            return -1;
+        }
+        if (rule_count == SIM_MAX_RULES)
+            break;
+        rule = &rules[rule_count++];
+        memset(rule, 0, sizeof(*rule));
+        rule->event = kind[0] == 'e';
+        rule->delay_ms = delay_ms;
+        rule->prefix = cmd[strlen(cmd) - 1] == '*';
+        if (rule->prefix)
+            cmd[strlen(cmd) - 1] = 0;
+        snprintf(rule->cmd, sizeof(rule->cmd), "%s", cmd);
+        /* %n is not set when the text is missing */
+        snprintf(rule->text, sizeof(rule->text), "%s", (size_t)offset <= strlen(line) ? line + offset : "");
+        unescape(rule->text);
+    }
+    fclose(fp);
+    return 0;
+}
+
+static void add_builtin_rules(void) {
+    const struct sim_rule *builtin = hostapd ? hostapd_rules : wpas_rules;
+    int i, count = hostapd ? sizeof(hostapd_rules) / sizeof(hostapd_rules[0]) :
+        sizeof(wpas_rules) / sizeof(wpas_rules[0]);
+
+    for (i = 0; i < count && rule_count < SIM_MAX_RULES; i++) {
+        rules[rule_count] = builtin[i];
+        if (!rules[rule_count].event)
+            rules[rule_count].delay_ms = default_delay_ms;
+        rule_count++;
+    }
+}
+
+static int rule_match(struct sim_rule *rule, const char *cmd) {
+    size_t len = strlen(rule->cmd);
+
+    if (strncmp(cmd, rule->cmd, len))
+        return 0;
+    return rule->prefix || cmd[len] == 0 || cmd[len] == ' ';
+}
+
+static void schedule(int sock, int event, struct sockaddr_un *to, socklen_t to_len, const char *text, int delay_ms) {
+    struct sim_pending *p;
+
+    if (pending_count == SIM_MAX_PENDING) {
+        sim_log("Too many pending messages, drop \"%s\"", text);
+        return;
+    }
+    p = &pending[pending_count++];
+    p->due_us = sim_now_us() + delay_ms * 1000ULL;
+    p->sock = sock;
+    p->event = event;
+    if (to)
+        memcpy(&p->to, to, to_len);
+    p->to_len = to_len;
+    p->len = snprintf(p->text, sizeof(p->text), "%s", text);
+    if (p->len >= (int)sizeof(p->text))
+        p->len = sizeof(p->text) - 1;
+}
+
+static void send_event(struct sim_sock *s, const char *text, int len) {
+    int i;
+
+    for (i = 0; i < s->monitor_count; i++) {
+        if (sendto(s->fd, text, len, 0, (struct sockaddr *)&s->monitors[i], s->monitor_len[i]) < 0 &&
+            (errno == ECONNREFUSED || errno == ENOENT)) {
+            /* The monitor is gone without DETACH */
+            s->monitors[i] = s->monitors[s->monitor_count - 1];
+            s->monitor_len[i] = s->monitor_len[s->monitor_count - 1];
+            s->monitor_count--;
+            i--;
+        }
+    }
+}
+
+static void run_pending(void) {
+    unsigned long long now = sim_now_us();
+    struct sim_pending *p;
+    int i;
+
+    for (i = 0; i < pending_count; i++) {
+        p = &pending[i];
+        if (p->due_us > now)
+            continue;
+        if (p->event) {
+            sim_log("%s event: %s", socks[p->sock].path, p->text);
+            send_event(&socks[p->sock], p->text, p->len);
+        } else {
+            sendto(socks[p->sock].fd, p->text, p->len, 0, (struct sockaddr *)&p->to, p->to_len);
+        }
+        pending[i--] = pending[--pending_count];
+    }
+}
+
+static int next_timeout_ms(void) {
+    unsigned long long now = sim_now_us(), next = 0;
+    int i;
+
+    for (i = 0; i < pending_count; i++) {
+        if (next == 0 || pending[i].due_us < next)
+            next = pending[i].due_us;
+    }
+    if (next == 0)
+        return -1;
+    return next <= now ? 0 : (int)((next - now + 999) / 1000);
+}
+
+static void monitor_update(struct sim_sock *s, struct sockaddr_un *from, socklen_t from_len, int attach) {
+    int i;
+
+    for (i = 0; i < s->monitor_count; i++) {
+        if (s->monitor_len[i] == from_len && memcmp(&s->monitors[i], from, from_len) == 0)
+            break;
+    }
+    if (attach && i == s->monitor_count && s->monitor_count < SIM_MAX_MONITORS) {
+        memcpy(&s->monitors[i], from, from_len);
+        s->monitor_len[i] = from_len;
+        s->monitor_count++;
+    } else if (!attach && i < s->monitor_count) {
+        s->monitors[i] = s->monitors[s->monitor_count - 1];
+        s->monitor_len[i] = s->monitor_len[s->monitor_count - 1];
+        s->monitor_count--;
+    }
+}
+
+static void handle_command(int index) {
+    struct sim_sock *s = &socks[index];
+    struct sockaddr_un from;
+    socklen_t from_len = sizeof(from);
+    char cmd[SIM_TEXT_LEN];
+    const char *reply = NULL;
+    int i, len, delay_ms = default_delay_ms;
+
+    len = recvfrom(s->fd, cmd, sizeof(cmd) - 1, 0, (struct sockaddr *)&from, &from_len);
+    if (len <= 0)
+        return;
+    cmd[len] = 0;
+    cmd[strcspn(cmd, "\r\n")] = 0;
+    sim_log("%s: %s", s->path, cmd);
+
+    if (strcmp(cmd, "ATTACH") == 0 || strcmp(cmd, "DETACH") == 0) {
+        monitor_update(s, &from, from_len, cmd[0] == 'A');
+        sendto(s->fd, "OK\n", 3, 0, (struct sockaddr *)&from, from_len);
+        return;
+    }
+    if (strcmp(cmd, "TERMINATE") == 0)
+        terminate = 1;
+
+    for (i = 0; i < rule_count; i++) {
+        if (!rule_match(&rules[i], cmd))
+            continue;
+        if (rules[i].event) {
+            schedule(index, 1, NULL, 0, rules[i].text, rules[i].delay_ms);
+        } else if (reply == NULL) {
+            reply = rules[i].text[0] ? rules[i].text : "OK\n";
+            delay_ms = rules[i].delay_ms;
+        }
+    }
+    if (reply == NULL)
+        reply = "OK\n";
+    if (delay_ms == 0)
+        sendto(s->fd, reply, strlen(reply), 0, (struct sockaddr *)&from, from_len);
+    else
+        schedule(index, 0, &from, from_len, reply, delay_ms);
+}
+
+static int open_ctrl_sock(const char *dir, const char *name) {
+    struct sockaddr_un addr;
+    struct sim_sock *s;
+    char path[sizeof(addr.sun_path)];
+    int i;
+
+    if (sock_count == SIM_MAX_SOCKS)
+        return -1;
+    if (dir)
+        snprintf(path, sizeof(path), "%s/%s", dir, name);
+    else
+        snprintf(path, sizeof(path), "%s", name);
+    for (i = 0; i < sock_count; i++) {
+        if (strcmp(socks[i].path, path) == 0)
+            return 0;
+    }
+    if (dir)
+        mkdir(dir, 0770);
+
+    s = &socks[sock_count];
+    memset(s, 0, sizeof(*s));
+    s->fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (s->fd < 0)
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    unlink(path);
+    if (bind(s->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "Failed to bind %s: %s\n", path, strerror(errno));
+        close(s->fd);
+        return -1;
+    }
+    snprintf(s->path, sizeof(s->path), "%s", path);
+    sock_count++;
+    return 0;
+}
+
+/* Value of "<key>=" in a configuration file. ctrl_interface may be "DIR=<dir> GROUP=<group>" */
+static int read_conf_values(const char *fn, const char *key, char values[][SIM_CMD_LEN], int max) {
+    char line[SIM_LINE_LEN], *value;
+    size_t key_len = strlen(key);
+    int count = 0;
+    FILE *fp;
+
+    fp = fopen(fn, "r");
+    if (fp == NULL)
+        return 0;
+    while (fgets(line, sizeof(line), fp) && count < max) {
+        line[strcspn(line, "\r\n")] = 0;
+        if (strncmp(line, key, key_len) || line[key_len] != '=')
+            continue;
+        value = line + key_len + 1;
+        if (strncmp(value, "DIR=", 4) == 0) {
+            value += 4;
+            value[strcspn(value, " ")] = 0;
+        }
+        snprintf(values[count++], SIM_CMD_LEN, "%s", value);
+    }
+    fclose(fp);
+    return count;
+}
+
+static void handle_signal(int sig) {
+    (void) sig;
+    terminate = 1;
+}
+
+int main(int argc, char *argv[]) {
+    char ifnames[SIM_MAX_SOCKS][SIM_CMD_LEN], dirs[1][SIM_CMD_LEN], name[SIM_CMD_LEN + 8];
+    const char *pid_file = NULL, *log_file = NULL, *global = NULL, *conf = NULL, *ctrl_dir = NULL;
+    struct pollfd fds[SIM_MAX_SOCKS];
+    int c, i, j, count, if_count = 0, daemonize = 0;
+    FILE *fp;
+
+    hostapd = strstr(argv[0], "hostapd") != NULL;
+    opterr = 0;
+    /* Options of both daemons, the ones not needed here are ignored */
+    while ((c = getopt(argc, argv, "b:Bc:C:D:de:f:g:G:hi:I:KLMm:No:O:p:P:qsStTuvW")) != -1) {
+        switch (c) {
+        case 'B':
+            daemonize = 1;
+            break;
+        case 'c':
+            if (conf == NULL)
+                conf = optarg;
+            break;
+        case 'C':
+            ctrl_dir = optarg;
+            break;
+        case 'f':
+            log_file = optarg;
+            break;
+        case 'g':
+            global = optarg;
+            break;
+        case 'i':
+            if (if_count < SIM_MAX_SOCKS)
+                snprintf(ifnames[if_count++], SIM_CMD_LEN, "%s", optarg);
+            break;
+        case 'P':
+            pid_file = optarg;
+            break;
+        default:
+            break;
+        }
+    }
+
+    if (getenv("WPA_SIM_CONF") && load_rules(getenv("WPA_SIM_CONF")))
+        return 1;
+    add_builtin_rules();
+    if (log_file) {
+        log_fp = fopen(log_file, "a");
+    }
+
+    if (hostapd) {
+        /* The remaining arguments are the configuration files of the interfaces */
+        for (i = optind; i < argc; i++) {
+            if (read_conf_values(argv[i], "ctrl_interface", dirs, 1) == 0)
+                snprintf(dirs[0], SIM_CMD_LEN, "%s", HAPD_CTRL_PATH_DEFAULT);
+            count = read_conf_values(argv[i], "interface", ifnames, SIM_MAX_SOCKS);
+            count += read_conf_values(argv[i], "bss", ifnames + count, SIM_MAX_SOCKS - count);
+            for (j = 0; j < count; j++) {
+                if (open_ctrl_sock(dirs[0], ifnames[j]))
+                    return 1;
+            }
+        }
+    } else {
+        if (ctrl_dir == NULL) {
+            if (conf && read_conf_values(conf, "ctrl_interface", dirs, 1))
+                ctrl_dir = dirs[0];
+            else
+                ctrl_dir = WPAS_CTRL_PATH_DEFAULT;
+        }
+        for (i = 0; i < if_count; i++) {
+            snprintf(name, sizeof(name), "p2p-dev-%s", ifnames[i]);
+            if (open_ctrl_sock(ctrl_dir, ifnames[i]) || open_ctrl_sock(ctrl_dir, name))
+                return 1;
+        }
+    }
+    if (global && open_ctrl_sock(NULL, global))
+        return 1;
+    if (sock_count == 0) {
+        fprintf(stderr, "No control interface to simulate\n");
+        return 1;
+    }
+
+    /* Like the real daemons, return once the control interfaces are ready */
+    if (daemonize) {
+        if (fork() > 0)
+            return 0;
+        setsid();
+        i = open("/dev/null", O_RDWR);
+        if (i >= 0) {
+            dup2(i, 0);
+            dup2(i, 1);
+            dup2(i, 2);
+            if (i > 2)
+                close(i);
+        }
+    }
+    if (pid_file) {
+        fp = fopen(pid_file, "w");
+        if (fp) {
+            fprintf(fp, "%d\n", getpid());
+            fclose(fp);
+        }
+    }
+    signal(SIGTERM, handle_signal);
+    signal(SIGINT, handle_signal);
+    sim_log("%s simulator started with %d control interfaces", hostapd ? "hostapd" : "wpa_supplicant", sock_count);
+
+    for (i = 0; i < sock_count; i++) {
+        fds[i].fd = socks[i].fd;
+        fds[i].events = POLLIN;
+    }
+    while (!terminate) {
+        if (poll(fds, sock_count, next_timeout_ms()) > 0) {
+            for (i = 0; i < sock_count; i++) {
+                if (fds[i].revents & POLLIN)
+                    handle_command(i);
+            }
+        }
+        run_pending();
+    }
+
+    for (i = 0; i < sock_count; i++) {
+        close(socks[i].fd);
+        unlink(socks[i].path);
+    }
+    if (pid_file)
+        unlink(pid_file);
+    sim_log("simulator stopped");
+    return 0;
+}
@@ -0,0 +1,429 @@
+/* Copyright (c) 2020 Wi-Fi Alliance                                                */
+
+/* Permission to use, copy, modify, and/or distribute this software for any         */
+/* purpose with or without fee is hereby granted, provided that the above           */
+/* copyright notice and this permission notice appear in all copies.                */
+
+/* THE SOFTWARE IS PROVIDED 'AS IS' AND THE AUTHOR DISCLAIMS ALL                    */
+/* WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED                    */
+/* WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL                     */
+/* THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR                       */
+/* CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING                        */
+/* FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF                       */
+/* CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT                       */
+/* OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS                          */
+/* SOFTWARE. */
+
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "vendor_specific.h"
+#include "indigo_api.h"
+#include "utils.h"
+#include "wpa_ctrl.h"
+#include "wpas_config.h"
+
+static struct wpas_conf wpas_conf;
+
+/* Internal. Strip the leading spaces and the trailing line break */
+static char* wpas_conf_trim(char *line) {
+    char *end;
+
+    while (*line == ' ' || *line == '\t') {
+        line++;
+    }
+    end = line + strlen(line);
+    while (end > line && (end[-1] == '\n' || end[-1] == '\r' || end[-1] == ' ' || end[-1] == '\t')) {
+        *--end = '\0';
+    }
+    return line;
+}
+
+/* Internal. Replace the value of the existing key or append the new key */
+static int wpas_conf_set_item(struct wpas_conf_item *items, int *count, char *key, char *value) {
+    int i;
+
+    if (!key || !value || strlen(key) >= WPAS_CONF_KEY_LEN || strlen(value) >= WPAS_CONF_VALUE_LEN) {
+        indigo_logger(LOG_LEVEL_ERROR, "Invalid wpa_supplicant config item %s", key ? key : "(null)");
+        return -1;
+    }
+
+    for (i = 0; i < *count; i++) {
+        if (strcmp(items[i].key, key) == 0) {
+            snprintf(items[i].value, sizeof(items[i].value), "%s", value);
+            return 0;
+        }
+    }
+
+    if (*count >= WPAS_CONF_MAX_ITEMS) {
+        indigo_logger(LOG_LEVEL_ERROR, "Too many wpa_supplicant config items. Drop %s", key);
+        return -1;
+    }
+    snprintf(items[*count].key, sizeof(items[*count].key), "%s", key);
+    snprintf(items[*count].value, sizeof(items[*count].value), "%s", value);
+    (*count)++;
+    return 0;
+}
+
+static char* wpas_conf_get_item(struct wpas_conf_item *items, int count, char *key) {
+    int i;
+
+    for (i = 0; i < count; i++) {
+        if (strcmp(items[i].key, key) == 0) {
+            return items[i].value;
+        }
+    }
+    return NULL;
+}
+
+/* Internal. Map the network id used by wpa_supplicant to the block index */
+static struct wpas_conf_block* wpas_conf_find_network(int network_id) {
+    int i, id = 0;
+
+    for (i = 0; i < wpas_conf.block_count; i++) {
+        if (strcmp(wpas_conf.blocks[i].type, WPAS_CONF_BLOCK_NETWORK) == 0) {
+            if (id == network_id) {
+                return &wpas_conf.blocks[i];
+            }
+            id++;
+        }
+    }
+    return NULL;
+}
+
+/* Start an empty model. It isn't in sync with the file until it is saved. */
+void wpas_conf_reset() {
+    memset(&wpas_conf, 0, sizeof(wpas_conf));
+}
+
+int wpas_conf_is_loaded() {
+    return wpas_conf.loaded;
+}
+
+/* Build the model from the content of a wpa_supplicant configuration */
+int wpas_conf_parse(char *buffer) {
+    char *line, *next, *ptr, *value;
+    struct wpas_conf_block *block = NULL;
+
+    memset(&wpas_conf, 0, sizeof(wpas_conf));
+    if (!buffer) {
+        return -1;
+    }
+
+    for (line = buffer; line && *line; line = next) {
+        char text[WPAS_CONF_KEY_LEN + WPAS_CONF_VALUE_LEN];
+        size_t len;
+
+        next = strchr(line, '\n');
+        len = next ? (size_t)(next - line) : strlen(line);
+        if (next) {
+            next++;
+        }
+        if (len >= sizeof(text)) {
+            indigo_logger(LOG_LEVEL_ERROR, "wpa_supplicant config line is too long");
+            return -1;
+        }
+        memcpy(text, line, len);
+        text[len] = '\0';
+
+        ptr = wpas_conf_trim(text);
+        if (*ptr == '\0' || *ptr == '#') {
+            continue;
+        }
+
+        if (strcmp(ptr, "}") == 0) {
+            block = NULL;
+            continue;
+        }
+
+        len = strlen(ptr);
+        if (len > 2 && strcmp(ptr + len - 2, "={") == 0) {
+            if (block || wpas_conf.block_count >= WPAS_CONF_MAX_BLOCKS) {
+                indigo_logger(LOG_LEVEL_ERROR, "Unable to add the wpa_supplicant config block %s", ptr);
+                return -1;
+            }
+            block = &wpas_conf.blocks[wpas_conf.block_count++];
+            ptr[len - 2] = '\0';
+            snprintf(block->type, sizeof(block->type), "%s", ptr);
+            continue;
+        }
+
+        value = strchr(ptr, '=');
+        if (!value) {
+            continue;
+        }
+        *value++ = '\0';
+        if (block) {
+            if (wpas_conf_set_item(block->items, &block->item_count, ptr, value)) {
+                return -1;
+            }
+        } else if (wpas_conf_set_item(wpas_conf.global, &wpas_conf.global_count, ptr, value)) {
+            return -1;
+        }
+    }
+
+    wpas_conf.loaded = 1;
+    return 0;
+}
+
+/* Load the model from the file. Only used when the model isn't in sync. */
+int wpas_conf_load(char *path) {
+    char *buffer;
+    int ret;
+
+    buffer = read_file(path);
+    if (!buffer) {
+        indigo_logger(LOG_LEVEL_ERROR, "Failed to read %s", path);
+        return -1;
+    }
+    ret = wpas_conf_parse(buffer);
+    free(buffer);
+    return ret;
+}
+
+int wpas_conf_serialize(char *buffer, int buffer_size) {
+    int i, j, len = 0, ret;
+
+    for (i = 0; i < wpas_conf.global_count; i++) {
+        ret = snprintf(buffer + len, buffer_size - len, "%s=%s\n",
+                       wpas_conf.global[i].key, wpas_conf.global[i].value);
+        if (ret < 0 || ret >= buffer_size - len) {
+            return -1;
+        }
+        len += ret;
+    }
+
+    for (i = 0; i < wpas_conf.block_count; i++) {
+        ret = snprintf(buffer + len, buffer_size - len, "%s={\n", wpas_conf.blocks[i].type);
+        if (ret < 0 || ret >= buffer_size - len) {
+            return -1;
+        }
+        len += ret;
+        for (j = 0; j < wpas_conf.blocks[i].item_count; j++) {
+            ret = snprintf(buffer + len, buffer_size - len, "%s=%s\n",
+                           wpas_conf.blocks[i].items[j].key, wpas_conf.blocks[i].items[j].value);
+            if (ret < 0 || ret >= buffer_size - len) {
+                return -1;
+            }
+            len += ret;
+        }
+        ret = snprintf(buffer + len, buffer_size - len, "}\n");
+        if (ret < 0 || ret >= buffer_size - len) {
+            return -1;
+        }
+        len += ret;
+    }
+
+    return len;
+}
+
+/* Serialize the model and write the file once */
+int wpas_conf_save(char *path) {
+    char buffer[L_BUFFER_LEN];
+    int len;
+
+    memset(buffer, 0, sizeof(buffer));
+    len = wpas_conf_serialize(buffer, sizeof(buffer));
+    if (len < 0) {
+        indigo_logger(LOG_LEVEL_ERROR, "wpa_supplicant config is larger than %d bytes", (int)sizeof(buffer));
+        return -1;
+    }
+    if (write_file(path, buffer, len)) {
+        return -1;
+    }
+    wpas_conf.loaded = 1;
+    return 0;
+}
+
+int wpas_conf_set_global(char *key, char *value) {
+    return wpas_conf_set_item(wpas_conf.global, &wpas_conf.global_count, key, value);
+}
+
+char* wpas_conf_get_global(char *key) {
+    return wpas_conf_get_item(wpas_conf.global, wpas_conf.global_count, key);
+}
+
+/* Return the network id of the new network block */
+int wpas_conf_add_network() {
+    struct wpas_conf_block *block;
+
+    if (wpas_conf.block_count >= WPAS_CONF_MAX_BLOCKS) {
+        return -1;
+    }
+    block = &wpas_conf.blocks[wpas_conf.block_count++];
+    memset(block, 0, sizeof(*block));
+    snprintf(block->type, sizeof(block->type), "%s", WPAS_CONF_BLOCK_NETWORK);
+    return wpas_conf_get_network_count() - 1;
+}
+
+int wpas_conf_get_network_count() {
+    int i, count = 0;
+
+    for (i = 0; i < wpas_conf.block_count; i++) {
+        if (strcmp(wpas_conf.blocks[i].type, WPAS_CONF_BLOCK_NETWORK) == 0) {
+            count++;
+        }
+    }
+    return count;
+}
+
+int wpas_conf_set_network(int network_id, char *key, char *value) {
+    struct wpas_conf_block *block = wpas_conf_find_network(network_id);
+
+    if (!block) {
+        return -1;
+    }
+    return wpas_conf_set_item(block->items, &block->item_count, key, value);
+}
+
+char* wpas_conf_get_network(int network_id, char *key) {
+    struct wpas_conf_block *block = wpas_conf_find_network(network_id);
+
+    if (!block) {
+        return NULL;
+    }
+    return wpas_conf_get_item(block->items, block->item_count, key);
+}
+
+/* Internal. Send SET_NETWORK for one item over the opened control interface */
+static int wpas_conf_send_network_item(struct wpa_ctrl *w, int network_id, struct wpas_conf_item *item) {
+    char buffer[S_BUFFER_LEN], response[S_BUFFER_LEN];
+    size_t resp_len;
+
+    memset(response, 0, sizeof(response));
+    snprintf(buffer, sizeof(buffer), "SET_NETWORK %d %s %s", network_id, item->key, item->value);
+    resp_len = sizeof(response) - 1;
+    wpa_ctrl_request(w, buffer, strlen(buffer), response, &resp_len, NULL);
+    if (strncmp(response, WPA_CTRL_OK, strlen(WPA_CTRL_OK)) != 0) {
+        indigo_logger(LOG_LEVEL_ERROR, "Failed to execute the command %s. Response: %s", buffer, response);
+        return -1;
+    }
+    return 0;
+}
+
+/* Push one item (or the whole block if key is NULL) of a network to the running wpa_supplicant */
+int wpas_conf_push_network(char *ctrl_path, int network_id, char *key) {
+    struct wpas_conf_block *block = wpas_conf_find_network(network_id);
+    struct wpa_ctrl *w = NULL;
+    int i, ret = 0;
+
+    if (!block) {
+        return -1;
+    }
+
+    w = wpa_ctrl_open(ctrl_path);
+    if (!w) {
+        indigo_logger(LOG_LEVEL_ERROR, "Failed to connect to wpa_supplicant");
+        return -1;
+    }
+    for (i = 0; i < block->item_count; i++) {
+        if (key && strcmp(block->items[i].key, key)) {
+            continue;
+        }
+        if (wpas_conf_send_network_item(w, network_id, &block->items[i])) {
+            ret = -1;
+        }
+    }
+    wpa_ctrl_close(w);
+    return ret;
+}
+
+int wpas_conf_push_all_networks(char *ctrl_path, char *key) {
+    int i, count, ret = 0;
+
+    count = wpas_conf_get_network_count();
+    for (i = 0; i < count; i++) {
+        if (wpas_conf_push_network(ctrl_path, i, key)) {
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+/* Write the configuration generated by the handlers and keep the model in sync */
+int wpas_conf_write_buffer(char *path, char *buffer) {
+    if (wpas_conf_parse(buffer)) {
+        indigo_logger(LOG_LEVEL_WARNING, "Unable to model the wpa_supplicant config. Reload it on the next change");
+        memset(&wpas_conf, 0, sizeof(wpas_conf));
+    }
+    return write_file(path, buffer, strlen(buffer));
+}
+
+/* Set key=value in every network block by editing the file text. Used when the
+ * config doesn't fit the model; the model stays unloaded and is reloaded on the
+ * next change. Also push the item to the running wpa_supplicant if ctrl_path is
+ * set; as for the model, only the file write decides the result. */
+int wpas_conf_edit_networks(char *path, char *ctrl_path, char *key, char *value) {
+    char *buffer, *output, *line, *next, *ptr;
+    size_t key_len = strlen(key), value_len = strlen(value), len, out_len = 0, out_size;
+    int in_network = 0, network_id = 0, ret, i;
+    struct wpas_conf_item item;
+    struct wpa_ctrl *w = NULL;
+
+    memset(&wpas_conf, 0, sizeof(wpas_conf));
+
+    buffer = read_file(path);
+    if (!buffer) {
+        indigo_logger(LOG_LEVEL_ERROR, "Failed to read %s", path);
+        return -1;
+    }
+
+    /* The replaced lines only shrink the output. Reserve one new line per block. */
+    out_size = strlen(buffer) + 1;
+    for (ptr = buffer; (ptr = strchr(ptr, '}')) != NULL; ptr++) {
+        out_size += key_len + value_len + 2;
+    }
+    output = malloc(out_size);
+    if (!output) {
+        free(buffer);
+        return -1;
+    }
+
+    for (line = buffer; *line; line = next) {
+        next = strchr(line, '\n');
+        next = next ? next + 1 : line + strlen(line);
+        len = next - line;
+
+        ptr = line;
+        while (*ptr == ' ' || *ptr == '\t') {
+            ptr++;
+        }
+        if (in_network && strncmp(ptr, key, key_len) == 0 && ptr[key_len] == '=') {
+            /* Drop the old value. The new one is written at the end of the block. */
+            continue;
+        }
+        if (in_network && *ptr == '}') {
+            out_len += snprintf(output + out_len, out_size - out_len, "%s=%s\n", key, value);
+            in_network = 0;
+            network_id++;
+        } else if (!in_network && strncmp(ptr, WPAS_CONF_BLOCK_NETWORK "={", strlen(WPAS_CONF_BLOCK_NETWORK "={")) == 0) {
+            in_network = 1;
+        }
+        memcpy(output + out_len, line, len);
+        out_len += len;
+    }
+    output[out_len] = '\0';
+    free(buffer);
+
+    indigo_logger(LOG_LEVEL_DEBUG, "insert config: %s=%s into %d networks of %s", key, value, network_id, path);
+    ret = write_file(path, output, out_len);
+    free(output);
+
+    if (ctrl_path && network_id) {
+        w = wpa_ctrl_open(ctrl_path);
+        if (!w) {
+            indigo_logger(LOG_LEVEL_ERROR, "Failed to connect to wpa_supplicant");
+            return ret;
+        }
+        memset(&item, 0, sizeof(item));
+        snprintf(item.key, sizeof(item.key), "%s", key);
+        snprintf(item.value, sizeof(item.value), "%s", value);
+        for (i = 0; i < network_id; i++) {
+            wpas_conf_send_network_item(w, i, &item);
+        }
+        wpa_ctrl_close(w);
+    }
+    return ret;
+}
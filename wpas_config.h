@@ -0,0 +1,77 @@
+/* Copyright (c) 2020 Wi-Fi Alliance                                                */
+
+/* Permission to use, copy, modify, and/or distribute this software for any         */
+/* purpose with or without fee is hereby granted, provided that the above           */
+/* copyright notice and this permission notice appear in all copies.                */
+
+/* THE SOFTWARE IS PROVIDED 'AS IS' AND THE AUTHOR DISCLAIMS ALL                    */
+/* WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED                    */
+/* WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL                     */
+/* THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR                       */
+/* CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING                        */
+/* FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF                       */
+/* CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT                       */
+/* OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS                          */
+/* SOFTWARE. */
+
+
+#ifndef _WPAS_CONFIG_
+#define _WPAS_CONFIG_  1
+
+/* In-memory model of the wpa_supplicant configuration file.
+ * The global section and every "xxx={ ... }" block (network, cred) are kept
+ * as ordered key/value lists. Handlers change the model and serialize it once,
+ * or push network changes to a running wpa_supplicant with SET_NETWORK.
+ */
+
+#define WPAS_CONF_MAX_ITEMS         48
+#define WPAS_CONF_MAX_BLOCKS        4
+#define WPAS_CONF_KEY_LEN           64
+#define WPAS_CONF_VALUE_LEN         256
+#define WPAS_CONF_BLOCK_TYPE_LEN    16
+
+#define WPAS_CONF_BLOCK_NETWORK     "network"
+
+struct wpas_conf_item {
+    char key[WPAS_CONF_KEY_LEN];
+    char value[WPAS_CONF_VALUE_LEN];
+};
+
+struct wpas_conf_block {
+    char type[WPAS_CONF_BLOCK_TYPE_LEN];
+    int item_count;
+    struct wpas_conf_item items[WPAS_CONF_MAX_ITEMS];
+};
+
+struct wpas_conf {
+    int loaded;
+    int global_count;
+    struct wpas_conf_item global[WPAS_CONF_MAX_ITEMS];
+    int block_count;
+    struct wpas_conf_block blocks[WPAS_CONF_MAX_BLOCKS];
+};
+
+/* Model API */
+void wpas_conf_reset();
+int wpas_conf_is_loaded();
+int wpas_conf_parse(char *buffer);
+int wpas_conf_load(char *path);
+int wpas_conf_serialize(char *buffer, int buffer_size);
+int wpas_conf_save(char *path);
+int wpas_conf_set_global(char *key, char *value);
+char* wpas_conf_get_global(char *key);
+int wpas_conf_add_network();
+int wpas_conf_get_network_count();
+int wpas_conf_set_network(int network_id, char *key, char *value);
+char* wpas_conf_get_network(int network_id, char *key);
+
+/* Runtime API. Push the model to a running wpa_supplicant */
+int wpas_conf_push_network(char *ctrl_path, int network_id, char *key);
+int wpas_conf_push_all_networks(char *ctrl_path, char *key);
+
+/* Write the buffer generated by the handlers and keep the model in sync */
+int wpas_conf_write_buffer(char *path, char *buffer);
+
+/* Edit the network blocks in the file text when the config doesn't fit the model */
+int wpas_conf_edit_networks(char *path, char *ctrl_path, char *key, char *value);
+#endif /* _WPAS_CONFIG_ */
@@ -54,6 +54,17 @@ int configured_interface_count = 0;
 struct interface_info interfaces[16];
 int band_mbssid_cnt[16];
 struct interface_info* default_interface;
+/* Loopback timer state. The main tree uses the traffic engine instead */
+struct loopback_info {
+    int sock;
+    double rate;
+    int pkt_sent;
+    int pkt_rcv;
+    int pkt_type;
+    int pkt_size;
+    char target_ip[64];
+    char message[1600];
+};
 static struct loopback_info loopback;
 /* bridge used for wireless interfaces */
 char wlans_bridge[32];
@@ -414,21 +425,26 @@ void send_continuous_loopback_packet(void *eloop_ctx, void *sock_ctx) {
 }
 
 /* Stop to send continuous loopback data */
-int stop_loopback_data(int *pkt_sent)
+int stop_loopback_data(struct traffic_stats *stats)
 {
+    if (stats)
+        memset(stats, 0, sizeof(*stats));
     if (loopback.sock <= 0)
         return 0;
 
     qt_eloop_cancel_timeout(send_continuous_loopback_packet, &loopback, NULL);
     close(loopback.sock);
     loopback.sock = 0;
-    if (pkt_sent)
-        *pkt_sent = loopback.pkt_sent;
+    if (stats) {
+        stats->sent = loopback.pkt_sent;
+        stats->received = loopback.pkt_rcv;
+        stats->lost = loopback.pkt_sent - loopback.pkt_rcv;
+    }
 
     return loopback.pkt_rcv;
 }
 
-int send_udp_data(char *target_ip, int target_port, int packet_count, int packet_size, double rate) {
+int send_udp_data(char *target_ip, int target_port, char *bind_ifname, int packet_count, int packet_size, double rate, struct traffic_stats *stats) {
     int s = 0, i = 0;
     struct sockaddr_in addr;
     int pkt_sent = 0, pkt_rcv = 0;
@@ -437,6 +453,9 @@ int send_udp_data(char *target_ip, int target_port, int packet_count, int packet
     ssize_t recv_len = 0, send_len = 0;
     struct timeval timeout;
 
+    /* The Zephyr port keeps its own interface choice */
+    (void)bind_ifname;
+
     /* Open UDP socket */
     s = socket(PF_INET, SOCK_DGRAM, 0);
     if (s < 0) {
@@ -528,11 +547,17 @@ int send_udp_data(char *target_ip, int target_port, int packet_count, int packet
         indigo_logger(LOG_LEVEL_INFO, "Receive echo %d bytes data", recv_len);
     }
     close(s);
+    if (stats) {
+        memset(stats, 0, sizeof(*stats));
+        stats->sent = packet_count;
+        stats->received = pkt_rcv;
+        stats->lost = packet_count - pkt_rcv;
+    }
 
     return pkt_rcv;
 }
 
-int send_icmp_data(char *target_ip, int packet_count, int packet_size, double rate)
+int send_icmp_data(char *target_ip, char *bind_ifname, int packet_count, int packet_size, double rate, struct traffic_stats *stats)
 {
     int n, sock;
     size_t i;
@@ -545,6 +570,9 @@ int send_icmp_data(char *target_ip, int packet_count, int packet_size, double ra
     struct timeval timeout;
     int pkt_sent = 0, pkt_rcv = 0;
 
+    /* The Zephyr port keeps its own interface choice */
+    (void)bind_ifname;
+
 	sock = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP);
 	if (sock < 0) {
         return -1;
@@ -635,6 +663,12 @@ int send_icmp_data(char *target_ip, int packet_count, int packet_size, double ra
     }
 
     close(sock);
+    if (stats) {
+        memset(stats, 0, sizeof(*stats));
+        stats->sent = packet_count;
+        stats->received = pkt_rcv;
+        stats->lost = packet_count - pkt_rcv;
+    }
     return pkt_rcv;
 }
 